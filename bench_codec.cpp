@@ -0,0 +1,533 @@
+// Microbenchmarks of the RESP codec, the CPU cost paid on every UDF call.
+//
+// Encodes commands with resp_encoder (the zero-copy path of single
+// commands) and RedisPipeline (the copying path of batches), and parses
+// replies with resp_reader the way RedisClient consumes them, all without
+// sockets or a server.  Value sizes run from 8 B to 1 MB and multibulk
+// widths from 1 to 10000.  Each case reports ns/op, MB/s and heap
+// allocations per op.  Files given with -i hold raw reply bytes as a
+// server sent them (e.g. a raw "follow TCP stream" export) and are replayed
+// through the parser one reply at a time.
+//
+// The output of one run is the baseline for the next: -B compares against
+// it and exits with status 1 when a case got more than -T percent slower
+// or allocates more than it did.
+//
+//   g++ -O2 -o bench_codec bench_codec.cpp anet.c redis_protocol.cpp
+//       redis_client.cpp redis_breaker.cpp -lboost_system
+//   ./bench_codec > codec.base
+//   ./bench_codec -B codec.base
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "redis_client.h"
+#include "redis_protocol.h"
+
+// Heap allocations are counted by interposing the C allocator, which
+// operator new also goes through.  Only possible with glibc.
+#ifdef __GLIBC__
+extern "C" void * __libc_malloc(size_t);
+extern "C" void * __libc_calloc(size_t, size_t);
+extern "C" void * __libc_realloc(void *, size_t);
+extern "C" void   __libc_free(void *);
+
+static unsigned long long allocations = 0;
+static const bool counting_allocations = true;
+
+extern "C" void * malloc(size_t n) throw() { ++allocations; return __libc_malloc(n); }
+extern "C" void * calloc(size_t n, size_t m) throw() { ++allocations; return __libc_calloc(n, m); }
+extern "C" void * realloc(void * p, size_t n) throw() { ++allocations; return __libc_realloc(p, n); }
+extern "C" void   free(void * p) throw() { __libc_free(p); }
+#else
+static unsigned long long allocations = 0;
+static const bool counting_allocations = false;
+#endif
+
+// Results go here so the compiler cannot drop the work.
+static volatile size_t sink;
+
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class codec_case
+{
+public:
+  codec_case(const std::string & name, size_t bytes) : name_(name), bytes_(bytes), per_pass_(1) {}
+  virtual ~codec_case() {}
+
+  const std::string & name() const { return name_; }
+  // payload bytes per op, for MB/s
+  size_t              bytes() const { return bytes_; }
+  // ops done by one call of pass()
+  size_t              per_pass() const { return per_pass_; }
+
+  virtual void        pass() = 0;
+
+protected:
+  std::string name_;
+  size_t      bytes_;
+  size_t      per_pass_;
+};
+
+static std::string case_name(const char * what, size_t n)
+{
+  char buf[96];
+  snprintf(buf, sizeof(buf), "%s/%lu", what, (unsigned long)n);
+  return buf;
+}
+
+// ---- encoding ----
+
+// One command through resp_encoder.  With an fd the encoded command is
+// flushed to it (writev(2) to /dev/null), otherwise only framed.
+class encode_case : public codec_case
+{
+public:
+  encode_case(const std::string & name, const std::vector<std::string> & argv, int fd)
+    : codec_case(name, 0), args_(argv), fd_(fd)
+  {
+    for (size_t i = 0; i < args_.size(); ++i)
+    {
+      refs_.push_back(string_ref(args_[i]));
+      bytes_ += args_[i].size();
+    }
+  }
+
+  void pass()
+  {
+    enc_.begin(refs_.size());
+    for (size_t i = 0; i < refs_.size(); ++i)
+      enc_.arg(refs_[i]);
+    if (fd_ >= 0)
+      enc_.flush(fd_);
+    else
+    {
+      sink += enc_.size();
+      enc_.clear();
+    }
+  }
+
+private:
+  std::vector<std::string> args_;
+  string_ref_vector        refs_;
+  int                      fd_;
+  resp_encoder             enc_;
+};
+
+// One command queued on a RedisPipeline, which copies the arguments.
+class pipeline_case : public codec_case
+{
+public:
+  pipeline_case(const std::string & name, const std::vector<std::string> & argv)
+    : codec_case(name, 0), args_(argv)
+  {
+    for (size_t i = 0; i < args_.size(); ++i)
+    {
+      refs_.push_back(string_ref(args_[i]));
+      bytes_ += args_[i].size();
+    }
+  }
+
+  void pass()
+  {
+    pipeline_.command(refs_);
+    sink += pipeline_.bytes();
+    pipeline_.clear();
+  }
+
+private:
+  std::vector<std::string> args_;
+  string_ref_vector        refs_;
+  RedisPipeline            pipeline_;
+};
+
+// ---- parsing ----
+
+// Feeds a byte stream to a resp_reader in segments of at most segment
+// bytes (0: as much as the buffer takes, like one recv(2)) and consumes
+// every reply as RedisClient does: bulk payloads and multi bulk elements
+// as views (bulk_ref_vector), or copied (string_type, string_vector).
+class parse_case : public codec_case
+{
+public:
+  parse_case(const std::string & name, const std::string & stream, size_t segment, bool copy)
+    : codec_case(name, stream.size()), stream_(stream), segment_(segment), copy_(copy), replies_(0)
+  {
+    pass();
+    per_pass_ = replies_ ? replies_ : 1;
+    bytes_    = stream_.size() / per_pass_;
+  }
+
+  void pass()
+  {
+    replies_ = 0;
+    size_t pos = 0;
+    while (pos < stream_.size())
+    {
+      size_t avail;
+      char * p = reader_.write_space(avail);
+      size_t n = std::min(avail, stream_.size() - pos);
+      if (segment_ && n > segment_)
+        n = segment_;
+      memcpy(p, stream_.data() + pos, n);
+      reader_.wrote(n);
+      pos += n;
+
+      resp_reader::status st;
+      while ((st = reader_.parse()) == resp_reader::complete)
+      {
+        consume_reply_();
+        reader_.consume();
+        ++replies_;
+      }
+      if (st == resp_reader::invalid)
+      {
+        fprintf(stderr, "%s: invalid RESP at byte %lu\n", name_.c_str(), (unsigned long)pos);
+        exit(1);
+      }
+    }
+  }
+
+private:
+  void consume_reply_()
+  {
+    const resp_value * node = reader_.nodes();
+    if (node->type == '*' && !node->nil && !copy_)
+    {
+      // recv_multi_bulk_reply_(bulk_ref_vector &)
+      views_.resize(node->integer);
+      for (long long i = 0; i < node->integer; ++i)
+      {
+        const resp_value & e = node[i + 1];
+        views_[i] = e.nil ? bulk_ref() : bulk_ref(reader_.text(e));
+      }
+      sink += views_.size();
+    }
+    else if (node->type == '*' && !node->nil)
+    {
+      // recv_multi_bulk_reply_(): resize so the strings keep their capacity
+      strings_.resize(node->integer);
+      for (long long i = 0; i < node->integer; ++i)
+      {
+        const resp_value & e = node[i + 1];
+        if (e.nil)
+          strings_[i] = missing_value;
+        else
+        {
+          string_ref data = reader_.text(e);
+          strings_[i].assign(data.data, data.size);
+        }
+      }
+      sink += strings_.size();
+    }
+    else if (node->type == '$' || node->type == '+' || node->type == '-')
+    {
+      string_ref data = node->nil ? string_ref(missing_value) : reader_.text(*node);
+      if (copy_)
+      {
+        string_.assign(data.data, data.size);
+        sink += string_.size();
+      }
+      else
+        sink += data.size;
+    }
+    else
+      sink += node->integer;
+  }
+
+  std::string              stream_;
+  size_t                   segment_;
+  bool                     copy_;
+  size_t                   replies_;
+  resp_reader              reader_;
+  std::string              string_;
+  std::vector<std::string> strings_;
+  bulk_ref_vector          views_;
+};
+
+// parse_integer() on the digits of a RESP header or integer reply.
+class integer_case : public codec_case
+{
+public:
+  integer_case() : codec_case("parse_integer", 10), digits_("1234567890") {}
+
+  void pass()
+  {
+    long long n;
+    parse_integer(digits_.data(), digits_.size(), n);
+    sink += n;
+  }
+
+private:
+  std::string digits_;
+};
+
+// ---- inputs ----
+
+static std::string value_of(size_t size)
+{
+  std::string v(size, 'x');
+  for (size_t i = 0; i < size; ++i)
+    v[i] = "0123456789abcdef\r\n$*"[i % 20];   // framing bytes inside the payload
+  return v;
+}
+
+static std::string field_of(size_t i)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "field:%05lu", (unsigned long)i);
+  return buf;
+}
+
+static void bulk(std::string & out, const std::string & v)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "$%lu\r\n", (unsigned long)v.size());
+  out += buf;
+  out += v;
+  out += "\r\n";
+}
+
+// HMGET reply of width elements of 16 bytes, every 8th one nil.
+static std::string multibulk_reply(size_t width)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "*%lu\r\n", (unsigned long)width);
+  std::string out = buf;
+  for (size_t i = 0; i < width; ++i)
+    if (i % 8 == 7)
+      out += "$-1\r\n";
+    else
+      bulk(out, value_of(16));
+  return out;
+}
+
+static bool read_file(const char * path, std::string & out)
+{
+  FILE * f = fopen(path, "rb");
+  if (!f)
+    return false;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    out.append(buf, n);
+  fclose(f);
+  return true;
+}
+
+// ---- running ----
+
+struct result
+{
+  double ns;
+  double allocs;
+};
+
+// Runs c for at least min_ms, after a calibration that grows the pass
+// count until a batch takes a tenth of that.
+static result measure(codec_case & c, int min_ms)
+{
+  unsigned long long target = min_ms * 1000000ULL;
+  unsigned long long passes = 1;
+  for (;;)
+  {
+    unsigned long long t0 = now_ns();
+    for (unsigned long long i = 0; i < passes; ++i)
+      c.pass();
+    unsigned long long spent = now_ns() - t0;
+    if (spent >= target / 10)
+    {
+      passes = std::max<unsigned long long>(passes, passes * target / (spent ? spent : 1));
+      break;
+    }
+    passes *= spent < target / 1000 ? 16 : 2;
+  }
+
+  unsigned long long a0 = allocations;
+  unsigned long long t0 = now_ns();
+  for (unsigned long long i = 0; i < passes; ++i)
+    c.pass();
+  unsigned long long spent = now_ns() - t0;
+  unsigned long long allocated = allocations - a0;
+
+  double ops = double(passes) * c.per_pass();
+  result r;
+  r.ns     = spent / ops;
+  r.allocs = allocated / ops;
+  return r;
+}
+
+static const size_t value_sizes[] = { 8, 64, 512, 4096, 32768, 262144, 1048576 };
+static const size_t widths[]      = { 1, 10, 100, 1000, 10000 };
+
+static void build_cases(std::vector<codec_case *> & cases, size_t segment, int null_fd,
+                        const std::vector<const char *> & inputs)
+{
+  for (size_t i = 0; i < sizeof(value_sizes) / sizeof(value_sizes[0]); ++i)
+  {
+    size_t size = value_sizes[i];
+    std::vector<std::string> argv;
+    argv.push_back("HSET");
+    argv.push_back("user:1000");
+    argv.push_back("name");
+    argv.push_back(value_of(size));
+    cases.push_back(new encode_case(case_name("encode/hset", size), argv, -1));
+    if (null_fd >= 0)
+      cases.push_back(new encode_case(case_name("encode+writev/hset", size), argv, null_fd));
+    cases.push_back(new pipeline_case(case_name("pipeline/hset", size), argv));
+
+    std::string reply;
+    bulk(reply, value_of(size));
+    cases.push_back(new parse_case(case_name("parse/bulk", size), reply, segment, false));
+    cases.push_back(new parse_case(case_name("parse/bulk-copy", size), reply, segment, true));
+  }
+
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i)
+  {
+    size_t width = widths[i];
+    std::vector<std::string> argv;
+    argv.push_back("HMGET");
+    argv.push_back("user:1000");
+    for (size_t f = 0; f < width; ++f)
+      argv.push_back(field_of(f));
+    cases.push_back(new encode_case(case_name("encode/hmget", width), argv, -1));
+    cases.push_back(new parse_case(case_name("parse/multibulk", width), multibulk_reply(width), segment, false));
+    cases.push_back(new parse_case(case_name("parse/multibulk-copy", width), multibulk_reply(width), segment, true));
+  }
+
+  cases.push_back(new parse_case("parse/status", "+OK\r\n", segment, false));
+  cases.push_back(new parse_case("parse/integer", ":1234567890\r\n", segment, false));
+  cases.push_back(new integer_case());
+
+  for (size_t i = 0; i < inputs.size(); ++i)
+  {
+    std::string stream;
+    if (!read_file(inputs[i], stream) || stream.empty())
+    {
+      fprintf(stderr, "cannot read %s\n", inputs[i]);
+      exit(2);
+    }
+    const char * base = strrchr(inputs[i], '/');
+    cases.push_back(new parse_case(std::string("replay/") + (base ? base + 1 : inputs[i]), stream, segment, false));
+  }
+}
+
+// Reads the results of an earlier run: "name ns/op MB/s allocs/op" lines.
+static std::map<std::string, result> read_baseline(const char * path)
+{
+  std::map<std::string, result> baseline;
+  FILE * f = fopen(path, "r");
+  if (!f)
+  {
+    fprintf(stderr, "cannot read %s\n", path);
+    exit(2);
+  }
+  char line[512], name[256];
+  double ns, mbs, allocs;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "%255s %lf %lf %lf", name, &ns, &mbs, &allocs) == 4)
+    {
+      result r;
+      r.ns = ns;
+      r.allocs = allocs;
+      baseline[name] = r;
+    }
+  fclose(f);
+  return baseline;
+}
+
+static void usage()
+{
+  fprintf(stderr,
+    "usage: bench_codec [options]\n"
+    "  -f substring     run only the cases whose name contains it\n"
+    "  -m ms            minimum time per case (default 200)\n"
+    "  -s bytes         feed the parser at most this much at a time, e.g. 1448\n"
+    "                   for one TCP segment (default: as much as fits)\n"
+    "  -i file          replay raw reply bytes from file; may be repeated\n"
+    "  -B file          compare with an earlier run saved in file\n"
+    "  -T percent       slowdown that counts as a regression with -B (default 20)\n");
+  exit(2);
+}
+
+int main(int argc, char ** argv)
+{
+  const char * filter = NULL;
+  const char * baseline_path = NULL;
+  int min_ms = 200;
+  size_t segment = 0;
+  double tolerance = 20;
+  std::vector<const char *> inputs;
+  int c;
+  while ((c = getopt(argc, argv, "f:m:s:i:B:T:")) != -1)
+  {
+    switch (c)
+    {
+    case 'f': filter        = optarg; break;
+    case 'm': min_ms        = atoi(optarg); break;
+    case 's': segment       = atol(optarg); break;
+    case 'i': inputs.push_back(optarg); break;
+    case 'B': baseline_path = optarg; break;
+    case 'T': tolerance     = atof(optarg); break;
+    default:  usage();
+    }
+  }
+  if (min_ms < 1 || tolerance < 0)
+    usage();
+
+  std::map<std::string, result> baseline;
+  if (baseline_path)
+    baseline = read_baseline(baseline_path);
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  std::vector<codec_case *> cases;
+  build_cases(cases, segment, null_fd, inputs);
+
+  printf("%-28s %12s %10s %10s", "case", "ns/op", "MB/s", "allocs/op");
+  if (baseline_path)
+    printf(" %12s %8s", "base ns/op", "change");
+  printf("\n");
+
+  int regressions = 0;
+  for (size_t i = 0; i < cases.size(); ++i)
+  {
+    codec_case & k = *cases[i];
+    if (filter && k.name().find(filter) == std::string::npos)
+      continue;
+    result r = measure(k, min_ms);
+    double mbs = r.ns > 0 ? k.bytes() * 1e3 / r.ns : 0;
+    printf("%-28s %12.1f %10.1f %10.2f", k.name().c_str(), r.ns, mbs,
+           counting_allocations ? r.allocs : -1.0);
+
+    std::map<std::string, result>::const_iterator base = baseline.find(k.name());
+    if (base != baseline.end())
+    {
+      double change = (r.ns / base->second.ns - 1) * 100;
+      bool worse = change > tolerance
+                   || (counting_allocations && r.allocs > base->second.allocs + 0.005);
+      printf(" %12.1f %+7.1f%%%s", base->second.ns, change, worse ? "  REGRESSION" : "");
+      regressions += worse;
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+  for (size_t i = 0; i < cases.size(); ++i)
+    delete cases[i];
+  if (null_fd >= 0)
+    close(null_fd);
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,585 @@
+// Multithreaded benchmark of the UDF entry points.
+//
+// Calls hget, hset, hmget, hmset, rget, rset, getset and del the way mysqld
+// does -- *_init once per statement, the function once per row, *_deinit at
+// the end -- from N threads, and reports throughput and latency percentiles
+// per function.  The Redis side is configured through the same environment
+// as the plugin (REDIS_HOST, REDIS_NODES, REDIS_CACHE_BYTES, ...); -h and -p
+// are shortcuts for REDIS_HOST and REDIS_PORT.  -F runs against an
+// in-process FakeRedis instead, with the faults set by FAKE_LATENCY_US and
+// friends (see redis_fake.h), so no server is needed at all.
+//
+//   g++ -O2 -o bench_udf -I /usr/include/mysql bench_udf.cpp anet.c redis_protocol.cpp
+//       redis_client.cpp ... redis_udf.cpp redis_fake.cpp -lboost_thread -lboost_system
+//   ./bench_udf -t 16 -n 100000 -o hget=90,hset=10 -z 0.99 -v 128
+
+#include <mysql.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <boost/cstdint.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "redis_fake.h"
+#include "redis_protocol.h"
+
+typedef my_bool (*init_fn)(UDF_INIT *, UDF_ARGS *, char *);
+typedef void    (*deinit_fn)(UDF_INIT *);
+typedef char *  (*row_fn)(UDF_INIT *, UDF_ARGS *, char *, unsigned long *, char *, char *);
+
+#define UDF_ENTRY(name) extern "C" my_bool name##_init(UDF_INIT *, UDF_ARGS *, char *); \
+  extern "C" void name##_deinit(UDF_INIT *); \
+  extern "C" char *name(UDF_INIT *, UDF_ARGS *, char *, unsigned long *, char *, char *);
+UDF_ENTRY(hget)
+UDF_ENTRY(hset)
+UDF_ENTRY(hmget)
+UDF_ENTRY(hmset)
+UDF_ENTRY(rget)
+UDF_ENTRY(rset)
+UDF_ENTRY(getset)
+UDF_ENTRY(del)
+UDF_ENTRY(redis_incrby)
+UDF_ENTRY(redis_hincrby)
+UDF_ENTRY(redis_flush)
+UDF_ENTRY(redis_stats)
+UDF_ENTRY(redis_slowlog)
+#undef UDF_ENTRY
+
+// Argument layouts: the key is always first.
+enum arg_shape { args_key, args_key_value, args_key_field, args_key_field_value,
+                 args_key_fields, args_key_field_values, args_key_delta, args_key_field_delta };
+
+struct udf_op
+{
+  const char * name;
+  init_fn      init;
+  row_fn       row;
+  deinit_fn    deinit;
+  arg_shape    shape;
+  bool         hash;    // works on the hash keys rather than the string keys
+  bool         write;   // returns SUCCESS when it worked
+};
+
+static const udf_op all_ops[] = {
+  { "hget",   hget_init,   hget,   hget_deinit,   args_key_field,        true,  false },
+  { "hset",   hset_init,   hset,   hset_deinit,   args_key_field_value,  true,  true  },
+  { "hmget",  hmget_init,  hmget,  hmget_deinit,  args_key_fields,       true,  false },
+  { "hmset",  hmset_init,  hmset,  hmset_deinit,  args_key_field_values, true,  true  },
+  { "rget",   rget_init,   rget,   rget_deinit,   args_key,              false, false },
+  { "rset",   rset_init,   rset,   rset_deinit,   args_key_value,        false, true  },
+  { "getset", getset_init, getset, getset_deinit, args_key_value,        false, false },
+  { "del",    del_init,    del,    del_deinit,    args_key,              false, true  },
+  { "incr",   redis_incrby_init,  redis_incrby,  redis_incrby_deinit,  args_key_delta,       false, false },
+  { "hincr",  redis_hincrby_init, redis_hincrby, redis_hincrby_deinit, args_key_field_delta, true,  false },
+};
+static const size_t op_count = sizeof(all_ops) / sizeof(all_ops[0]);
+
+static const udf_op * find_op(const std::string & name)
+{
+  for (size_t i = 0; i < op_count; ++i)
+    if (name == all_ops[i].name)
+      return &all_ops[i];
+  return NULL;
+}
+
+struct bench_config
+{
+  int            threads;
+  long           ops;          // rows per thread
+  long           keys;
+  double         theta;        // 0 = uniform, else Zipfian skew
+  size_t         value_size;
+  int            fields;       // per hash, and per hmget/hmset row
+  int            rows;         // rows per statement
+  bool           prefill;
+  unsigned       seed;
+  std::vector<std::pair<const udf_op *, int> > mix;   // op and weight
+
+  bench_config()
+    : threads(4), ops(100000), keys(100000), theta(0), value_size(64), fields(4),
+      rows(1), prefill(true), seed(1) {}
+};
+
+// xorshift64*, one per thread.
+class rng
+{
+public:
+  explicit rng(boost::uint64_t seed) : s_(seed * 0x9E3779B97F4A7C15ULL | 1) {}
+  boost::uint64_t next()
+  {
+    s_ ^= s_ >> 12;
+    s_ ^= s_ << 25;
+    s_ ^= s_ >> 27;
+    return s_ * 0x2545F4914F6CDD1DULL;
+  }
+  double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+private:
+  boost::uint64_t s_;
+};
+
+// Zipfian key ranks as in YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases"), scrambled with FNV so the hot keys
+// are spread over the keyspace and the shards.
+class key_chooser
+{
+public:
+  key_chooser(long n, double theta) : n_(n), theta_(theta)
+  {
+    if (theta_ <= 0)
+      return;
+    zetan_ = zeta(n_, theta_);
+    double zeta2 = zeta(2, theta_);
+    alpha_ = 1.0 / (1.0 - theta_);
+    eta_   = (1.0 - pow(2.0 / n_, 1.0 - theta_)) / (1.0 - zeta2 / zetan_);
+    half_pow_theta_ = 1.0 + pow(0.5, theta_);
+  }
+
+  long next(rng & r) const
+  {
+    if (theta_ <= 0)
+      return r.next() % n_;
+    double u  = r.unit();
+    double uz = u * zetan_;
+    long rank;
+    if (uz < 1.0)
+      rank = 0;
+    else if (uz < half_pow_theta_)
+      rank = 1;
+    else
+      rank = static_cast<long>(n_ * pow(eta_ * u - eta_ + 1.0, alpha_));
+    return scramble(std::min(rank, n_ - 1));
+  }
+
+private:
+  static double zeta(long n, double theta)
+  {
+    double sum = 0;
+    for (long i = 1; i <= n; ++i)
+      sum += 1.0 / pow(static_cast<double>(i), theta);
+    return sum;
+  }
+
+  long scramble(long rank) const
+  {
+    boost::uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < 8; ++i)
+      h = (h ^ ((rank >> (i * 8)) & 0xff)) * 1099511628211ULL;
+    return h % n_;
+  }
+
+  long   n_;
+  double theta_, zetan_, alpha_, eta_, half_pow_theta_;
+};
+
+// Latencies of one op in one thread, in microseconds.
+struct op_samples
+{
+  std::vector<boost::uint32_t> latency;
+  unsigned long                errors;
+  op_samples() : errors(0) {}
+};
+
+// One statement of one op, with argument arrays rebuilt for every row.
+class statement
+{
+public:
+  statement(const udf_op & op, const bench_config & config, const std::string & value)
+    : op_(op), value_(value), delta_(1), open_(false)
+  {
+    for (int i = 0; i < config.fields; ++i)
+    {
+      char name[16];
+      snprintf(name, sizeof(name), "f%d", i);
+      field_names_.push_back(name);
+    }
+  }
+
+  ~statement() { close(); }
+
+  // Runs one row for key; returns false when it failed.
+  bool row(long key)
+  {
+    build_args_(key);
+    if (!open_)
+    {
+      memset(&init_, 0, sizeof(init_));
+      init_.max_length = 255;
+      char message[MYSQL_ERRMSG_SIZE];
+      if (op_.init(&init_, &args_, message))
+      {
+        fprintf(stderr, "%s_init failed: %s\n", op_.name, message);
+        exit(1);
+      }
+      open_ = true;
+    }
+    char result[256];
+    unsigned long length = 0;
+    char is_null = 0, error = 0;
+    char * out = op_.row(&init_, &args_, result, &length, &is_null, &error);
+    if (error)
+      return false;
+    if (op_.write)
+      return !is_null && length == 7 && memcmp(out, "SUCCESS", 7) == 0;
+    return true;
+  }
+
+  void close()
+  {
+    if (open_)
+      op_.deinit(&init_);
+    open_ = false;
+  }
+
+private:
+  void build_args_(long key)
+  {
+    char buf[32];
+    snprintf(buf, sizeof(buf), op_.hash ? "bench:h:%ld" : "bench:s:%ld", key);
+    key_ = buf;
+
+    argv_.clear();
+    argv_.push_back(string_ref(key_));
+    switch (op_.shape)
+    {
+    case args_key:
+      break;
+    case args_key_value:
+      argv_.push_back(string_ref(value_));
+      break;
+    case args_key_field:
+      argv_.push_back(string_ref(field_names_[key % field_names_.size()]));
+      break;
+    case args_key_field_value:
+      argv_.push_back(string_ref(field_names_[key % field_names_.size()]));
+      argv_.push_back(string_ref(value_));
+      break;
+    case args_key_fields:
+      for (size_t f = 0; f < field_names_.size(); ++f)
+        argv_.push_back(string_ref(field_names_[f]));
+      break;
+    case args_key_field_values:
+      for (size_t f = 0; f < field_names_.size(); ++f)
+      {
+        argv_.push_back(string_ref(field_names_[f]));
+        argv_.push_back(string_ref(value_));
+      }
+      break;
+    case args_key_field_delta:
+      argv_.push_back(string_ref(field_names_[key % field_names_.size()]));
+      // fall through
+    case args_key_delta:
+      argv_.push_back(string_ref(reinterpret_cast<const char *>(&delta_), sizeof(delta_)));
+      break;
+    }
+
+    size_t n = argv_.size();
+    types_.assign(n, STRING_RESULT);
+    if (op_.shape == args_key_delta || op_.shape == args_key_field_delta)
+      types_[n - 1] = INT_RESULT;
+    ptrs_.resize(n);
+    lengths_.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+      ptrs_[i]    = const_cast<char *>(argv_[i].data);
+      lengths_[i] = argv_[i].size;
+    }
+    memset(&args_, 0, sizeof(args_));
+    args_.arg_count = n;
+    args_.arg_type  = &types_[0];
+    args_.args      = &ptrs_[0];
+    args_.lengths   = &lengths_[0];
+  }
+
+  const udf_op &            op_;
+  const std::string &       value_;
+  std::vector<std::string>  field_names_;
+  std::string               key_;
+  long long                 delta_;      // of incr and hincr
+  string_ref_vector         argv_;
+  std::vector<Item_result>  types_;
+  std::vector<char *>       ptrs_;
+  std::vector<unsigned long> lengths_;
+  UDF_ARGS                  args_;
+  UDF_INIT                  init_;
+  bool                      open_;
+};
+
+static void worker(const bench_config & config, const key_chooser & chooser, int id,
+                   boost::barrier & start, std::vector<op_samples> & samples)
+{
+  rng r(config.seed + id);
+  std::string value(config.value_size, 'v');
+  for (size_t i = 0; i < value.size(); ++i)
+    value[i] = 'a' + r.next() % 26;
+
+  std::vector<statement *> statements;
+  std::vector<int> rows_left(config.mix.size(), 0);
+  int total_weight = 0;
+  for (size_t i = 0; i < config.mix.size(); ++i)
+  {
+    statements.push_back(new statement(*config.mix[i].first, config, value));
+    total_weight += config.mix[i].second;
+    samples[i].latency.reserve(config.ops / config.mix.size() + 1);
+  }
+
+  start.wait();
+  for (long n = 0; n < config.ops; ++n)
+  {
+    int pick = r.next() % total_weight;
+    size_t m = 0;
+    while (pick >= config.mix[m].second)
+      pick -= config.mix[m++].second;
+
+    // init and deinit are charged to the first and last rows of a statement
+    unsigned long long t0 = monotonic_us();
+    bool ok = statements[m]->row(chooser.next(r));
+    if (++rows_left[m] >= config.rows)
+    {
+      statements[m]->close();
+      rows_left[m] = 0;
+    }
+    unsigned long long t1 = monotonic_us();
+
+    samples[m].latency.push_back(static_cast<boost::uint32_t>(t1 - t0));
+    if (!ok)
+      samples[m].errors++;
+  }
+  for (size_t i = 0; i < statements.size(); ++i)
+    delete statements[i];
+}
+
+static void prefill(const bench_config & config)
+{
+  bool strings = false, hashes = false;
+  for (size_t i = 0; i < config.mix.size(); ++i)
+    (config.mix[i].first->hash ? hashes : strings) = true;
+
+  // one statement per kind for the whole keyspace
+  std::string value(config.value_size, 'p');
+  statement set_strings(*find_op("rset"), config, value);
+  statement set_hashes(*find_op("hmset"), config, value);
+  for (long k = 0; k < config.keys; ++k)
+  {
+    if (strings)
+      set_strings.row(k);
+    if (hashes)
+      set_hashes.row(k);
+  }
+}
+
+// In write-behind mode (REDIS_WRITE_BEHIND=1) the writes are only queued,
+// and with REDIS_COUNTER_COALESCE=1 so are increments; waits until they
+// have reached Redis.
+static void flush_writes()
+{
+  UDF_INIT init;
+  UDF_ARGS args;
+  memset(&init, 0, sizeof(init));
+  memset(&args, 0, sizeof(args));
+  char message[MYSQL_ERRMSG_SIZE];
+  char result[256];
+  unsigned long length = 0;
+  char is_null = 0, error = 0;
+  if (redis_flush_init(&init, &args, message))
+    return;
+  char * out = redis_flush(&init, &args, result, &length, &is_null, &error);
+  if (length != 7 || memcmp(out, "SUCCESS", 7) != 0)
+    fprintf(stderr, "redis_flush: %.*s\n", (int)length, out);
+  redis_flush_deinit(&init);
+}
+
+// Prints the JSON a no-argument reporting UDF returns.
+static void print_report(const char * name, init_fn init_f, row_fn row_f, deinit_fn deinit_f)
+{
+  UDF_INIT init;
+  UDF_ARGS args;
+  memset(&init, 0, sizeof(init));
+  memset(&args, 0, sizeof(args));
+  char message[MYSQL_ERRMSG_SIZE];
+  char result[256];
+  unsigned long length = 0;
+  char is_null = 0, error = 0;
+  if (init_f(&init, &args, message))
+    return;
+  char * out = row_f(&init, &args, result, &length, &is_null, &error);
+  if (!is_null)
+    printf("%s: %.*s\n", name, (int)length, out);
+  deinit_f(&init);
+}
+
+// Prints what redis_stats() and redis_slowlog() report about the run.
+static void print_stats()
+{
+  print_report("redis_stats", redis_stats_init, redis_stats, redis_stats_deinit);
+  print_report("redis_slowlog", redis_slowlog_init, redis_slowlog, redis_slowlog_deinit);
+}
+
+static double percentile(const std::vector<boost::uint32_t> & sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[i];
+}
+
+static void report(const bench_config & config, std::vector<std::vector<op_samples> > & samples, double seconds)
+{
+  printf("%-8s %10s %11s %8s %8s %8s %8s %8s %8s\n",
+         "op", "calls", "ops/s", "avg_us", "p50_us", "p99_us", "p999_us", "max_us", "errors");
+  std::vector<boost::uint32_t> all;
+  unsigned long all_errors = 0;
+  for (size_t m = 0; m < config.mix.size(); ++m)
+  {
+    std::vector<boost::uint32_t> lat;
+    unsigned long errors = 0;
+    for (size_t t = 0; t < samples.size(); ++t)
+    {
+      lat.insert(lat.end(), samples[t][m].latency.begin(), samples[t][m].latency.end());
+      errors += samples[t][m].errors;
+    }
+    all.insert(all.end(), lat.begin(), lat.end());
+    all_errors += errors;
+    std::sort(lat.begin(), lat.end());
+    double sum = 0;
+    for (size_t i = 0; i < lat.size(); ++i)
+      sum += lat[i];
+    printf("%-8s %10lu %11.0f %8.1f %8.0f %8.0f %8.0f %8.0f %8lu\n",
+           config.mix[m].first->name, (unsigned long)lat.size(), lat.size() / seconds,
+           lat.empty() ? 0 : sum / lat.size(), percentile(lat, 0.50), percentile(lat, 0.99),
+           percentile(lat, 0.999), lat.empty() ? 0.0 : double(lat.back()), errors);
+  }
+  std::sort(all.begin(), all.end());
+  double sum = 0;
+  for (size_t i = 0; i < all.size(); ++i)
+    sum += all[i];
+  printf("%-8s %10lu %11.0f %8.1f %8.0f %8.0f %8.0f %8.0f %8lu\n",
+         "total", (unsigned long)all.size(), all.size() / seconds,
+         all.empty() ? 0 : sum / all.size(), percentile(all, 0.50), percentile(all, 0.99),
+         percentile(all, 0.999), all.empty() ? 0.0 : double(all.back()), all_errors);
+}
+
+static void usage()
+{
+  fprintf(stderr,
+    "usage: bench_udf [options]\n"
+    "  -t threads       (default 4)\n"
+    "  -n rows          per thread (default 100000)\n"
+    "  -o op=w,...      mix of hget hset hmget hmset rget rset getset del incr hincr\n"
+    "                   (default hget=90,hset=10)\n"
+    "  -k keys          keyspace size (default 100000)\n"
+    "  -z theta         Zipfian skew, 0 for uniform (default 0; YCSB uses 0.99)\n"
+    "  -v bytes         value size (default 64)\n"
+    "  -f fields        fields per hash and per hmget/hmset row (default 4)\n"
+    "  -r rows          rows per statement, i.e. per *_init/*_deinit (default 1)\n"
+    "  -s seed          (default 1)\n"
+    "  -P               skip the prefill of the keyspace\n"
+    "  -h host          sets REDIS_HOST, e.g. 127.0.0.1 or unix:/tmp/redis.sock\n"
+    "  -p port          sets REDIS_PORT\n"
+    "  -F               serve from an in-process fake Redis (faults from FAKE_* variables)\n"
+    "  -S               print redis_stats() and redis_slowlog() after the run\n");
+  exit(2);
+}
+
+static bool parse_mix(const char * spec, bench_config & config)
+{
+  config.mix.clear();
+  std::string s(spec);
+  size_t start = 0;
+  while (start < s.size())
+  {
+    size_t end = s.find(',', start);
+    if (end == std::string::npos)
+      end = s.size();
+    std::string item = s.substr(start, end - start);
+    start = end + 1;
+
+    size_t eq = item.find('=');
+    std::string name = item.substr(0, eq);
+    int weight = eq == std::string::npos ? 1 : atoi(item.c_str() + eq + 1);
+    const udf_op * op = find_op(name);
+    if (!op || weight <= 0)
+      return false;
+    config.mix.push_back(std::make_pair(op, weight));
+  }
+  return !config.mix.empty();
+}
+
+int main(int argc, char ** argv)
+{
+  bench_config config;
+  const char * mix = "hget=90,hset=10";
+  bool fake = false, stats = false;
+  int c;
+  while ((c = getopt(argc, argv, "t:n:o:k:z:v:f:r:s:Ph:p:FS")) != -1)
+  {
+    switch (c)
+    {
+    case 't': config.threads    = atoi(optarg); break;
+    case 'n': config.ops        = atol(optarg); break;
+    case 'o': mix               = optarg; break;
+    case 'k': config.keys       = atol(optarg); break;
+    case 'z': config.theta      = atof(optarg); break;
+    case 'v': config.value_size = atol(optarg); break;
+    case 'f': config.fields     = atoi(optarg); break;
+    case 'r': config.rows       = atoi(optarg); break;
+    case 's': config.seed       = atoi(optarg); break;
+    case 'P': config.prefill    = false; break;
+    case 'h': setenv("REDIS_HOST", optarg, 1); break;
+    case 'p': setenv("REDIS_PORT", optarg, 1); break;
+    case 'F': fake = true; break;
+    case 'S': stats = true; break;
+    default:  usage();
+    }
+  }
+  if (!parse_mix(mix, config) || config.threads < 1 || config.ops < 1 || config.keys < 1
+      || config.fields < 1 || config.rows < 1 || config.theta < 0 || config.theta == 1)
+    usage();
+
+  FakeRedis * server = NULL;
+  if (fake)
+  {
+    server = new FakeRedis(0, fake_faults::from_env());
+    char port[16];
+    snprintf(port, sizeof(port), "%d", server->port());
+    setenv("REDIS_HOST", "127.0.0.1", 1);
+    setenv("REDIS_PORT", port, 1);
+    unsetenv("REDIS_NODES");
+    unsetenv("REDIS_REPLICAS");
+    unsetenv("REDIS_CLUSTER");
+  }
+
+  if (config.prefill)
+  {
+    prefill(config);
+    flush_writes();
+  }
+
+  key_chooser chooser(config.keys, config.theta);
+  std::vector<std::vector<op_samples> > samples(config.threads, std::vector<op_samples>(config.mix.size()));
+  boost::barrier start(config.threads + 1);
+  boost::thread_group threads;
+  for (int t = 0; t < config.threads; ++t)
+    threads.create_thread(boost::bind(worker, boost::cref(config), boost::cref(chooser), t,
+                                      boost::ref(start), boost::ref(samples[t])));
+
+  start.wait();
+  unsigned long long t0 = monotonic_us();
+  threads.join_all();
+  flush_writes();
+  double seconds = (monotonic_us() - t0) / 1e6;
+
+  printf("threads=%d rows/thread=%ld keys=%ld theta=%.2f value=%luB fields=%d rows/statement=%d  %.2fs\n",
+         config.threads, config.ops, config.keys, config.theta, (unsigned long)config.value_size,
+         config.fields, config.rows, seconds);
+  report(config, samples, seconds);
+  if (stats)
+    print_stats();
+  delete server;
+  return 0;
+}
@@ -0,0 +1,143 @@
+#include "redis_breaker.h"
+#include "redis_protocol.h"
+
+CircuitBreaker::CircuitBreaker(const breaker_config & config)
+  : config_(config), state_(state_closed), consecutive_(0), trial_ok_(0),
+    window_start_(monotonic_ms()), window_calls_(0), window_failures_(0),
+    opened_at_(0), probed_at_(0), trips_(0), rejected_(0)
+{
+}
+
+const char * CircuitBreaker::state_name(state_type state)
+{
+  switch (state)
+  {
+  case state_open:      return "open";
+  case state_half_open: return "half-open";
+  default:              return "closed";
+  }
+}
+
+void CircuitBreaker::success(unsigned long long started_ms)
+{
+  if (!config_.enabled)
+    return;
+  unsigned long long now = monotonic_ms();
+  bool slow = config_.slow_ms > 0 && now - started_ms >= static_cast<unsigned long long>(config_.slow_ms);
+  // skip the store in the common case so the line is not bounced between cores
+  if (!slow && consecutive_.load(boost::memory_order_relaxed) != 0)
+    consecutive_.store(0, boost::memory_order_relaxed);
+
+  switch (state())
+  {
+  case state_closed:
+    count_(slow, now);
+    break;
+  case state_half_open:
+    if (slow)
+      trip_(now);
+    else if (++trial_ok_ >= config_.half_open_calls)
+    {
+      state_type expected = state_half_open;
+      if (state_.compare_exchange_strong(expected, state_closed))
+      {
+        window_start_    = now;
+        window_calls_    = 0;
+        window_failures_ = 0;
+      }
+    }
+    break;
+  case state_open:
+    break;
+  }
+}
+
+void CircuitBreaker::failure()
+{
+  if (!config_.enabled)
+    return;
+  unsigned long long now = monotonic_ms();
+  switch (state())
+  {
+  case state_closed:
+    if (++consecutive_ >= config_.failures)
+      trip_(now);
+    else
+      count_(true, now);
+    break;
+  case state_half_open:
+    trip_(now);
+    break;
+  case state_open:
+    break;
+  }
+}
+
+// Tallies a call in the current window, starting a new window when the old
+// one has run out, and trips on the error rate.
+void CircuitBreaker::count_(bool failed, unsigned long long now)
+{
+  unsigned long long start = window_start_.load(boost::memory_order_relaxed);
+  if (now - start >= static_cast<unsigned long long>(config_.window_ms)
+      && window_start_.compare_exchange_strong(start, now))
+  {
+    window_calls_.store(0, boost::memory_order_relaxed);
+    window_failures_.store(0, boost::memory_order_relaxed);
+  }
+
+  boost::uint64_t calls = ++window_calls_;
+  if (!failed)
+    return;
+  boost::uint64_t failures = ++window_failures_;
+  if (calls >= static_cast<boost::uint64_t>(config_.min_calls)
+      && failures * 100 >= calls * config_.error_pct)
+    trip_(now);
+}
+
+void CircuitBreaker::trip_(unsigned long long now)
+{
+  opened_at_ = now;
+  probed_at_ = now;
+  state_type s = state_.load(boost::memory_order_acquire);
+  while (s != state_open)
+  {
+    if (state_.compare_exchange_weak(s, state_open))
+    {
+      consecutive_ = 0;
+      ++trips_;
+      return;
+    }
+  }
+}
+
+bool CircuitBreaker::probe_due()
+{
+  if (state() != state_open)
+    return false;
+  unsigned long long now  = monotonic_ms();
+  unsigned long long last = probed_at_.load(boost::memory_order_relaxed);
+  if (now - last < static_cast<unsigned long long>(config_.probe_ms))
+    return false;
+  return probed_at_.compare_exchange_strong(last, now);
+}
+
+void CircuitBreaker::probed(bool ok)
+{
+  if (!ok)
+    return;
+  trial_ok_ = 0;
+  state_type expected = state_open;
+  state_.compare_exchange_strong(expected, state_half_open);
+}
+
+CircuitBreaker::counters CircuitBreaker::stats() const
+{
+  counters c;
+  c.state           = state();
+  c.trips           = trips_.load(boost::memory_order_relaxed);
+  c.rejected        = rejected_.load(boost::memory_order_relaxed);
+  c.window_calls    = window_calls_.load(boost::memory_order_relaxed);
+  c.window_failures = window_failures_.load(boost::memory_order_relaxed);
+  c.open_ms         = c.state == state_open ? monotonic_ms() - opened_at_.load(boost::memory_order_relaxed) : 0;
+  return c;
+}
@@ -0,0 +1,96 @@
+#ifndef _REDIS_BREAKER_H
+#define _REDIS_BREAKER_H
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+// Circuit breaker settings (REDIS_BREAKER=1).
+
+struct breaker_config
+{
+  bool enabled;
+  int  failures;         // consecutive I/O failures that open the breaker
+  int  error_pct;        // or this share of failed and slow calls in a window...
+  int  min_calls;        // ...once the window has seen this many calls
+  int  window_ms;
+  int  slow_ms;          // a reply slower than this counts as failed; 0 = off
+  int  probe_ms;         // health probe interval while open
+  int  half_open_calls;  // successes in a row that close it again
+
+  breaker_config()
+    : enabled(false), failures(5), error_pct(50), min_calls(20), window_ms(10000),
+      slow_ms(250), probe_ms(500), half_open_calls(5) {}
+};
+
+// Closed/open/half-open breaker for one Redis endpoint.
+//
+// Connections report every reply and every I/O failure.  The breaker opens
+// after `failures` failures in a row, or when error_pct of the calls in the
+// current window failed or were slower than slow_ms.  While open allow()
+// says no and callers fail at once instead of waiting on a dead server; a
+// health prober PINGs the endpoint every probe_ms and moves the breaker to
+// half-open when it answers.  Half-open lets calls through: the first
+// failure opens it again, half_open_calls successes close it.
+//
+// All state is in atomics, so the hot path takes no lock.
+
+class CircuitBreaker : private boost::noncopyable
+{
+public:
+  enum state_type { state_closed, state_open, state_half_open };
+
+  struct counters
+  {
+    state_type      state;
+    boost::uint64_t trips;      // closed/half-open -> open transitions
+    boost::uint64_t rejected;   // calls refused while open
+    boost::uint64_t window_calls;
+    boost::uint64_t window_failures;
+    boost::uint64_t open_ms;    // how long it has been open, 0 when not
+  };
+
+  explicit CircuitBreaker(const breaker_config & config);
+
+  bool       enabled() const { return config_.enabled; }
+  // false while open; counts the rejection.
+  bool       allow()
+  {
+    if (!config_.enabled || state_.load(boost::memory_order_acquire) != state_open)
+      return true;
+    ++rejected_;
+    return false;
+  }
+
+  // A reply to a call that started waiting at started_ms (monotonic_ms()).
+  void       success(unsigned long long started_ms);
+  void       failure();
+
+  // True when open and the last probe is probe_ms old; the caller then
+  // probes and reports with probed().
+  bool       probe_due();
+  void       probed(bool ok);
+
+  state_type state() const { return state_.load(boost::memory_order_acquire); }
+  counters   stats() const;
+
+  static const char * state_name(state_type state);
+
+private:
+  void       count_(bool failed, unsigned long long now);
+  void       trip_(unsigned long long now);
+
+  breaker_config                     config_;
+  boost::atomic<state_type>          state_;
+  boost::atomic<int>                 consecutive_;
+  boost::atomic<int>                 trial_ok_;
+  boost::atomic<unsigned long long>  window_start_;
+  boost::atomic<boost::uint64_t>     window_calls_;
+  boost::atomic<boost::uint64_t>     window_failures_;
+  boost::atomic<unsigned long long>  opened_at_;
+  boost::atomic<unsigned long long>  probed_at_;
+  boost::atomic<boost::uint64_t>     trips_;
+  boost::atomic<boost::uint64_t>     rejected_;
+};
+
+#endif
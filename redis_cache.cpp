@@ -0,0 +1,363 @@
+#include "redis_cache.h"
+#include "redis_shard.h"
+
+#include <cstdlib>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+// Rough heap footprint of an entry, so the byte bound means something for
+// small values too.
+static const size_t entry_overhead = 128;
+
+RedisCache::RedisCache(size_t max_bytes, unsigned ttl_ms)
+  : shard_bytes_(max_bytes / shard_count), ttl_ms_(ttl_ms), stop_(false)
+{
+  for (int i = 0; i < shard_count; ++i)
+  {
+    shards_[i].bytes = 0;
+    shards_[i].epoch = 0;
+    memset(&shards_[i].stats, 0, sizeof(counters));
+  }
+}
+
+RedisCache::~RedisCache()
+{
+  stop_ = true;
+  {
+    boost::lock_guard<boost::mutex> lock(sub_mutex_);
+    for (size_t i = 0; i < subs_.size(); ++i)
+      if (subs_[i]->client)
+        subs_[i]->client->shutdown();
+  }
+  for (size_t i = 0; i < subs_.size(); ++i)
+  {
+    subs_[i]->thread.join();
+    delete subs_[i];
+  }
+}
+
+RedisCache::shard & RedisCache::shard_for_(const string_ref & key)
+{
+  size_t h = boost::hash_range(key.data, key.data + key.size);
+  return shards_[h % shard_count];
+}
+
+void RedisCache::erase_(shard & s, lru_iter it)
+{
+  s.bytes -= it->bytes;
+  --s.stats.entries;
+
+  boost::unordered_map<string_type, key_entry>::iterator k = s.keys.find(it->key);
+  if (k != s.keys.end())
+  {
+    if (it->is_hash)
+      k->second.fields.erase(it->field);
+    else
+      k->second.has_string = false;
+    if (!k->second.has_string && k->second.fields.empty())
+      s.keys.erase(k);
+  }
+  s.lru.erase(it);
+}
+
+void RedisCache::drop_key_(shard & s, const string_type & key)
+{
+  boost::unordered_map<string_type, key_entry>::iterator k = s.keys.find(key);
+  if (k == s.keys.end())
+    return;
+
+  key_entry & ke = k->second;
+  if (ke.has_string)
+  {
+    s.bytes -= ke.string_it->bytes;
+    --s.stats.entries;
+    s.lru.erase(ke.string_it);
+  }
+  for (field_map::iterator f = ke.fields.begin(); f != ke.fields.end(); ++f)
+  {
+    s.bytes -= f->second->bytes;
+    --s.stats.entries;
+    s.lru.erase(f->second);
+  }
+  s.keys.erase(k);
+}
+
+bool RedisCache::get(const string_ref & key, const string_ref * field, string_type & out)
+{
+  shard & s = shard_for_(key);
+  boost::lock_guard<boost::mutex> lock(s.mutex);
+
+  boost::unordered_map<string_type, key_entry>::iterator k = s.keys.find(key.str());
+  lru_iter it;
+  bool found = false;
+  if (k != s.keys.end())
+  {
+    if (!field)
+    {
+      found = k->second.has_string;
+      it = k->second.string_it;
+    }
+    else
+    {
+      field_map::iterator f = k->second.fields.find(field->str());
+      found = f != k->second.fields.end();
+      if (found)
+        it = f->second;
+    }
+  }
+
+  if (found && it->expires <= monotonic_ms())
+  {
+    erase_(s, it);
+    found = false;
+  }
+  if (!found)
+  {
+    ++s.stats.misses;
+    return false;
+  }
+
+  ++s.stats.hits;
+  s.lru.splice(s.lru.begin(), s.lru, it);
+  out = it->value;
+  return true;
+}
+
+boost::uint64_t RedisCache::epoch(const string_ref & key)
+{
+  shard & s = shard_for_(key);
+  boost::lock_guard<boost::mutex> lock(s.mutex);
+  return s.epoch;
+}
+
+void RedisCache::put(const string_ref & key, const string_ref * field,
+                     const string_ref & value, boost::uint64_t epoch)
+{
+  size_t bytes = entry_overhead + key.size + (field ? field->size : 0) + value.size;
+  shard & s = shard_for_(key);
+  if (bytes > shard_bytes_)
+    return;
+
+  boost::lock_guard<boost::mutex> lock(s.mutex);
+  if (s.epoch != epoch)
+    return;    // invalidated while the caller was talking to Redis
+
+  string_type k = key.str();
+  key_entry & ke = s.keys[k];
+  if (field)
+  {
+    field_map::iterator f = ke.fields.find(field->str());
+    if (f != ke.fields.end())
+      erase_(s, f->second);
+  }
+  else if (ke.has_string)
+    erase_(s, ke.string_it);
+
+  while (s.bytes + bytes > shard_bytes_ && !s.lru.empty())
+  {
+    ++s.stats.evictions;
+    erase_(s, --s.lru.end());
+  }
+
+  entry e;
+  e.key     = k;
+  e.is_hash = field != NULL;
+  if (field)
+    e.field = field->str();
+  e.value.assign(value.data, value.size);
+  e.expires = monotonic_ms() + ttl_ms_;
+  e.bytes   = bytes;
+  s.lru.push_front(e);
+
+  // erase_ may have dropped the key_entry when evicting its last entry
+  key_entry & target = s.keys[k];
+  if (field)
+    target.fields[e.field] = s.lru.begin();
+  else
+  {
+    target.has_string = true;
+    target.string_it = s.lru.begin();
+  }
+  s.bytes += bytes;
+  ++s.stats.entries;
+}
+
+void RedisCache::invalidate(const string_ref & key)
+{
+  shard & s = shard_for_(key);
+  boost::lock_guard<boost::mutex> lock(s.mutex);
+  ++s.epoch;
+  ++s.stats.invalidations;
+  drop_key_(s, key.str());
+}
+
+void RedisCache::invalidate(const string_ref & key, const string_ref & field)
+{
+  shard & s = shard_for_(key);
+  boost::lock_guard<boost::mutex> lock(s.mutex);
+  ++s.epoch;
+  ++s.stats.invalidations;
+
+  boost::unordered_map<string_type, key_entry>::iterator k = s.keys.find(key.str());
+  if (k == s.keys.end())
+    return;
+  // a plain string at this key is stale as well: HSET would have failed on
+  // it, or the key was replaced
+  if (k->second.has_string)
+  {
+    drop_key_(s, k->first);
+    return;
+  }
+  field_map::iterator f = k->second.fields.find(field.str());
+  if (f != k->second.fields.end())
+    erase_(s, f->second);
+}
+
+void RedisCache::clear()
+{
+  for (int i = 0; i < shard_count; ++i)
+  {
+    shard & s = shards_[i];
+    boost::lock_guard<boost::mutex> lock(s.mutex);
+    ++s.epoch;
+    s.keys.clear();
+    s.lru.clear();
+    s.bytes = 0;
+    s.stats.entries = 0;
+  }
+}
+
+RedisCache::counters RedisCache::stats()
+{
+  counters total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < shard_count; ++i)
+  {
+    shard & s = shards_[i];
+    boost::lock_guard<boost::mutex> lock(s.mutex);
+    total.hits          += s.stats.hits;
+    total.misses        += s.stats.misses;
+    total.invalidations += s.stats.invalidations;
+    total.evictions     += s.stats.evictions;
+    total.entries       += s.stats.entries;
+    total.bytes         += s.bytes;
+  }
+  return total;
+}
+
+void RedisCache::start_subscriber(const RedisPoolConfig & config)
+{
+  subscriber * sub = new subscriber;
+  sub->host     = config.host;
+  sub->port     = config.port;
+  sub->pass     = config.pass;
+  sub->timeouts = config.timeouts;
+  sub->client   = NULL;
+  {
+    boost::lock_guard<boost::mutex> lock(sub_mutex_);
+    subs_.push_back(sub);
+  }
+  sub->thread = boost::thread(&RedisCache::subscribe_loop_, this, sub);
+}
+
+// Runs on its own connection in subscribe mode.  Any event on a key drops
+// all of its cached entries.  While the subscription is down we cannot see
+// invalidations, so the cache is cleared whenever it (re)connects.
+
+void RedisCache::subscribe_loop_(subscriber * sub)
+{
+  static const string_type channel_prefix("__:");
+
+  while (!stop_)
+  {
+    try {
+      RedisClient * client = new RedisClient(sub->host, sub->port, sub->timeouts);
+      {
+        boost::lock_guard<boost::mutex> lock(sub_mutex_);
+        sub->client = client;
+      }
+      if (stop_)
+        throw connection_error("stopping");
+      if (!sub->pass.empty())
+        client->auth(sub->pass);
+
+      RedisPipeline subscribe;
+      subscribe.command("PSUBSCRIBE", "__keyspace@*__:*");
+      reply_vector replies;
+      client->exec(subscribe, replies);
+      if (replies.empty() || !replies[0].ok())
+        throw protocol_error("PSUBSCRIBE failed");
+      clear();
+
+      redis_reply message;
+      while (!stop_)
+      {
+        client->recv(message);
+        // pmessage <pattern> <channel> <event>
+        if (message.type != redis_reply::reply_array || message.elements.size() != 4)
+          continue;
+        const string_type & channel = message.elements[2].str;
+        string_type::size_type pos = channel.find(channel_prefix);
+        if (pos != string_type::npos)
+          invalidate(string_ref(channel.data() + pos + channel_prefix.size(),
+                                channel.size() - pos - channel_prefix.size()));
+      }
+    }
+    catch (redis_error &) {
+    }
+
+    {
+      boost::lock_guard<boost::mutex> lock(sub_mutex_);
+      delete sub->client;
+      sub->client = NULL;
+    }
+    clear();
+
+    for (int i = 0; i < 10 && !stop_; ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  }
+}
+
+static RedisCache * global_cache_ = NULL;
+static boost::once_flag global_cache_once_ = BOOST_ONCE_INIT;
+static bool global_cache_notified_ = false;
+
+// Cluster nodes found after the cache was built need a subscriber too.
+static void subscribe_node(const RedisPoolConfig & config)
+{
+  global_cache_->start_subscriber(config);
+}
+
+static void create_global_cache()
+{
+  const char * bytes = getenv("REDIS_CACHE_BYTES");
+  long n = bytes ? atol(bytes) : 0;
+  if (n <= 0)
+    return;
+  const char * ttl = getenv("REDIS_CACHE_TTL_MS");
+  long t = ttl ? atol(ttl) : 0;
+
+  global_cache_ = new RedisCache(n, t > 0 ? t : 60000);
+
+  const char * notify = getenv("REDIS_CACHE_NOTIFY");
+  if (notify && atoi(notify) != 0)
+  {
+    redis_shards().observe(subscribe_node);
+    global_cache_notified_ = true;
+  }
+}
+
+void stop_cache()
+{
+  if (global_cache_notified_)
+    redis_shards().observe(NULL);
+  delete global_cache_;
+  global_cache_ = NULL;
+}
+
+RedisCache * redis_cache()
+{
+  boost::call_once(global_cache_once_, create_global_cache);
+  return global_cache_;
+}
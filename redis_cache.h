@@ -0,0 +1,129 @@
+#ifndef _REDIS_CACHE_H
+#define _REDIS_CACHE_H
+
+#include <list>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "redis_client.h"
+
+struct RedisPoolConfig;
+
+// In-process cache for rget/hget/hmget (REDIS_CACHE_BYTES > 0).
+//
+// Entries are keyed by Redis key plus hash field (or the key alone for
+// plain strings) and expire after a TTL.  The cache is split into shards by
+// Redis key, each a mutex-protected hash map plus LRU list bounded by
+// bytes, so all entries of one key can be dropped together.
+//
+// Readers take an epoch() before fetching from Redis and pass it back to
+// put(); an invalidation in between bumps the shard's epoch and the stale
+// value is not cached.
+
+class RedisCache : private boost::noncopyable
+{
+public:
+  struct counters
+  {
+    boost::uint64_t hits;
+    boost::uint64_t misses;
+    boost::uint64_t invalidations;
+    boost::uint64_t evictions;
+    boost::uint64_t entries;
+    boost::uint64_t bytes;
+  };
+
+  RedisCache(size_t max_bytes, unsigned ttl_ms);
+  ~RedisCache();
+
+  // field == NULL addresses the plain string stored at key.
+  bool            get(const string_ref & key, const string_ref * field, string_type & out);
+  boost::uint64_t epoch(const string_ref & key);
+  void            put(const string_ref & key, const string_ref * field,
+                      const string_ref & value, boost::uint64_t epoch);
+
+  void            invalidate(const string_ref & key);
+  void            invalidate(const string_ref & key, const string_ref & field);
+  void            clear();
+
+  counters        stats();
+
+  // Keeps the cache coherent with writes made by other clients through
+  // Redis keyspace notifications (notify-keyspace-events must include K).
+  // Called once per node, as each node only reports its own keys.
+  void            start_subscriber(const RedisPoolConfig & config);
+
+private:
+  struct entry;
+  typedef std::list<entry>            lru_list;
+  typedef lru_list::iterator          lru_iter;
+  typedef boost::unordered_map<string_type, lru_iter> field_map;
+
+  struct entry
+  {
+    string_type     key;
+    string_type     field;
+    bool            is_hash;
+    string_type     value;
+    boost::uint64_t expires;   // monotonic ms
+    size_t          bytes;
+  };
+
+  struct key_entry
+  {
+    bool            has_string;
+    lru_iter        string_it;
+    field_map       fields;
+    key_entry() : has_string(false) {}
+  };
+
+  struct shard
+  {
+    boost::mutex    mutex;
+    lru_list        lru;       // most recently used first
+    boost::unordered_map<string_type, key_entry> keys;
+    size_t          bytes;
+    boost::uint64_t epoch;
+    counters        stats;
+  };
+
+  shard &         shard_for_(const string_ref & key);
+  void            erase_(shard & s, lru_iter it);
+  void            drop_key_(shard & s, const string_type & key);
+  struct subscriber
+  {
+    string_type     host;
+    unsigned int    port;
+    string_type     pass;
+    redis_timeouts  timeouts;
+    RedisClient *   client;    // guarded by sub_mutex_
+    boost::thread   thread;
+  };
+
+  void            subscribe_loop_(subscriber * sub);
+
+  enum { shard_count = 64 };
+
+  shard           shards_[shard_count];
+  size_t          shard_bytes_;
+  unsigned        ttl_ms_;
+
+  boost::atomic<bool>       stop_;
+  boost::mutex              sub_mutex_;
+  std::vector<subscriber *> subs_;
+};
+
+// Null unless REDIS_CACHE_BYTES is set; built on first use together with
+// a subscriber per node when REDIS_CACHE_NOTIFY=1, including the cluster
+// nodes that join later.
+RedisCache * redis_cache();
+
+// Joins the subscriber threads and frees the cache; redis_cache() returns
+// NULL afterwards.  Called once, when the plugin is unloaded.
+void         stop_cache();
+
+#endif
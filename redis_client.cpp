@@ -1,10 +1,10 @@
 #include "redis_client.h"
 #include "anet.h"
-
-#include <sstream>
+#include "redis_breaker.h"
 
 #include <algorithm>
 #include <iostream>
+#include <cstdio>
 #include <ctime>
 #include <unistd.h>
 #include <cstring>
@@ -12,99 +12,74 @@
 
 #include <sys/errno.h>
 #include <sys/socket.h>
+#include <poll.h>
 using namespace std;
 
 const string_type status_reply_ok("OK");
-const string_type prefix_status_reply_error("-ERR ");
-const char prefix_status_reply_value = '+';
-const char prefix_single_bulk_reply = '$';
-const char prefix_multi_bulk_reply = '*';
-const char prefix_int_reply = ':';
-const string_type missing_value("**nonexistent-key**");
-const string whitespace(" \f\n\r\t\v");
-const string CRLF("\r\n");
+const string_type prefix_status_reply_error("ERR ");
+extern const string_type missing_value("**nonexistent-key**");
 
-template <typename T>
-T value_from_string(const string & data)
+redis_error::redis_error(const string_type & err) : err_(err) 
 {
-  T value;
-
-  istringstream iss(data);
-  iss >> value;
-  if (iss.fail()) 
-    throw value_error("invalid number");
-
-  return value;
 }
 
-string_type & rtrim(string & str, const string & ws = whitespace)
+redis_error::operator std::string ()
 {
-  string_type::size_type pos = str.find_last_not_of(ws);
-  str.erase(pos + 1);
-  return str;
+  return err_;
 }
 
-class makecmd
+redis_error::operator const std::string () const
 {
-public:
-  explicit makecmd(const string_type & initial, bool finalize = false) 
-  {
-    buffer_ << initial;
-    if (!finalize)
-      buffer_ << " ";
-  }
-
-  template <typename T> 
-  makecmd & operator<<(T const & datum)
-  {
-    buffer_ <<" "<< datum;
-    return *this;
-  }
-
-  template <typename T>
-  makecmd & operator<<(const std::vector<T> & data) 
-  {
-  	buffer_ << " ";
-    size_t n = data.size();
-    for (size_t i = 0; i < n; ++i)
-    {
-      buffer_ << data[i];
-      if (i < n - 1)
-          buffer_ << " ";
-    }
-    return *this;
-  }
-
-  operator std::string ()
-  {
-    buffer_ << CRLF;
-    return buffer_.str();
-  }
+  return err_;
+}
 
-private:
-  std::ostringstream buffer_;
-};
+connection_error::connection_error(const string_type & err) : redis_error(err)
+{
+}
 
-redis_error::redis_error(const string_type & err) : err_(err) 
+circuit_open_error::circuit_open_error(const string_type & err) : connection_error(err)
 {
 }
 
-redis_error::operator std::string ()
+timeout_error::timeout_error(const string_type & err) : connection_error(err)
 {
-  return err_;
 }
 
-redis_error::operator const std::string () const
+protocol_error::protocol_error(const string_type & err) : redis_error(err)
 {
-  return err_;
 }
 
-connection_error::connection_error(const string_type & err) : redis_error(err)
+redirect_error::redirect_error(const string_type & err, bool a, int s,
+                               const string_type & h, unsigned int p)
+  : protocol_error(err), ask(a), slot(s), host(h), port(p)
 {
 }
 
-protocol_error::protocol_error(const string_type & err) : redis_error(err)
+bool parse_redirect(const string_type & msg, bool & ask, int & slot,
+                    string_type & host, unsigned int & port)
 {
+  string_type::size_type pos;
+  if (msg.compare(0, 6, "MOVED ") == 0)
+  {
+    ask = false;
+    pos = 6;
+  }
+  else if (msg.compare(0, 4, "ASK ") == 0)
+  {
+    ask = true;
+    pos = 4;
+  }
+  else
+    return false;
+
+  string_type::size_type space = msg.find(' ', pos);
+  string_type::size_type colon = msg.rfind(':');
+  if (space == string_type::npos || colon == string_type::npos || colon < space)
+    return false;
+  slot = atoi(msg.c_str() + pos);
+  host = msg.substr(space + 1, colon - space - 1);
+  port = atoi(msg.c_str() + colon + 1);
+  return slot >= 0 && slot < 16384 && port > 0;
 }
 
 key_error::key_error(const string_type & err) : redis_error(err)
@@ -115,13 +90,37 @@ value_error::value_error(const string_type & err) : redis_error(err)
 {
 }
 
-RedisClient::RedisClient(const string_type & host, unsigned int port)
+RedisClient::RedisClient(const string_type & host, unsigned int port, const redis_timeouts & timeouts)
+  : broken_(false), timeouts_(timeouts), deadline_(0), breaker_(NULL), read_cmd_(stat_other), sent_us_(0)
 {
 	char err[ANET_ERR_LEN];
-    socket_ = anetTcpConnect(err, const_cast<char*>(host.c_str()), port);
+    bool local = is_unix_endpoint(host);
+    if (local)
+      socket_ = anetUnixNonBlockConnect(err, const_cast<char*>(host.c_str()) + unix_prefix_len);
+    else
+      socket_ = anetTcpNonBlockConnect(err, const_cast<char*>(host.c_str()), port);
     if (socket_ == ANET_ERR) 
       throw connection_error(err);
-    anetTcpNoDelay(NULL, socket_);
+
+    // the connect completes (or fails) in the background
+    deadline_in_(timeouts_.connect_ms);
+    int so_error = 0;
+    socklen_t so_len = sizeof(so_error);
+    if (!wait_ready(socket_, POLLOUT, deadline_)
+        || getsockopt(socket_, SOL_SOCKET, SO_ERROR, &so_error, &so_len) < 0 || so_error != 0)
+    {
+      int saved = so_error ? so_error : errno;
+      close(socket_);
+      if (saved == ETIMEDOUT)
+        throw timeout_error("connect to " + host + " timed out");
+      throw connection_error("connect to " + host + ": " + strerror(saved));
+    }
+    if (!local)
+    {
+      anetTcpNoDelay(NULL, socket_);
+      // pooled connections sit idle for long stretches
+      anetTcpKeepAlive(NULL, socket_);
+    }
 #ifdef DEBUG
 		std::cout<<"open redis success"<<std::endl;
 #endif
@@ -136,258 +135,669 @@ RedisClient::~RedisClient()
 #endif
 }  
 
-void  RedisClient::auth(const string_type & pass)
+void  RedisClient::auth(const string_ref & pass)
+{
+	send_("AUTH", pass);
+  recv_ok_reply_();
+}
+
+void RedisClient::asking()
 {
-	send_(makecmd("AUTH") << pass);
+	send_("ASKING");
   recv_ok_reply_();
 }
 
-void RedisClient::set(const string_type & key,const string_type & value)
+void RedisClient::set(const string_ref & key,const string_ref & value)
 {
-	send_(makecmd("SET") << key << value);
+	command_timer timer(stat_set, trace_, key);
+	send_("SET", key, value);
 	recv_ok_reply_();
+	timer.done();
 }
-string_type RedisClient::get(const string_type & key){
-	send_(makecmd("GET") << key);
-	return recv_bulk_reply_();
+string_type RedisClient::get(const string_ref & key){
+	string_type out;
+	get(key, out);
+	return out;
 }
 
-void RedisClient::hset(const string_type & key,const string_type & field,const string_type & value){
-	send_(makecmd("HSET") << key << field << value);
+void RedisClient::get(const string_ref & key,string_type & out){
+	command_timer timer(stat_get, trace_, key);
+	send_("GET", key);
+	recv_bulk_reply_(out);
+	timer.done();
+}
+
+void RedisClient::get(const string_ref & key,string_ref & out){
+	command_timer timer(stat_get, trace_, key);
+	send_("GET", key);
+	recv_bulk_reply_(out);
+	timer.done();
+}
+
+void RedisClient::hset(const string_ref & key,const string_ref & field,const string_ref & value){
+	command_timer timer(stat_hset, trace_, key);
+	send_("HSET", key, field, value);
 	//return :0
-	recv_bulk_reply_(prefix_int_reply);
+	recv_int_reply_();
+	timer.done();
+}
+
+string_type RedisClient::hget(const string_ref & key,const string_ref & field){
+	string_type out;
+	hget(key, field, out);
+	return out;
+}
+
+void RedisClient::hget(const string_ref & key,const string_ref & field,string_type & out){
+	command_timer timer(stat_hget, trace_, key);
+	send_("HGET", key, field);
+	recv_bulk_reply_(out);
+	timer.done();
+}
+
+void RedisClient::hget(const string_ref & key,const string_ref & field,string_ref & out){
+	command_timer timer(stat_hget, trace_, key);
+	send_("HGET", key, field);
+	recv_bulk_reply_(out);
+	timer.done();
 }
 
-string_type RedisClient::hget(const string_type & key,const string_type & field){
-	send_(makecmd("HGET") << key << field);
-	return recv_bulk_reply_();
+void RedisClient::del(const string_ref & key){
+	command_timer timer(stat_del, trace_, key);
+	send_("DEL", key);
+	recv_int_reply_();
+	timer.done();
 }
 
-void RedisClient::del(const string_type & key){
-	send_(makecmd("DEL") << key);
-	recv_bulk_reply_(prefix_int_reply);
+int_type RedisClient::incrby(const string_ref & key,int_type delta){
+	command_timer timer(stat_incr, trace_, key);
+	char number[32];
+	snprintf(number, sizeof(number), "%ld", delta);
+	send_("INCRBY", key, number);
+	int_type value = recv_int_reply_();
+	timer.done();
+	return value;
+}
+
+int_type RedisClient::hincrby(const string_ref & key,const string_ref & field,int_type delta){
+	command_timer timer(stat_incr, trace_, key);
+	char number[32];
+	snprintf(number, sizeof(number), "%ld", delta);
+	send_("HINCRBY", key, field, number);
+	int_type value = recv_int_reply_();
+	timer.done();
+	return value;
+}
+
+void RedisClient::hincrbyfloat(const string_ref & key,const string_ref & field,double delta,string_type & out){
+	command_timer timer(stat_incr, trace_, key);
+	char number[32];
+	snprintf(number, sizeof(number), "%.17g", delta);
+	send_("HINCRBYFLOAT", key, field, number);
+	recv_bulk_reply_(out);
+	timer.done();
 }
 
 void RedisClient::save(){
-	send_(makecmd("SAVE"));
+	command_timer timer(stat_other, trace_, string_ref());
+	send_("SAVE");
+	deadline_in_(timeouts_.admin_ms);
 	recv_ok_reply_();
+	timer.done();
 }
 
 void RedisClient::bgsave(){
-	send_(makecmd("BGSAVE"));
+	command_timer timer(stat_other, trace_, string_ref());
+	send_("BGSAVE");
+	deadline_in_(timeouts_.admin_ms);
 	recv_single_line_reply_();
+	timer.done();
 }
 
-void RedisClient::hmset(const string_type & key,const string_vector & fields,const string_vector & values){
-	makecmd maker("HMSET");
-	maker << key;
+void RedisClient::hmset(const string_ref & key,const string_ref_vector & fields,const string_ref_vector & values){
+	command_timer timer(stat_hmset, trace_, key);
 	if(fields.size() != values.size() || fields.size() <= 0){
 		throw protocol_error("invalid arguments");
 	}
-	for(int i = 0;i < fields.size();i++){
-		maker << fields[i] << values[i];
+	enc_.begin(2 + 2 * fields.size());
+	enc_.arg("HMSET");
+	enc_.arg(key);
+	for(size_t i = 0;i < fields.size();i++){
+		enc_.arg(fields[i]);
+		enc_.arg(values[i]);
 	}
-	send_(maker);
+	send_();
 	recv_ok_reply_();
+	timer.done();
+}
+
+void RedisClient::hmset(const string_ref & key,const string_vector & fields,const string_vector & values){
+	string_ref_vector f(fields.begin(), fields.end());
+	string_ref_vector v(values.begin(), values.end());
+	hmset(key, f, v);
+}
+
+void RedisClient::send_hmget_(const string_ref & key,const string_ref_vector & fields){
+	enc_.begin(2 + fields.size());
+	enc_.arg("HMGET");
+	enc_.arg(key);
+	for(size_t i = 0;i < fields.size();i++){
+		enc_.arg(fields[i]);
+	}
+	send_();
+}
+
+void RedisClient::hmget(const string_ref & key,const string_ref_vector & fields,string_vector & out){
+	command_timer timer(stat_hmget, trace_, key);
+	send_hmget_(key, fields);
+	recv_multi_bulk_reply_(out);
+	timer.done();
+}
+
+void RedisClient::hmget(const string_ref & key,const string_ref_vector & fields,bulk_ref_vector & out){
+	command_timer timer(stat_hmget, trace_, key);
+	send_hmget_(key, fields);
+	recv_multi_bulk_reply_(out);
+	timer.done();
+}
+
+void RedisClient::begin_read(const string_ref_vector & argv){
+	// GET, HGET or HMGET
+	read_cmd_ = argv[0].data[0] == 'G' ? stat_get : argv[0].size == 4 ? stat_hget : stat_hmget;
+	read_key_ = argv[1];
+	sent_us_ = command_timing ? monotonic_us() : 0;
+	enc_.begin(argv.size());
+	for(size_t i = 0;i < argv.size();i++)
+		enc_.arg(argv[i]);
+	send_();
+}
+
+void RedisClient::end_read(string_ref & out){
+	command_timer timer(read_cmd_, trace_, read_key_, sent_us_);
+	recv_bulk_reply_(out);
+	timer.done();
+}
+
+void RedisClient::end_read(string_vector & out){
+	command_timer timer(read_cmd_, trace_, read_key_, sent_us_);
+	recv_multi_bulk_reply_(out);
+	timer.done();
 }
 
-void RedisClient::hmget(const string_type & key,const string_vector & fields,string_vector & out){
-	send_(makecmd("HMGET")<<key<<fields);
+void RedisClient::end_read(bulk_ref_vector & out){
+	command_timer timer(read_cmd_, trace_, read_key_, sent_us_);
 	recv_multi_bulk_reply_(out);
+	timer.done();
+}
+
+void RedisClient::hmget(const string_ref & key,const string_vector & fields,string_vector & out){
+	string_ref_vector f(fields.begin(), fields.end());
+	hmget(key, f, out);
 }
 	
-string_type RedisClient::getset(const string_type & key,const string_type & value){
-	send_(makecmd("GETSET") << key << value);
-	return recv_bulk_reply_();
+string_type RedisClient::getset(const string_ref & key,const string_ref & value){
+	string_type out;
+	getset(key, value, out);
+	return out;
 }
 
-void RedisClient::recv_ok_reply_() 
+void RedisClient::getset(const string_ref & key,const string_ref & value,string_type & out){
+	command_timer timer(stat_getset, trace_, key);
+	send_("GETSET", key, value);
+	recv_bulk_reply_(out);
+	timer.done();
+}
+
+void RedisClient::getset(const string_ref & key,const string_ref & value,string_ref & out){
+	command_timer timer(stat_getset, trace_, key);
+	send_("GETSET", key, value);
+	recv_bulk_reply_(out);
+	timer.done();
+}
+
+void RedisClient::evalsha(const string_ref_vector & argv,redis_reply & out){
+	command_timer timer(stat_eval, trace_, argv.size() > 3 ? argv[3] : string_ref());
+	enc_.begin(argv.size());
+	for(size_t i = 0;i < argv.size();i++)
+		enc_.arg(argv[i]);
+	send_();
+	const resp_value & reply = recv_reply_();
+	if(reply.type == '-' && is_redirect_(reply))
+		check_error_reply_(reply);
+	decode_reply_(&reply, out);
+	timer.done();
+}
+
+void RedisClient::evalsha(const string_ref_vector & argv,const string_ref & script,redis_reply & out){
+	command_timer timer(stat_eval, trace_, argv.size() > 3 ? argv[3] : string_ref());
+	enc_.begin(3);
+	enc_.arg("SCRIPT");
+	enc_.arg("LOAD");
+	enc_.arg(script);
+	enc_.begin(argv.size());
+	for(size_t i = 0;i < argv.size();i++)
+		enc_.arg(argv[i]);
+	send_();
+	redis_reply loaded;
+	decode_reply_(&recv_reply_(), loaded);
+	const resp_value & reply = recv_reply_();
+	if(reply.type == '-' && is_redirect_(reply))
+		check_error_reply_(reply);
+	if(loaded.ok())
+		decode_reply_(&reply, out);
+	else
+		out = loaded;    // e.g. a compile error, more use than the NOSCRIPT after it
+	timer.done();
+}
+
+void RedisPipeline::command(const string_ref & a0)
 {
-  if (recv_single_line_reply_() != status_reply_ok) 
-    throw protocol_error("expected OK response");
-}  
+  size_t start = enc_.size();
+  enc_.begin(1);
+  enc_.arg_copy(a0);
+  starts_.push_back(start);
+}
 
-string_type RedisClient::recv_single_line_reply_()
+void RedisPipeline::command(const string_ref & a0, const string_ref & a1)
 {
-  string_type line = read_line(socket_);
+  size_t start = enc_.size();
+  enc_.begin(2);
+  enc_.arg_copy(a0);
+  enc_.arg_copy(a1);
+  starts_.push_back(start);
+}
 
-  if (line.empty())
-    throw protocol_error("empty single line reply");
-  if (line.find(prefix_status_reply_error) == 0) 
-  {
-    string_type error_msg = line.substr(prefix_status_reply_error.length());
-    if (error_msg.empty()) 
-      error_msg = "unknown error";
-    throw protocol_error(error_msg);
-  }
+void RedisPipeline::command(const string_ref & a0, const string_ref & a1, const string_ref & a2)
+{
+  size_t start = enc_.size();
+  enc_.begin(3);
+  enc_.arg_copy(a0);
+  enc_.arg_copy(a1);
+  enc_.arg_copy(a2);
+  starts_.push_back(start);
+}
 
-  if (line[0] != prefix_status_reply_value)
-    throw protocol_error("unexpected prefix for status reply");
-  return line.substr(1);
+void RedisPipeline::command(const string_ref & a0, const string_ref & a1, const string_ref & a2, const string_ref & a3)
+{
+  size_t start = enc_.size();
+  enc_.begin(4);
+  enc_.arg_copy(a0);
+  enc_.arg_copy(a1);
+  enc_.arg_copy(a2);
+  enc_.arg_copy(a3);
+  starts_.push_back(start);
 }
 
-string_type RedisClient::recv_bulk_reply_() 
+void RedisPipeline::command(const string_ref_vector & argv)
 {
-  int_type length = recv_bulk_reply_(prefix_single_bulk_reply);
+  size_t start = enc_.size();
+  enc_.begin(argv.size());
+  for (size_t i = 0; i < argv.size(); ++i)
+    enc_.arg_copy(argv[i]);
+  starts_.push_back(start);
+}
 
-  if (length == -1)
-    return missing_value;
+void RedisPipeline::command_encoded(const string_ref & command)
+{
+  starts_.push_back(enc_.size());
+  enc_.raw(command);
+}
 
-  int_type real_length = length + 2;    // CRLF
+void RedisPipeline::encoded(size_t i, string_type & out) const
+{
+  size_t end = i + 1 < starts_.size() ? starts_[i + 1] : enc_.size();
+  enc_.copy_out(starts_[i], end - starts_[i], out);
+}
 
-  string_type data = read_n(socket_, real_length);
+void RedisClient::exec(RedisPipeline & pipeline, reply_vector & replies)
+{
+  recv(send(pipeline), replies);
+}
 
-  if (data.empty())
-    throw protocol_error("invalid bulk reply data; empty");
+size_t RedisClient::send(RedisPipeline & pipeline)
+{
+  size_t count = pipeline.starts_.size();
+  if (count == 0)
+    return 0;
+
+  pipeline.starts_.clear();
+  deadline_in_(timeouts_.pipeline_ms);
+  size_t bytes = pipeline.enc_.size();
+  unsigned long syscalls = pipeline.enc_.syscalls();
+  sent_us_ = command_timing ? monotonic_us() : 0;
+  trace_ = command_trace();
+  bool ok = pipeline.enc_.flush(socket_, deadline_);
+  if (thread_stats * stats = local_stats())
+  {
+    stats->io(bytes, 0, pipeline.enc_.syscalls() - syscalls);
+    stats->pipeline(count);
+  }
+  if (!ok)
+  {
+    io_failed_();
+    if (errno == ETIMEDOUT)
+      throw timeout_error("redis write timed out");
+    throw connection_error(strerror(errno));
+  }
+  return count;
+}
 
-  if (data.length() != static_cast<string_type::size_type>(real_length))
-    throw protocol_error("invalid bulk reply data; data of unexpected length");
+void RedisClient::recv(size_t count, reply_vector & replies)
+{
+  command_timer timer(stat_pipeline, trace_, string_ref(), sent_us_);
+  replies.resize(count);
+  for (size_t i = 0; i < count; ++i)
+    decode_reply_(&recv_reply_(), replies[i]);
+  timer.done();
+}
 
-  data.erase(data.size() - 2);
+void RedisClient::recv(redis_reply & out)
+{
+  deadline_ = 0;
+  decode_reply_(&recv_reply_(), out);
+}
 
-  return data;
+void RedisClient::shutdown()
+{
+  ::shutdown(socket_, SHUT_RDWR);
 }
 
-int_type RedisClient::recv_multi_bulk_reply_(string_vector & out)
+// Converts one flattened reply node (and its elements) into out.  Returns
+// the node following it.
+
+const resp_value * RedisClient::decode_reply_(const resp_value * node, redis_reply & out)
 {
-  int_type length = recv_bulk_reply_(prefix_multi_bulk_reply);
-#ifdef DEBUG
-  	std::cout<<"len is "<<length<<std::endl;
-  	#endif
-  if (length == -1)
-    throw key_error("no such key");
+  out.integer = node->integer;
+  out.str.clear();
+  out.elements.clear();
 
-  for (int_type i = 0; i < length; ++i){
-  	string_type ret = recv_bulk_reply_();
-  	#ifdef DEBUG
-  	std::cout<<"ret is "<<ret<<std::endl;
-  	#endif
-  	out.push_back(ret);
+  switch (node->type)
+  {
+  case '+':
+  case '-':
+    out.type = node->type == '+' ? redis_reply::reply_status : redis_reply::reply_error;
+    out.str.assign(reader_.text(*node).data, node->len);
+    break;
+  case ':':
+    out.type = redis_reply::reply_integer;
+    break;
+  case '$':
+    out.type = node->nil ? redis_reply::reply_nil : redis_reply::reply_bulk;
+    if (!node->nil)
+      out.str.assign(reader_.text(*node).data, node->len);
+    break;
+  case '*':
+    out.type = node->nil ? redis_reply::reply_nil : redis_reply::reply_array;
+    if (!node->nil)
+    {
+      const resp_value * next = node + 1;
+      out.elements.resize(node->integer);
+      for (long long i = 0; i < node->integer; ++i)
+        next = decode_reply_(next, out.elements[i]);
+      return next;
+    }
+    break;
   }
-
-  return length;
+  return node + 1;
 }
 
-void RedisClient::send_(const string_type & msg)
+// Marks the connection unusable and tells the breaker; errno is kept for
+// the caller's message.
+void RedisClient::io_failed_()
 {
-#ifdef DEBUG
-  std::cout<< "send cmd "<<msg<<std::endl;
-#endif
-
-  if (anetWrite(socket_, const_cast<char *>(msg.data()), msg.size()) == -1)
-    throw connection_error(strerror(errno));
+  int saved = errno;
+  broken_ = true;
+  if (breaker_)
+    breaker_->failure();
+  errno = saved;
 }
 
-int_type RedisClient::recv_bulk_reply_(char prefix)
+// Reads the next complete reply into reader_, receiving as much as the
+// buffer holds per recv(2).  The previous reply is released first.
+const resp_value & RedisClient::recv_reply_()
 {
-  string line = read_line(socket_);
+  unsigned long long started = breaker_ ? monotonic_ms() : 0;
+  size_t received = 0;
+  unsigned long syscalls = 0;
+  reader_.consume();
+  for (;;)
+  {
+    resp_reader::status st = reader_.parse();
+    if (st == resp_reader::complete)
+      break;
+    if (st == resp_reader::invalid)
+    {
+      io_failed_();
+      throw protocol_error("invalid reply from redis");
+    }
 
+    size_t avail = 0;
+    char * space = reader_.write_space(avail);
+    ssize_t bytes_received;
+    while (++syscalls, (bytes_received = ::recv(socket_, space, avail, 0)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if ((errno != EAGAIN && errno != EWOULDBLOCK) || (++syscalls, !wait_ready(socket_, POLLIN, deadline_)))
+        break;
+    }
+
+    if (bytes_received <= 0)
+    {
+      io_failed_();
+      if (bytes_received < 0 && errno == ETIMEDOUT)
+        throw timeout_error("redis read timed out");
+      throw connection_error(bytes_received == 0 ? "connection was closed" : strerror(errno));
+    }
+    reader_.wrote(bytes_received);
+    received += bytes_received;
+    if (!trace_.first_byte_us && slowlog_threshold_us != ~0ULL)
+      trace_.first_byte_us = monotonic_us();
+  }
+  trace_.reply_bytes += received;
+
+  if (breaker_)
+    breaker_->success(started);
+  if (thread_stats * stats = local_stats())
+    stats->io(0, received, syscalls);
+
+  const resp_value & reply = reader_.nodes()[0];
 #ifdef DEBUG
-  std::cout<<"line is "<<line<<std::endl;
+  std::cout<<"reply type "<<reply.type<<" nodes "<<reader_.node_count()<<std::endl;
 #endif
+  return reply;
+}
 
-  if (line[0] != prefix)
-    throw protocol_error("unexpected prefix for bulk reply");
+// Error replies are consumed whole, so they leave the connection usable.
 
-  return value_from_string<int_type>(line.substr(1));
+void RedisClient::check_error_reply_(const resp_value & reply)
+{
+  if (reply.type != '-')
+    return;
+  string_type error_msg = reader_.text(reply).str();
+  if (error_msg.compare(0, prefix_status_reply_error.size(), prefix_status_reply_error) == 0)
+    error_msg.erase(0, prefix_status_reply_error.size());
+  if (error_msg.empty()) 
+    error_msg = "unknown error";
+
+  bool ask;
+  int slot;
+  string_type host;
+  unsigned int port;
+  if (parse_redirect(error_msg, ask, slot, host, port))
+    throw redirect_error(error_msg, ask, slot, host, port);
+  throw protocol_error(error_msg);
 }
 
-string_type RedisClient::read_line(int socket, ssize_t max_size) 
+bool RedisClient::is_redirect_(const resp_value & reply)
 {
-  assert(socket > 0);
-  assert(max_size > 0);
+  string_ref text = reader_.text(reply);
+  return (text.size > 6 && memcmp(text.data, "MOVED ", 6) == 0) ||
+         (text.size > 4 && memcmp(text.data, "ASK ", 4) == 0);
+}
 
-  std::ostringstream oss;
+void RedisClient::recv_ok_reply_() 
+{
+  if (recv_single_line_reply_() != status_reply_ok) 
+    throw protocol_error("expected OK response");
+}
 
-  enum { buffer_size = 64 };
-  char buffer[buffer_size];
-  memset(buffer, 0, buffer_size);
+string_type RedisClient::recv_single_line_reply_()
+{
+  const resp_value & reply = recv_reply_();
+  check_error_reply_(reply);
+  if (reply.type != '+')
+    throw protocol_error("unexpected prefix for status reply");
+  return reader_.text(reply).str();
+}
 
-  ssize_t total_bytes_read = 0;
-  bool found_delimiter = false;
+string_type RedisClient::recv_bulk_reply_() 
+{
+  string_type data;
+  recv_bulk_reply_(data);
+  return data;
+}
 
-  while (total_bytes_read < max_size && !found_delimiter)
-  {
-    // Peek at what's available.
+// Copies a bulk reply into out, reusing whatever capacity it already has.
 
-    ssize_t bytes_received = 0;
-    do bytes_received = recv(socket, buffer, buffer_size, MSG_PEEK);
-    while (bytes_received < 0 && errno == EINTR);
+void RedisClient::recv_bulk_reply_(string_type & out)
+{
+  string_ref data;
+  recv_bulk_reply_(data);
+  out.assign(data.data, data.size);
+}
 
-    if (bytes_received == 0)
-      throw connection_error("connection was closed");
+// Points out at the payload where recv(2) put it in the read buffer.  The
+// reader grows the buffer to hold a whole bulk before parsing it, so even a
+// multi-megabyte value is one contiguous run and is never copied here.
 
-    // Some data is available; Length might be < buffer_size.
-    // Look for newline in whatever was read though.
+void RedisClient::recv_bulk_reply_(string_ref & out)
+{
+  const resp_value & reply = recv_reply_();
+  check_error_reply_(reply);
+  if (reply.type != '$')
+    throw protocol_error("unexpected prefix for bulk reply");
 
-    char * eol = static_cast<char *>(memchr(buffer, '\n', bytes_received));
+  if (reply.nil)
+    out = missing_value;
+  else
+    out = reader_.text(reply);
+}
 
-    // If found, write data from the buffer to the output string.
-    // Else, write the entire buffer and continue reading more data.
+int_type RedisClient::recv_int_reply_()
+{
+  const resp_value & reply = recv_reply_();
+  check_error_reply_(reply);
+  if (reply.type != ':')
+    throw protocol_error("unexpected prefix for integer reply");
+  return reply.integer;
+}
 
-    ssize_t to_read = bytes_received;
+// Reads a multi bulk reply of bulks and returns its first element.
 
-    if (eol) 
-    {
-      to_read = eol - buffer + 1;
-      oss.write(buffer, to_read);
-      found_delimiter = true;
-    }
-    else
-      oss.write(buffer, bytes_received);
+const resp_value * RedisClient::recv_multi_bulk_nodes_(int_type & length)
+{
+  const resp_value & reply = recv_reply_();
+  check_error_reply_(reply);
+  if (reply.type != '*')
+    throw protocol_error("unexpected prefix for multi bulk reply");
+  if (reply.nil)
+    throw key_error("no such key");
 
-    // Now read from the socket to remove the peeked data from the socket's
-    // read buffer.  This will not block since we've peeked already and know
-    // there's data waiting.  It might fail if we were interrupted however.
+  length = reply.integer;
+  if (static_cast<size_t>(length) + 1 != reader_.node_count())
+    throw protocol_error("unexpected nested multi bulk reply");
+  return &reply + 1;
+}
 
-    do bytes_received = recv(socket, buffer, to_read, 0);
-    while (bytes_received < 0 && errno == EINTR);
+int_type RedisClient::recv_multi_bulk_reply_(string_vector & out)
+{
+  int_type length;
+  const resp_value * element = recv_multi_bulk_nodes_(length);
+
+  // resize rather than clear so the element strings keep their capacity
+  out.resize(length);
+  for (int_type i = 0; i < length; ++i, ++element){
+  	if (element->nil)
+  		out[i] = missing_value;
+  	else
+  	{
+  		string_ref data = reader_.text(*element);
+  		out[i].assign(data.data, data.size);
+  	}
   }
 
-  // Construct final line string. Remove trailing CRLF-based whitespace.
-
-  string_type line = oss.str();
-  return rtrim(line, CRLF);
+  return length;
 }
 
-string_type RedisClient::read_n(int socket, ssize_t n)
+// The elements stay in the read buffer; out only holds offsets into it, so
+// a wide reply costs no allocation once out has grown to its width.
+int_type RedisClient::recv_multi_bulk_reply_(bulk_ref_vector & out)
 {
-  char * buffer = new char[n + 1];
-  buffer[n] = '\0';
+  int_type length;
+  const resp_value * element = recv_multi_bulk_nodes_(length);
 
-  char * bp = buffer;
-  ssize_t bytes_read = 0;
+  out.resize(length);
+  for (int_type i = 0; i < length; ++i, ++element)
+    out[i] = element->nil ? bulk_ref() : bulk_ref(reader_.text(*element));
 
-  while (bytes_read != n) 
-  {
-    ssize_t bytes_received = 0;
-    do bytes_received = recv(socket, bp, n - (bp - buffer), 0);
-    while (bytes_received < 0 && errno == EINTR);
+  return length;
+}
+
+// Flushes whatever has been encoded into enc_.
 
-    if (bytes_received == 0)
-      throw connection_error("connection was closed");
+void RedisClient::send_()
+{
+#ifdef DEBUG
+  std::cout<< "send cmd of "<<enc_.size()<<" bytes"<<std::endl;
+#endif
 
-    bytes_read += bytes_received;
-    bp         += bytes_received;
+  deadline_in_(timeouts_.command_ms);
+  size_t bytes = enc_.size();
+  unsigned long syscalls = enc_.syscalls();
+  trace_ = command_trace();
+  bool ok = enc_.flush(socket_, deadline_);
+  if (thread_stats * stats = local_stats())
+    stats->io(bytes, 0, enc_.syscalls() - syscalls);
+  if (!ok)
+  {
+    io_failed_();
+    if (errno == ETIMEDOUT)
+      throw timeout_error("redis write timed out");
+    throw connection_error(strerror(errno));
   }
+}
 
-  string_type str(buffer);
-  delete [] buffer;
-  return str;
+void RedisClient::send_(const string_ref & a0)
+{
+  enc_.begin(1);
+  enc_.arg(a0);
+  send_();
 }
 
-RedisClient *init_client_if_isnull()
+void RedisClient::send_(const string_ref & a0, const string_ref & a1)
 {
-    if(!_client){
-        const char* c_host = getenv("REDIS_HOST"); // 获取操作系统变量
-        const char * c_pass = getenv("REDID_PASS");
-        //string_type host = "changhua0208.cn";
-        if(!c_host)
-            c_host = "changhua0208.cn";
-        _client = new RedisClient(c_host,6379);
-        if(!c_pass)
-        		c_pass = "changhua.jiang";
-        _client->auth(c_pass);
-    }
-    return _client;
-}
\ No newline at end of file
+  enc_.begin(2);
+  enc_.arg(a0);
+  enc_.arg(a1);
+  send_();
+}
+
+void RedisClient::send_(const string_ref & a0, const string_ref & a1, const string_ref & a2)
+{
+  enc_.begin(3);
+  enc_.arg(a0);
+  enc_.arg(a1);
+  enc_.arg(a2);
+  send_();
+}
+
+void RedisClient::send_(const string_ref & a0, const string_ref & a1, const string_ref & a2, const string_ref & a3)
+{
+  enc_.begin(4);
+  enc_.arg(a0);
+  enc_.arg(a1);
+  enc_.arg(a2);
+  enc_.arg(a3);
+  send_();
+}
@@ -8,6 +8,11 @@
 #include <ctime>
 #include<stdlib.h>
 
+#include "redis_protocol.h"
+#include "redis_stats.h"
+
+class CircuitBreaker;
+
 typedef std::string string_type;
 typedef std::vector<string_type> string_vector;
 typedef long int_type;
@@ -31,6 +36,23 @@ public:
   connection_error(const string_type & err);
 };
 
+// The endpoint's circuit breaker is open; nothing was sent.
+
+class circuit_open_error : public connection_error
+{
+public:
+  circuit_open_error(const string_type & err);
+};
+
+// An I/O deadline passed.  The connection is left broken: part of the
+// reply may still be on its way and must not be read by the next command.
+
+class timeout_error : public connection_error
+{
+public:
+  timeout_error(const string_type & err);
+};
+
 // Redis gave us a reply we were not expecting.
 // Possibly an internal error (here or in redis, probably here).
 
@@ -40,6 +62,26 @@ public:
   protocol_error(const string_type & err);
 };
 
+// A cluster node answered -MOVED or -ASK: the slot of the key is served by
+// another node, permanently (MOVED) or just for this command while the slot
+// migrates (ASK).
+
+class redirect_error : public protocol_error
+{
+public:
+  redirect_error(const string_type & err, bool ask, int slot,
+                 const string_type & host, unsigned int port);
+
+  bool         ask;
+  int          slot;
+  string_type  host;
+  unsigned int port;
+};
+
+// Parses "MOVED <slot> <host>:<port>" or "ASK <slot> <host>:<port>".
+bool parse_redirect(const string_type & msg, bool & ask, int & slot,
+                    string_type & host, unsigned int & port);
+
 // A key that you expected to exist does not in fact exist.
 
 class key_error : public redis_error
@@ -56,45 +98,221 @@ public:
   value_error(const string_type & err);
 };
 
+// I/O deadlines per kind of operation, in milliseconds; 0 means no limit.
+// A deadline covers the whole operation, from the first byte sent to the
+// last byte of the reply.
+
+struct redis_timeouts
+{
+  int connect_ms;    // TCP connect
+  int command_ms;    // one command
+  int pipeline_ms;   // a whole pipeline, e.g. an aggregate batch
+  int admin_ms;      // SAVE, BGSAVE
+
+  redis_timeouts() : connect_ms(1000), command_ms(1000), pipeline_ms(10000), admin_ms(0) {}
+};
+
+// Endpoints of the form "unix:/path/to.sock" name a Unix domain socket.
+
+static const size_t unix_prefix_len = 5;
+
+inline bool is_unix_endpoint(const string_type & host)
+{
+  return host.compare(0, unix_prefix_len, "unix:") == 0;
+}
+
+// A decoded reply, as returned for each command of a pipeline.
+
+struct redis_reply
+{
+  enum reply_type { reply_status, reply_error, reply_integer, reply_bulk, reply_nil, reply_array };
+
+  reply_type               type;
+  int_type                 integer;   // integer value, or element count of an array
+  string_type              str;       // status or error text, bulk payload
+  std::vector<redis_reply> elements;
+
+  redis_reply() : type(reply_nil), integer(0) {}
+  bool ok() const { return type != reply_error; }
+};
+
+typedef std::vector<redis_reply> reply_vector;
+
+// One element of a multi bulk reply decoded in place: a view into the
+// connection's read buffer, or nil.  Valid until the next command on the
+// connection, like the other string_ref results.
+
+struct bulk_ref
+{
+  string_ref data;
+  bool       nil;
+
+  bulk_ref() : nil(true) {}
+  bulk_ref(const string_ref & d) : data(d), nil(false) {}
+};
+
+typedef std::vector<bulk_ref> bulk_ref_vector;
+
+// What a nil bulk reads as through the string_type and string_vector
+// interfaces, and what the UDFs return for it.
+extern const string_type missing_value;
+
+// Commands queued for a single round trip.  Arguments are copied into the
+// pipeline's output buffer, so they need not outlive the call that queues
+// them.  RedisClient::exec() writes the whole buffer at once and decodes
+// one reply per command.
+
+class RedisPipeline {
+	public:
+		RedisPipeline() {}
+
+		void           command(const string_ref &);
+		void           command(const string_ref &,const string_ref &);
+		void           command(const string_ref &,const string_ref &,const string_ref &);
+		void           command(const string_ref &,const string_ref &,const string_ref &,const string_ref &);
+		void           command(const string_ref_vector &);
+
+		// Queues a command exactly as encoded by another pipeline, e.g. one
+		// taken out with encoded() to resend it elsewhere.
+		void           command_encoded(const string_ref &);
+		void           encoded(size_t i,string_type & out) const;
+
+		size_t         size() const { return starts_.size(); }
+		bool           empty() const { return starts_.empty(); }
+		size_t         bytes() const { return enc_.size(); }
+		void           clear() { enc_.clear(); starts_.clear(); }
+
+	private:
+		friend class RedisClient;
+		resp_encoder        enc_;
+		std::vector<size_t> starts_;   // offset of each command in enc_
+};
+
 class RedisClient {
 	private:
-		void send_(const string_type &);
+		void send_();
+		void send_(const string_ref &);
+		void send_(const string_ref &,const string_ref &);
+		void send_(const string_ref &,const string_ref &,const string_ref &);
+		void send_(const string_ref &,const string_ref &,const string_ref &,const string_ref &);
+		void send_hmget_(const string_ref &,const string_ref_vector &);
+		const resp_value & recv_reply_();
+		void check_error_reply_(const resp_value &);
+		bool is_redirect_(const resp_value &);
 		void recv_ok_reply_();
 		string_type recv_single_line_reply_();
 		string_type recv_bulk_reply_();
+		void recv_bulk_reply_(string_type &);
+		void recv_bulk_reply_(string_ref &);
+		int_type recv_int_reply_();
+		const resp_value * recv_multi_bulk_nodes_(int_type &);
 		int_type recv_multi_bulk_reply_(string_vector &);
-		int_type recv_bulk_reply_(char);
-		string_type read_line(int socket, ssize_t max_size = 2048);
-		string_type read_n(int, ssize_t);
+		int_type recv_multi_bulk_reply_(bulk_ref_vector &);
+		const resp_value * decode_reply_(const resp_value *, redis_reply &);
+		void deadline_in_(int ms) { deadline_ = ms > 0 ? monotonic_ms() + ms : 0; }
+		void io_failed_();
 	private:
     int socket_;
+    bool broken_;
+    resp_encoder enc_;
+    resp_reader reader_;
+    redis_timeouts timeouts_;
+    unsigned long long deadline_;   // of the operation in progress, 0 for none
+    CircuitBreaker * breaker_;
+    stat_command read_cmd_;          // of begin_read()
+    string_ref read_key_;            // of begin_read(), in the caller's argv
+    command_trace trace_;            // of the command in flight
+    unsigned long long sent_us_;     // when begin_read() or send() sent, for the stats
 	public:
+		// host "unix:/path/to.sock" connects to a Unix domain socket and
+		// ignores port.  The socket is non-blocking; every wait for it is
+		// bounded by the deadlines in timeouts.
 		explicit RedisClient(const string_type & host = "localhost", 
-                    unsigned int port = 6379);
+                    unsigned int port = 6379,
+                    const redis_timeouts & timeouts = redis_timeouts());
 
     ~RedisClient();
+
+    // True once an I/O or framing error left the connection unusable.
+    bool           broken() const { return broken_; }
+    // Reports every reply and I/O failure of this connection to breaker.
+    void           observe(CircuitBreaker * breaker) { breaker_ = breaker; }
     
-    void           auth(const string_type & pass);
+    void           auth(const string_ref & pass);
+    // Lets the next command touch a slot this cluster node is importing.
+    void           asking();
 
-		void           set(const string_type &,const string_type &);
-		string_type    get(const string_type &);
+		// The string_ref forms return a view into the read buffer instead
+		// of a copy; it stays valid until the next command on this client.
+
+		void           set(const string_ref &,const string_ref &);
+		string_type    get(const string_ref &);
+		void           get(const string_ref &,string_type &);
+		void           get(const string_ref &,string_ref &);
 		
-		void           hset(const string_type &,const string_type &,const string_type &);
-		string_type    hget(const string_type &,const string_type &);
+		void           hset(const string_ref &,const string_ref &,const string_ref &);
+		string_type    hget(const string_ref &,const string_ref &);
+		void           hget(const string_ref &,const string_ref &,string_type &);
+		void           hget(const string_ref &,const string_ref &,string_ref &);
 		
-		void           hmset(const string_type &,const string_vector &,const string_vector &);
-		void           hmget(const string_type &,const string_vector &,string_vector &);
+		void           hmset(const string_ref &,const string_ref_vector &,const string_ref_vector &);
+		void           hmset(const string_ref &,const string_vector &,const string_vector &);
+		// out is resized to one entry per field
+		void           hmget(const string_ref &,const string_ref_vector &,string_vector &);
+		void           hmget(const string_ref &,const string_vector &,string_vector &);
+		// views into the read buffer, with missing fields as nil
+		void           hmget(const string_ref &,const string_ref_vector &,bulk_ref_vector &);
 		
-		string_type    getset(const string_type &,const string_type &);
-		void           del(const string_type &);
+		string_type    getset(const string_ref &,const string_ref &);
+		void           getset(const string_ref &,const string_ref &,string_type &);
+		void           getset(const string_ref &,const string_ref &,string_ref &);
+		void           del(const string_ref &);
+		// the value after the increment
+		int_type       incrby(const string_ref &,int_type);
+		int_type       hincrby(const string_ref &,const string_ref &,int_type);
+		void           hincrbyfloat(const string_ref &,const string_ref &,double,string_type &);
 		void           save();
 		void           bgsave();
-		
-		
-};
 
-static RedisClient *_client = NULL;
+		// Sends every queued command with one write and fills replies with
+		// one entry per command, in order.  Redis errors are reported per
+		// command as redis_reply::reply_error and do not abort the batch; only a
+		// connection or protocol failure throws.  The pipeline is cleared.
+		void           exec(RedisPipeline &,reply_vector &);
+
+		// exec() in two halves, so that pipelines for several servers can
+		// all be sent before waiting on any of them.  send() returns the
+		// number of replies to collect with recv().
+		size_t         send(RedisPipeline &);
+		void           recv(size_t,reply_vector &);
+
+		// A read command (GET, HGET or HMGET) split in two, for hedged
+		// reads: begin_read() sends argv, fd() can then be polled for the
+		// reply and end_read() reads it like get() or hmget() would.
+		// abandon() gives up on a reply that will not be read; the
+		// connection is closed at checkin.
+		void           begin_read(const string_ref_vector &);
+		void           end_read(string_ref &);
+		void           end_read(string_vector &);
+		void           end_read(bulk_ref_vector &);
+		int            fd() const { return socket_; }
+		void           abandon() { broken_ = true; }
 
-RedisClient *init_client_if_isnull();
+		// EVALSHA: argv is "EVALSHA", sha, numkeys, keys..., args...  The
+		// reply is decoded into out whatever its type; a Redis error,
+		// NOSCRIPT included, comes back as reply_error and only MOVED and
+		// ASK throw.  With script, SCRIPT LOAD script goes first in the same
+		// round trip, for a server that answered NOSCRIPT.
+		void           evalsha(const string_ref_vector &,redis_reply &);
+		void           evalsha(const string_ref_vector &,const string_ref &,redis_reply &);
+
+		// Reads one more reply, for connections in subscribe mode.  Waits
+		// without a deadline.
+		void           recv(redis_reply &);
+
+		// Wakes up a thread blocked reading this connection; for use from
+		// another thread during shutdown.
+		void           shutdown();
+};
 
 #endif
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include "redis_compress.h"
+#include "redis_stats.h"
+
+#include <cstdlib>
+#include <string.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <set>
+#include <boost/cstdint.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+static size_t env_size(const char * name, size_t fallback)
+{
+  const char * value = getenv(name);
+  long n = value && *value ? atol(value) : -1;
+  return n >= 0 ? static_cast<size_t>(n) : fallback;
+}
+
+size_t compress_threshold = env_size("REDIS_COMPRESS_BYTES", 0);
+
+static const int compress_level = static_cast<int>(env_size("REDIS_COMPRESS_LEVEL", 1));
+
+static const char magic[3] = { '\xff', 'R', 'Z' };
+
+enum codec { codec_deflate = 'd' };
+
+// deflate cannot expand its input by more than this
+static const size_t deflate_max_ratio = 1032;
+
+// The calling thread's zlib streams, set up on first use and ended when
+// the thread exits.  Like the stats blocks, they are owned through a plain
+// pthread key that stop_compress() deletes at unload, so mysqld's threads,
+// which outlive the plugin, never run its code on exit.
+
+namespace {
+
+struct zlib_streams
+{
+  z_stream deflater;
+  z_stream inflater;
+  bool     deflater_ok;
+  bool     inflater_ok;
+
+  zlib_streams() : deflater_ok(false), inflater_ok(false)
+  {
+    memset(&deflater, 0, sizeof(deflater));
+    memset(&inflater, 0, sizeof(inflater));
+  }
+  ~zlib_streams()
+  {
+    if (deflater_ok)
+      deflateEnd(&deflater);
+    if (inflater_ok)
+      inflateEnd(&inflater);
+  }
+};
+
+}
+
+static boost::mutex              streams_mutex_;
+static std::set<zlib_streams *>  streams_;      // of every live thread
+static __thread zlib_streams *   local_ = NULL;
+
+static void end_streams(void * p)
+{
+  zlib_streams * s = static_cast<zlib_streams *>(p);
+  {
+    boost::lock_guard<boost::mutex> lock(streams_mutex_);
+    streams_.erase(s);
+  }
+  delete s;
+}
+
+static pthread_key_t owner_key_;
+static bool          owner_key_ok_ = pthread_key_create(&owner_key_, end_streams) == 0;
+
+static zlib_streams & local_streams()
+{
+  if (!local_)
+  {
+    local_ = new zlib_streams();
+    boost::lock_guard<boost::mutex> lock(streams_mutex_);
+    streams_.insert(local_);
+    if (owner_key_ok_)
+      pthread_setspecific(owner_key_, local_);
+  }
+  return *local_;
+}
+
+void stop_compress()
+{
+  boost::lock_guard<boost::mutex> lock(streams_mutex_);
+  if (owner_key_ok_)
+  {
+    owner_key_ok_ = false;
+    pthread_key_delete(owner_key_);
+  }
+  // No UDF runs during unload, so every thread's streams can go.
+  for (std::set<zlib_streams *>::iterator it = streams_.begin(); it != streams_.end(); ++it)
+    delete *it;
+  streams_.clear();
+}
+
+bool compress_value(const string_ref & value, string_type & out)
+{
+  if (value.size <= compress_header_size || value.size > compress_max_size)
+    return false;
+  thread_stats * stats = local_stats();
+  unsigned long long started = stats ? monotonic_us() : 0;
+
+  zlib_streams & s = local_streams();
+  if (!s.deflater_ok)
+  {
+    if (deflateInit(&s.deflater, compress_level) != Z_OK)
+      return false;
+    s.deflater_ok = true;
+  }
+  else
+    deflateReset(&s.deflater);
+
+  // Only worth it if the result is smaller, so give deflate no more room.
+  size_t room = value.size - compress_header_size;
+  out.resize(value.size);
+  s.deflater.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(value.data));
+  s.deflater.avail_in  = value.size;
+  s.deflater.next_out  = reinterpret_cast<Bytef *>(&out[compress_header_size]);
+  s.deflater.avail_out = room;
+  bool shrunk = deflate(&s.deflater, Z_FINISH) == Z_STREAM_END;
+
+  if (stats)
+    stats->compressed(value.size, shrunk ? compress_header_size + s.deflater.total_out : value.size,
+                      monotonic_us() - started);
+  if (!shrunk)
+    return false;
+
+  memcpy(&out[0], magic, sizeof(magic));
+  out[3] = static_cast<char>(codec_deflate);
+  boost::uint32_t size = value.size;
+  for (int i = 0; i < 4; ++i)
+    out[4 + i] = static_cast<char>(size >> (8 * i));
+  out.resize(compress_header_size + s.deflater.total_out);
+  return true;
+}
+
+bool compressed_size(const string_ref & value, size_t & size)
+{
+  if (value.size <= compress_header_size || memcmp(value.data, magic, sizeof(magic)) != 0)
+    return false;
+  switch (value.data[3])
+  {
+  case codec_deflate:
+    break;
+  default:
+    return false;
+  }
+  const unsigned char * p = reinterpret_cast<const unsigned char *>(value.data) + 4;
+  size = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<size_t>(p[3]) << 24);
+  return size <= compress_max_size && size <= (value.size - compress_header_size) * deflate_max_ratio;
+}
+
+static bool inflate_value(const string_ref & body, char * out, size_t size)
+{
+  zlib_streams & s = local_streams();
+  if (!s.inflater_ok)
+  {
+    if (inflateInit(&s.inflater) != Z_OK)
+      return false;
+    s.inflater_ok = true;
+  }
+  else
+    inflateReset(&s.inflater);
+
+  s.inflater.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(body.data));
+  s.inflater.avail_in  = body.size;
+  s.inflater.next_out  = reinterpret_cast<Bytef *>(out);
+  s.inflater.avail_out = size;
+  return inflate(&s.inflater, Z_FINISH) == Z_STREAM_END && s.inflater.total_out == size;
+}
+
+bool decompress_value(const string_ref & value, char * out, size_t size)
+{
+  thread_stats * stats = local_stats();
+  unsigned long long started = stats ? monotonic_us() : 0;
+
+  string_ref body(value.data + compress_header_size, value.size - compress_header_size);
+  bool ok = false;
+  switch (value.data[3])
+  {
+  case codec_deflate:
+    ok = inflate_value(body, out, size);
+    break;
+  }
+
+  if (stats && ok)
+    stats->decompressed(value.size, size, monotonic_us() - started);
+  return ok;
+}
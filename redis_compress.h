@@ -0,0 +1,52 @@
+#ifndef _REDIS_COMPRESS_H
+#define _REDIS_COMPRESS_H
+
+#include "redis_client.h"
+
+// Transparent value compression (REDIS_COMPRESS_BYTES > 0).
+//
+// Values written through the UDFs that are at least REDIS_COMPRESS_BYTES
+// long are stored compressed behind an 8-byte header: the bytes FF 'R' 'Z',
+// a codec id, and the original length as a 32-bit little-endian number.
+// The only codec is 'd', zlib deflate at REDIS_COMPRESS_LEVEL (default 1);
+// a value naming another codec is treated as not compressed.  0xFF never
+// starts UTF-8 text, so legacy values are not mistaken for compressed ones.
+// A header announcing more than compress_max_size bytes, or more than
+// deflate's 1032:1 ratio allows for the body, is not trusted, so a foreign
+// value cannot make a reader allocate gigabytes; such a value, and one
+// whose body does not inflate to exactly the announced length, is returned
+// as stored.  Values that do not shrink are stored as they are.
+// Reads recognise compressed values whatever the setting, so compression
+// can be turned off without rewriting data.
+//
+// Each thread keeps one deflate and one inflate stream and resets them per
+// value, so there is no per-value allocation of zlib's state.
+
+enum { compress_header_size = 8 };
+
+// Largest value compressed: the UDFs' largest result (MEDIUMBLOB).
+static const size_t compress_max_size = 16777215;
+
+extern size_t compress_threshold;   // 0: off
+
+inline bool compress_wanted(size_t size)
+{
+  return compress_threshold && size >= compress_threshold;
+}
+
+// Deflates value into out, header included.  False when it would not
+// shrink; value is then to be stored as it is.
+bool compress_value(const string_ref & value, string_type & out);
+
+// True when value carries the header; size is then the original length.
+bool compressed_size(const string_ref & value, size_t & size);
+
+// Inflates value, which compressed_size() accepted, into out, which holds
+// exactly size bytes.  False when the body does not inflate to that.
+bool decompress_value(const string_ref & value, char * out, size_t size);
+
+// Ends every thread's streams and stops ending them at thread exit.
+// Called once, when the plugin is unloaded.
+void stop_compress();
+
+#endif
@@ -0,0 +1,245 @@
+#include "redis_counter.h"
+#include "redis_shard.h"
+#include "redis_cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+RedisCounters::RedisCounters(RedisShards & shards, unsigned interval_ms, size_t max_pending)
+  : shards_(shards), interval_ms_(interval_ms), max_pending_(max_pending),
+    spare_(shard_count), pending_(0), commands_(0), stop_(false), errors_(0)
+{
+  thread_ = boost::thread(&RedisCounters::run_, this);
+}
+
+RedisCounters::~RedisCounters()
+{
+  // The flusher sends what is left before it exits.
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stop_ = true;
+    wake_.notify_one();
+  }
+  thread_.join();
+}
+
+void RedisCounters::add(counter_kind kind, const string_ref & key, const string_ref & field,
+                        long long delta, double real_delta)
+{
+  shard & s = shards_table_[boost::hash_range(key.data, key.data + key.size) % shard_count];
+  bool full = false;
+  {
+    boost::lock_guard<boost::mutex> lock(s.mutex);
+    boost::uint32_t key_len = key.size;
+    s.scratch.assign(1, static_cast<char>(kind));
+    s.scratch.append(reinterpret_cast<const char *>(&key_len), sizeof(key_len));
+    s.scratch.append(key.data, key.size);
+    if (kind != kind_incrby)
+      s.scratch.append(field.data, field.size);
+
+    counter_map::iterator it = s.map.find(s.scratch);
+    if (it == s.map.end())
+    {
+      pending_counter & c = s.map[s.scratch];
+      c.kind = kind;
+      c.key.assign(key.data, key.size);
+      if (kind != kind_incrby)
+        c.field.assign(field.data, field.size);
+      c.delta = delta;
+      c.real_delta = real_delta;
+      full = ++pending_ == max_pending_;
+    }
+    else
+    {
+      it->second.delta += delta;
+      it->second.real_delta += real_delta;
+    }
+    ++s.increments;
+  }
+  if (full)
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    wake_.notify_one();
+  }
+}
+
+unsigned long RedisCounters::flush(string_type & last_error)
+{
+  send_();
+
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  unsigned long errors = errors_;
+  last_error.swap(last_error_);
+  last_error_.clear();
+  errors_ = 0;
+  return errors;
+}
+
+RedisCounters::counters RedisCounters::stats()
+{
+  counters c;
+  c.increments = 0;
+  for (int i = 0; i < shard_count; ++i)
+  {
+    boost::lock_guard<boost::mutex> lock(shards_table_[i].mutex);
+    c.increments += shards_table_[i].increments;
+  }
+  c.commands = commands_.load(boost::memory_order_relaxed);
+  c.pending  = pending_.load(boost::memory_order_relaxed);
+  return c;
+}
+
+void RedisCounters::fail_(unsigned long n, const string_type & error)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  errors_ += n;
+  last_error_ = error;
+}
+
+void RedisCounters::run_()
+{
+  for (;;)
+  {
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      if (!stop_ && pending_.load() < max_pending_)
+        wake_.timed_wait(lock, boost::posix_time::milliseconds(interval_ms_));
+      if (stop_)
+        break;
+    }
+    send_();
+  }
+  send_();
+}
+
+void RedisCounters::send_()
+{
+  boost::lock_guard<boost::mutex> sending(send_mutex_);
+
+  // Take every shard's counters, leaving the emptied maps of the last
+  // round in their place so their buckets are reused.
+  for (int i = 0; i < shard_count; ++i)
+  {
+    shard & s = shards_table_[i];
+    boost::lock_guard<boost::mutex> lock(s.mutex);
+    s.map.swap(spare_[i]);
+  }
+
+  std::vector<RedisPipeline> pipelines;
+  std::vector<size_t> queued;
+  char number[32];
+  size_t taken = 0;
+  for (int i = 0; i < shard_count; ++i)
+  {
+    taken += spare_[i].size();
+    for (counter_map::const_iterator it = spare_[i].begin(); it != spare_[i].end(); ++it)
+    {
+      const pending_counter & c = it->second;
+      if (c.kind == kind_hincrbyfloat ? c.real_delta == 0 : c.delta == 0)
+        continue;    // increments that cancelled out
+      size_t node = shards_.node_for(c.key);
+      if (node >= pipelines.size())
+      {
+        pipelines.resize(node + 1);
+        queued.resize(node + 1, 0);
+      }
+      RedisPipeline & pipeline = pipelines[node];
+      switch (c.kind)
+      {
+      case kind_incrby:
+        snprintf(number, sizeof(number), "%lld", c.delta);
+        pipeline.command("INCRBY", c.key, number);
+        break;
+      case kind_hincrby:
+        snprintf(number, sizeof(number), "%lld", c.delta);
+        pipeline.command("HINCRBY", c.key, c.field, number);
+        break;
+      case kind_hincrbyfloat:
+        snprintf(number, sizeof(number), "%.17g", c.real_delta);
+        pipeline.command("HINCRBYFLOAT", c.key, c.field, number);
+        break;
+      }
+      ++queued[node];
+    }
+  }
+  pending_ -= taken;
+
+  if (!pipelines.empty())
+  {
+    std::vector<reply_vector> replies;
+    string_vector errors;
+    {
+      PooledClients clients(shards_);
+      exec_routed(shards_, clients, pipelines, replies, errors);
+    }
+    for (size_t n = 0; n < queued.size(); ++n)
+    {
+      commands_ += queued[n];
+      if (!errors[n].empty())
+        fail_(queued[n], errors[n]);
+      else
+        for (size_t i = 0; i < replies[n].size(); ++i)
+          if (!replies[n][i].ok())
+            fail_(1, replies[n][i].str);
+    }
+  }
+
+  RedisCache * cache = redis_cache();
+  for (int i = 0; i < shard_count; ++i)
+  {
+    if (cache)
+      for (counter_map::const_iterator it = spare_[i].begin(); it != spare_[i].end(); ++it)
+      {
+        if (it->second.kind == kind_incrby)
+          cache->invalidate(it->second.key);
+        else
+          cache->invalidate(it->second.key, it->second.field);
+      }
+    spare_[i].clear();
+  }
+}
+
+bool counter_coalescing_enabled()
+{
+  static int enabled = -1;
+  if (enabled < 0)
+  {
+    const char * value = getenv("REDIS_COUNTER_COALESCE");
+    enabled = (value && atoi(value) != 0) ? 1 : 0;
+  }
+  return enabled == 1;
+}
+
+static RedisCounters * global_counters_ = NULL;
+static boost::once_flag global_counters_once_ = BOOST_ONCE_INIT;
+
+static void create_global_counters()
+{
+  const char * interval = getenv("REDIS_COUNTER_FLUSH_MS");
+  const char * pending  = getenv("REDIS_COUNTER_MAX_PENDING");
+
+  long ms = interval ? atol(interval) : 0;
+  if (ms <= 0)
+    ms = 100;
+  long n = pending ? atol(pending) : 0;
+  if (n <= 0)
+    n = 10000;
+
+  global_counters_ = new RedisCounters(redis_shards(), ms, n);
+}
+
+void stop_counters()
+{
+  delete global_counters_;
+  global_counters_ = NULL;
+}
+
+RedisCounters & redis_counters()
+{
+  boost::call_once(global_counters_once_, create_global_counters);
+  return *global_counters_;
+}
@@ -0,0 +1,114 @@
+#ifndef _REDIS_COUNTER_H
+#define _REDIS_COUNTER_H
+
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "redis_client.h"
+
+class RedisShards;
+
+// Coalescing mode for the increment UDFs (REDIS_COUNTER_COALESCE=1).
+//
+// redis_incrby(), redis_hincrby() and redis_hincrbyfloat() add their delta
+// to an in-process table instead of sending it, so a counter bumped a
+// thousand times between flushes costs one INCRBY, HINCRBY or HINCRBYFLOAT
+// carrying the sum.  The table is split into shards by key, each a
+// mutex-protected hash map, so concurrent UDFs rarely meet.  A background
+// thread swaps every shard's map for an empty one each interval_ms, or
+// sooner once max_pending counters are waiting, and sends the sums as one
+// pipeline per node.
+//
+// Increments are not idempotent, so a batch lost to a connection failure
+// is not retried: Redis may or may not have applied it.  Such failures are
+// reported by the next flush().
+
+class RedisCounters : private boost::noncopyable
+{
+public:
+  enum counter_kind { kind_incrby, kind_hincrby, kind_hincrbyfloat };
+
+  struct counters
+  {
+    boost::uint64_t increments;   // deltas added
+    boost::uint64_t commands;     // commands sent for them
+    boost::uint64_t pending;      // counters waiting for the next flush
+  };
+
+  RedisCounters(RedisShards & shards, unsigned interval_ms, size_t max_pending);
+  ~RedisCounters();
+
+  // field is ignored for kind_incrby.  Integer kinds use delta, the float
+  // kind real_delta.
+  void          add(counter_kind kind, const string_ref & key, const string_ref & field,
+                    long long delta, double real_delta);
+
+  // Sends everything added before the call.  Returns the number of
+  // commands that failed since the previous flush and the last error seen.
+  unsigned long flush(string_type & last_error);
+
+  counters      stats();
+
+private:
+  struct pending_counter
+  {
+    counter_kind kind;
+    string_type  key;
+    string_type  field;
+    long long    delta;
+    double       real_delta;
+  };
+
+  // pending counters by kind, key and field, packed into one string
+  typedef boost::unordered_map<string_type, pending_counter> counter_map;
+
+  struct shard
+  {
+    boost::mutex    mutex;
+    counter_map     map;
+    string_type     scratch;      // lookup key, reused
+    boost::uint64_t increments;
+    shard() : increments(0) {}
+  };
+
+  enum { shard_count = 16 };
+
+  void          run_();
+  void          send_();
+  void          fail_(unsigned long n, const string_type & error);
+
+  RedisShards &                   shards_;
+  unsigned                        interval_ms_;
+  size_t                          max_pending_;
+  shard                           shards_table_[shard_count];
+  std::vector<counter_map>        spare_;        // the flusher's half of each shard
+  boost::atomic<size_t>           pending_;
+  boost::atomic<boost::uint64_t>  commands_;
+
+  boost::mutex                    send_mutex_;   // one send_() at a time
+  boost::mutex                    mutex_;
+  boost::condition_variable       wake_;
+  bool                            stop_;
+  unsigned long                   errors_;
+  string_type                     last_error_;
+
+  boost::thread                   thread_;
+};
+
+// True when REDIS_COUNTER_COALESCE is set to a non-zero value.
+bool            counter_coalescing_enabled();
+
+// Process-wide counter table over redis_shards(), started on first use.
+RedisCounters & redis_counters();
+
+// Sends the last sums and joins the flusher.  Called once, when the plugin
+// is unloaded.
+void            stop_counters();
+
+#endif
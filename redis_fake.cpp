@@ -0,0 +1,626 @@
+#include "redis_fake.h"
+#include "anet.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fnmatch.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static long env_long(const char * name, long fallback)
+{
+  const char * value = getenv(name);
+  if (!value || !*value)
+    return fallback;
+  char * end = NULL;
+  long n = strtol(value, &end, 10);
+  return (*end == '\0' && n >= 0) ? n : fallback;
+}
+
+static void upper(string_type & s)
+{
+  for (size_t i = 0; i < s.size(); ++i)
+    if (s[i] >= 'a' && s[i] <= 'z')
+      s[i] -= 'a' - 'A';
+}
+
+fake_faults fake_faults::from_env()
+{
+  fake_faults faults;
+  faults.latency_us    = env_long("FAKE_LATENCY_US", faults.latency_us);
+  faults.write_chunk   = env_long("FAKE_WRITE_CHUNK", faults.write_chunk);
+  faults.reset_every   = env_long("FAKE_RESET_EVERY", faults.reset_every);
+  faults.read_chunk    = env_long("FAKE_READ_CHUNK", faults.read_chunk);
+  faults.read_pause_ms = env_long("FAKE_READ_PAUSE_MS", faults.read_pause_ms);
+
+  // GET=100,HGET=250
+  const char * spec = getenv("FAKE_COMMAND_LATENCY_US");
+  string_type rest = spec ? spec : "";
+  while (!rest.empty())
+  {
+    string_type::size_type comma = rest.find(',');
+    string_type item = rest.substr(0, comma);
+    rest = comma == string_type::npos ? string_type() : rest.substr(comma + 1);
+    string_type::size_type eq = item.find('=');
+    if (eq == string_type::npos)
+      continue;
+    string_type name = item.substr(0, eq);
+    upper(name);
+    faults.command_latency_us[name] = atoi(item.c_str() + eq + 1);
+  }
+  return faults;
+}
+
+// ---- reply encoding ----
+
+static void reply_line(string_type & out, char type, const string_type & text)
+{
+  out += type;
+  out += text;
+  out += "\r\n";
+}
+
+static void reply_integer(string_type & out, long long n)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), ":%lld\r\n", n);
+  out += buf;
+}
+
+static void reply_header(string_type & out, char type, long long n)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%c%lld\r\n", type, n);
+  out += buf;
+}
+
+static void reply_bulk(string_type & out, const string_type & s)
+{
+  reply_header(out, '$', s.size());
+  out += s;
+  out += "\r\n";
+}
+
+static void reply_nil(string_type & out)
+{
+  out += "$-1\r\n";
+}
+
+static const char wrongtype[] = "WRONGTYPE Operation against a key holding the wrong kind of value";
+static const char not_integer[] = "ERR value is not an integer or out of range";
+
+// ---- server ----
+
+FakeRedis::FakeRedis(int port, const fake_faults & faults)
+  : faults_(faults), listen_fd_(-1), epoll_fd_(-1), port_(port), commands_(0)
+{
+  wake_fd_[0] = wake_fd_[1] = -1;
+
+  char err[ANET_ERR_LEN];
+  char bindaddr[] = "127.0.0.1";
+  listen_fd_ = anetTcpServer(err, port, bindaddr);
+  if (listen_fd_ == ANET_ERR)
+    throw connection_error(err);
+  anetNonBlock(err, listen_fd_);
+
+  struct sockaddr_in sa;
+  socklen_t len = sizeof(sa);
+  if (getsockname(listen_fd_, (struct sockaddr *)&sa, &len) == 0)
+    port_ = ntohs(sa.sin_port);
+
+  epoll_fd_ = epoll_create(64);
+  if (epoll_fd_ < 0 || pipe(wake_fd_) < 0)
+  {
+    string_type msg = strerror(errno);
+    if (epoll_fd_ >= 0)
+      close(epoll_fd_);
+    close(listen_fd_);
+    throw connection_error("fake server: " + msg);
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+  ev.data.fd = wake_fd_[0];
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_[0], &ev);
+
+  thread_ = boost::thread(&FakeRedis::run_, this);
+}
+
+FakeRedis::~FakeRedis()
+{
+  stop();
+  for (std::map<int, connection *>::iterator it = connections_.begin(); it != connections_.end(); ++it)
+  {
+    close(it->first);
+    delete it->second;
+  }
+  close(listen_fd_);
+  close(epoll_fd_);
+  close(wake_fd_[0]);
+  close(wake_fd_[1]);
+}
+
+void FakeRedis::stop()
+{
+  if (thread_.joinable())
+  {
+    char c = 0;
+    while (write(wake_fd_[1], &c, 1) < 0 && errno == EINTR)
+      ;
+    thread_.join();
+  }
+}
+
+void FakeRedis::run_()
+{
+  struct epoll_event events[64];
+  for (;;)
+  {
+    int n = epoll_wait(epoll_fd_, events, 64, next_timeout_ms_());
+    if (n < 0 && errno != EINTR)
+      return;
+
+    std::vector<int> dead;
+    for (int i = 0; i < n; ++i)
+    {
+      int fd = events[i].data.fd;
+      if (fd == wake_fd_[0])
+        return;
+      if (fd == listen_fd_)
+      {
+        accept_();
+        continue;
+      }
+      std::map<int, connection *>::iterator it = connections_.find(fd);
+      if (it == connections_.end())
+        continue;
+      connection & c = *it->second;
+      bool ok = !(events[i].events & (EPOLLERR | EPOLLHUP));
+      if (ok && (events[i].events & EPOLLIN))
+        ok = read_(c);
+      if (ok && (events[i].events & EPOLLOUT))
+        ok = write_(c);
+      if (!ok)
+        dead.push_back(fd);
+    }
+    for (size_t i = 0; i < dead.size(); ++i)
+      close_(connections_[dead[i]], connections_[dead[i]]->reset);
+
+    // Replies whose latency has passed, paused readers whose pause has.
+    unsigned long long now = monotonic_us();
+    dead.clear();
+    for (std::map<int, connection *>::iterator it = connections_.begin(); it != connections_.end(); ++it)
+    {
+      service_(*it->second, now);
+      if (it->second->out_pos < it->second->out.size() && !write_(*it->second))
+        dead.push_back(it->first);
+      else
+        watch_(*it->second);
+    }
+    for (size_t i = 0; i < dead.size(); ++i)
+      close_(connections_[dead[i]], false);
+  }
+}
+
+void FakeRedis::accept_()
+{
+  char err[ANET_ERR_LEN];
+  for (;;)
+  {
+    int fd = anetAccept(err, listen_fd_, NULL, NULL);
+    if (fd == ANET_ERR)
+      return;
+    anetNonBlock(err, fd);
+    anetTcpNoDelay(err, fd);
+    if (faults_.read_chunk)
+    {
+      // a small receive window, so the client's writes really back up; not
+      // too small, or the kernel's silly window avoidance turns it into
+      // 200 ms zero window probes
+      int size = static_cast<int>(std::max<size_t>(faults_.read_chunk * 16, 16384));
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    connection * c = new connection(fd);
+    connections_[fd] = c;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    c->events = EPOLLIN;
+  }
+}
+
+bool FakeRedis::read_(connection & c)
+{
+  size_t avail;
+  char * p = c.in.write_space(avail);
+  if (faults_.read_chunk && avail > faults_.read_chunk)
+    avail = faults_.read_chunk;
+  ssize_t n = recv(c.fd, p, avail, 0);
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  if (n == 0)
+    return false;
+  c.in.wrote(n);
+
+  unsigned long long now = monotonic_us();
+  if (faults_.read_pause_ms)
+  {
+    c.reading = false;
+    c.read_resume_ms = now / 1000 + faults_.read_pause_ms;
+  }
+
+  resp_reader::status status;
+  while ((status = c.in.parse()) == resp_reader::complete)
+  {
+    const resp_value * nodes = c.in.nodes();
+    command_args argv;
+    if (nodes[0].type == '*')
+      for (size_t i = 1; i < c.in.node_count(); ++i)
+        if (nodes[i].type == '$' && !nodes[i].nil)
+          argv.push_back(c.in.text(nodes[i]).str());
+    c.in.consume();
+    if (argv.empty())
+      continue;
+
+    ++commands_;
+    if (faults_.reset_every > 0 && commands_ % faults_.reset_every == 0)
+    {
+      c.reset = true;
+      return false;
+    }
+
+    upper(argv[0]);
+    pending_reply reply;
+    std::map<string_type, int>::const_iterator lat = faults_.command_latency_us.find(argv[0]);
+    reply.due_us = now + (lat != faults_.command_latency_us.end() ? lat->second : faults_.latency_us);
+    execute_(c, argv, reply.bytes);
+    c.pending.push_back(reply);
+  }
+  return status != resp_reader::invalid;
+}
+
+bool FakeRedis::write_(connection & c)
+{
+  // One write(2) per call, so that a write_chunk limit reaches the client as
+  // separate segments.
+  size_t left = c.out.size() - c.out_pos;
+  if (left == 0)
+    return true;
+  if (faults_.write_chunk && left > faults_.write_chunk)
+    left = faults_.write_chunk;
+  ssize_t n = send(c.fd, c.out.data() + c.out_pos, left, MSG_NOSIGNAL);
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  c.out_pos += n;
+  if (c.out_pos == c.out.size())
+  {
+    c.out.clear();
+    c.out_pos = 0;
+  }
+  return true;
+}
+
+void FakeRedis::service_(connection & c, unsigned long long now_us)
+{
+  // FIFO: a reply never overtakes an earlier one, even with less latency
+  while (!c.pending.empty() && c.pending.front().due_us <= now_us)
+  {
+    c.out += c.pending.front().bytes;
+    c.pending.pop_front();
+  }
+  if (!c.reading && c.read_resume_ms <= now_us / 1000)
+    c.reading = true;
+}
+
+void FakeRedis::watch_(connection & c)
+{
+  unsigned int events = (c.reading ? unsigned(EPOLLIN) : 0u) | (c.out_pos < c.out.size() ? unsigned(EPOLLOUT) : 0u);
+  if (events == c.events)
+    return;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = c.fd;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c.fd, &ev);
+  c.events = events;
+}
+
+void FakeRedis::close_(connection * c, bool reset)
+{
+  if (reset)
+  {
+    struct linger lg;
+    lg.l_onoff  = 1;
+    lg.l_linger = 0;
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  }
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  connections_.erase(c->fd);
+  delete c;
+}
+
+int FakeRedis::next_timeout_ms_() const
+{
+  unsigned long long now = monotonic_us();
+  long long wait = -1;
+  for (std::map<int, connection *>::const_iterator it = connections_.begin(); it != connections_.end(); ++it)
+  {
+    const connection & c = *it->second;
+    long long until = -1;
+    if (!c.pending.empty())
+      until = c.pending.front().due_us > now ? (c.pending.front().due_us - now + 999) / 1000 : 0;
+    if (!c.reading)
+    {
+      long long resume = c.read_resume_ms * 1000 > now ? (c.read_resume_ms * 1000 - now + 999) / 1000 : 0;
+      if (until < 0 || resume < until)
+        until = resume;
+    }
+    if (until >= 0 && (wait < 0 || until < wait))
+      wait = until;
+  }
+  return static_cast<int>(wait);
+}
+
+FakeRedis::entry * FakeRedis::find_(const string_type & key)
+{
+  std::map<string_type, entry>::iterator it = data_.find(key);
+  if (it == data_.end())
+    return NULL;
+  if (it->second.expires_ms && it->second.expires_ms <= monotonic_ms())
+  {
+    data_.erase(it);
+    return NULL;
+  }
+  return &it->second;
+}
+
+void FakeRedis::notify_(const string_type & key, const char * event)
+{
+  string_type channel = "__keyspace@0__:" + key;
+  for (std::map<int, connection *>::iterator it = connections_.begin(); it != connections_.end(); ++it)
+  {
+    connection & c = *it->second;
+    if (c.pattern.empty() || fnmatch(c.pattern.c_str(), channel.c_str(), 0) != 0)
+      continue;
+    pending_reply message;
+    message.due_us = 0;
+    reply_header(message.bytes, '*', 4);
+    reply_bulk(message.bytes, "pmessage");
+    reply_bulk(message.bytes, c.pattern);
+    reply_bulk(message.bytes, channel);
+    reply_bulk(message.bytes, event);
+    c.pending.push_back(message);
+  }
+}
+
+void FakeRedis::execute_(connection & c, const command_args & argv, string_type & out)
+{
+  const string_type & cmd = argv[0];
+  size_t argc = argv.size();
+
+  if (cmd == "PING")
+    reply_line(out, '+', "PONG");
+  else if (cmd == "AUTH" || cmd == "SELECT" || cmd == "SAVE")
+    reply_line(out, '+', "OK");
+  else if (cmd == "BGSAVE")
+    reply_line(out, '+', "Background saving started");
+  else if (cmd == "ECHO" && argc == 2)
+    reply_bulk(out, argv[1]);
+  else if (cmd == "DBSIZE")
+    reply_integer(out, data_.size());
+  else if (cmd == "FLUSHALL" || cmd == "FLUSHDB")
+  {
+    data_.clear();
+    reply_line(out, '+', "OK");
+  }
+  else if (cmd == "GET" && argc == 2)
+  {
+    entry * e = find_(argv[1]);
+    if (!e)
+      reply_nil(out);
+    else if (e->hash)
+      reply_line(out, '-', wrongtype);
+    else
+      reply_bulk(out, e->value);
+  }
+  else if ((cmd == "SET" && argc >= 3) || (cmd == "GETSET" && argc == 3))
+  {
+    entry * e = find_(argv[1]);
+    if (cmd == "GETSET")
+    {
+      if (e && e->hash)
+      {
+        reply_line(out, '-', wrongtype);
+        return;
+      }
+      if (e)
+        reply_bulk(out, e->value);
+      else
+        reply_nil(out);
+    }
+    else
+      reply_line(out, '+', "OK");
+    entry & slot = data_[argv[1]];
+    slot = entry();
+    slot.value = argv[2];
+    notify_(argv[1], "set");
+  }
+  else if ((cmd == "DEL" || cmd == "EXISTS") && argc >= 2)
+  {
+    long long n = 0;
+    for (size_t i = 1; i < argc; ++i)
+      if (find_(argv[i]))
+      {
+        ++n;
+        if (cmd == "DEL")
+        {
+          data_.erase(argv[i]);
+          notify_(argv[i], "del");
+        }
+      }
+    reply_integer(out, n);
+  }
+  else if ((cmd == "INCRBY" && argc == 3) || (cmd == "INCR" && argc == 2))
+  {
+    entry * e = find_(argv[1]);
+    long long value = 0, by = 1;
+    if (e && e->hash)
+      reply_line(out, '-', wrongtype);
+    else if ((e && !parse_integer(e->value.data(), e->value.size(), value))
+             || (argc == 3 && !parse_integer(argv[2].data(), argv[2].size(), by)))
+      reply_line(out, '-', not_integer);
+    else
+    {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%lld", value + by);
+      data_[argv[1]].value = buf;
+      reply_integer(out, value + by);
+      notify_(argv[1], "incrby");
+    }
+  }
+  else if (cmd == "EXPIRE" && argc == 3)
+  {
+    entry * e = find_(argv[1]);
+    long long seconds;
+    if (!parse_integer(argv[2].data(), argv[2].size(), seconds))
+      reply_line(out, '-', not_integer);
+    else if (!e)
+      reply_integer(out, 0);
+    else
+    {
+      e->expires_ms = monotonic_ms() + seconds * 1000;
+      reply_integer(out, 1);
+      notify_(argv[1], "expire");
+    }
+  }
+  else if (cmd.size() > 1 && cmd[0] == 'H' && argc >= 2)
+  {
+    // hash commands
+    entry * e = find_(argv[1]);
+    if (e && !e->hash)
+    {
+      reply_line(out, '-', wrongtype);
+      return;
+    }
+    if (cmd == "HGET" && argc == 3)
+    {
+      std::map<string_type, string_type>::const_iterator f;
+      if (e && (f = e->fields.find(argv[2])) != e->fields.end())
+        reply_bulk(out, f->second);
+      else
+        reply_nil(out);
+    }
+    else if (cmd == "HMGET" && argc >= 3)
+    {
+      reply_header(out, '*', argc - 2);
+      for (size_t i = 2; i < argc; ++i)
+      {
+        std::map<string_type, string_type>::const_iterator f;
+        if (e && (f = e->fields.find(argv[i])) != e->fields.end())
+          reply_bulk(out, f->second);
+        else
+          reply_nil(out);
+      }
+    }
+    else if ((cmd == "HSET" || cmd == "HMSET") && argc >= 4 && argc % 2 == 0)
+    {
+      entry & h = data_[argv[1]];
+      h.hash = true;
+      long long added = 0;
+      for (size_t i = 2; i < argc; i += 2)
+      {
+        if (h.fields.find(argv[i]) == h.fields.end())
+          ++added;
+        h.fields[argv[i]] = argv[i + 1];
+      }
+      if (cmd == "HSET")
+        reply_integer(out, added);
+      else
+        reply_line(out, '+', "OK");
+      notify_(argv[1], "hset");
+    }
+    else if (cmd == "HDEL" && argc >= 3)
+    {
+      long long n = 0;
+      for (size_t i = 2; e && i < argc; ++i)
+        n += e->fields.erase(argv[i]);
+      if (e && e->fields.empty())
+        data_.erase(argv[1]);
+      reply_integer(out, n);
+      if (n)
+        notify_(argv[1], "hdel");
+    }
+    else if (cmd == "HINCRBY" && argc == 4)
+    {
+      long long value = 0, by;
+      std::map<string_type, string_type>::const_iterator f;
+      if (e && (f = e->fields.find(argv[2])) != e->fields.end()
+          && !parse_integer(f->second.data(), f->second.size(), value))
+        reply_line(out, '-', "ERR hash value is not an integer");
+      else if (!parse_integer(argv[3].data(), argv[3].size(), by))
+        reply_line(out, '-', not_integer);
+      else
+      {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lld", value + by);
+        entry & h = data_[argv[1]];
+        h.hash = true;
+        h.fields[argv[2]] = buf;
+        reply_integer(out, value + by);
+        notify_(argv[1], "hincrby");
+      }
+    }
+    else if (cmd == "HINCRBYFLOAT" && argc == 4)
+    {
+      double value = 0;
+      char * end;
+      std::map<string_type, string_type>::const_iterator f;
+      if (e && (f = e->fields.find(argv[2])) != e->fields.end())
+      {
+        value = strtod(f->second.c_str(), &end);
+        if (*end || f->second.empty())
+        {
+          reply_line(out, '-', "ERR hash value is not a float");
+          return;
+        }
+      }
+      double by = strtod(argv[3].c_str(), &end);
+      if (*end || argv[3].empty())
+      {
+        reply_line(out, '-', "ERR value is not a valid float");
+        return;
+      }
+      char buf[64];
+      snprintf(buf, sizeof(buf), "%.17g", value + by);
+      entry & h = data_[argv[1]];
+      h.hash = true;
+      h.fields[argv[2]] = buf;
+      reply_bulk(out, buf);
+      notify_(argv[1], "hincrbyfloat");
+    }
+    else
+      reply_line(out, '-', "ERR wrong number of arguments for '" + cmd + "' command");
+  }
+  else if (cmd == "PSUBSCRIBE" && argc == 2)
+  {
+    c.pattern = argv[1];
+    reply_header(out, '*', 3);
+    reply_bulk(out, "psubscribe");
+    reply_bulk(out, argv[1]);
+    reply_integer(out, 1);
+  }
+  else
+    reply_line(out, '-', "ERR unknown command or wrong number of arguments for '" + cmd + "'");
+}
@@ -0,0 +1,108 @@
+#ifndef _REDIS_FAKE_H
+#define _REDIS_FAKE_H
+
+#include <deque>
+#include <map>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "redis_client.h"
+
+// Faults FakeRedis injects, all off by default.
+
+struct fake_faults
+{
+  int    latency_us;         // delay before every reply
+  std::map<string_type, int> command_latency_us;  // per command (upper case), instead of latency_us
+  size_t write_chunk;        // partial writes: at most this many bytes per write(2)
+  int    reset_every;        // reset the connection instead of answering every Nth command
+  size_t read_chunk;         // slow reader: at most this many bytes per read(2)...
+  int    read_pause_ms;      // ...then leave the connection unread this long
+
+  fake_faults() : latency_us(0), write_chunk(0), reset_every(0), read_chunk(0), read_pause_ms(0) {}
+
+  // FAKE_LATENCY_US, FAKE_COMMAND_LATENCY_US ("GET=100,HGET=250"),
+  // FAKE_WRITE_CHUNK, FAKE_RESET_EVERY, FAKE_READ_CHUNK, FAKE_READ_PAUSE_MS.
+  static fake_faults from_env();
+};
+
+// In-process stand-in for redis-server, for benchmarks and tests that must
+// run on one machine without a Redis deployment.
+//
+// One thread runs an epoll loop over a listening socket from anetTcpServer.
+// Strings and hashes live in memory, and the commands this plugin sends are
+// served: PING AUTH SELECT ECHO GET SET GETSET DEL EXISTS INCRBY HGET HSET
+// HMSET HMGET HDEL HINCRBY HINCRBYFLOAT EXPIRE DBSIZE FLUSHALL SAVE BGSAVE,
+// and PSUBSCRIBE, which then receives a keyspace notification for every
+// write.  Replies go out in request order, each after its injected latency;
+// a connection reset closes the socket with an RST instead of answering.
+
+class FakeRedis : private boost::noncopyable
+{
+public:
+  // port 0 takes any free port; port() tells which.  Throws
+  // connection_error when the socket cannot be set up.
+  explicit FakeRedis(int port = 0, const fake_faults & faults = fake_faults());
+  ~FakeRedis();
+
+  int          port() const { return port_; }
+  void         stop();
+
+private:
+  struct entry
+  {
+    bool                               hash;
+    string_type                        value;
+    std::map<string_type, string_type> fields;
+    unsigned long long                 expires_ms;   // monotonic, 0 = never
+    entry() : hash(false), expires_ms(0) {}
+  };
+
+  struct pending_reply
+  {
+    unsigned long long due_us;
+    string_type        bytes;
+  };
+
+  struct connection
+  {
+    int                       fd;
+    resp_reader               in;
+    std::deque<pending_reply> pending;
+    string_type               out;
+    size_t                    out_pos;
+    unsigned long long        read_resume_ms;   // slow reader pause, 0 when reading
+    string_type               pattern;          // PSUBSCRIBE pattern, empty if none
+    unsigned int              events;           // what epoll watches
+    bool                      reading;
+    bool                      reset;            // close with an RST
+    connection(int f)
+      : fd(f), out_pos(0), read_resume_ms(0), events(0), reading(true), reset(false) {}
+  };
+
+  typedef std::vector<string_type> command_args;
+
+  void         run_();
+  void         service_(connection & c, unsigned long long now_us);
+  void         accept_();
+  bool         read_(connection & c);
+  bool         write_(connection & c);
+  void         watch_(connection & c);
+  void         close_(connection * c, bool reset);
+  int          next_timeout_ms_() const;
+  entry *      find_(const string_type & key);
+  void         execute_(connection & c, const command_args & argv, string_type & reply);
+  void         notify_(const string_type & key, const char * event);
+
+  fake_faults                       faults_;
+  int                               listen_fd_;
+  int                               epoll_fd_;
+  int                               wake_fd_[2];
+  int                               port_;
+  unsigned long                     commands_;
+  std::map<int, connection *>       connections_;
+  std::map<string_type, entry>      data_;
+  boost::thread                     thread_;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "redis_memo.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+static const boost::uint32_t no_field = ~0u;
+
+statement_memo::statement_memo(size_t max_bytes)
+  : table_(64), count_(0), pos_(NULL), left_(0), used_(0), max_bytes_(max_bytes)
+{
+}
+
+statement_memo::~statement_memo()
+{
+  for (size_t i = 0; i < chunks_.size(); ++i)
+    free(chunks_[i]);
+}
+
+// FNV-1a over the key, a separator and the field.
+boost::uint64_t statement_memo::hash_(const string_ref & key, const string_ref * field)
+{
+  boost::uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.size; ++i)
+    h = (h ^ static_cast<unsigned char>(key.data[i])) * 1099511628211ULL;
+  h = (h ^ (field ? 0xff : 0xfe)) * 1099511628211ULL;
+  if (field)
+    for (size_t i = 0; i < field->size; ++i)
+      h = (h ^ static_cast<unsigned char>(field->data[i])) * 1099511628211ULL;
+  return h ? h : 1;
+}
+
+const statement_memo::slot * statement_memo::lookup_(boost::uint64_t h, const string_ref & key,
+                                                     const string_ref * field) const
+{
+  size_t mask = table_.size() - 1;
+  boost::uint32_t field_len = field ? field->size : no_field;
+
+  for (size_t i = h & mask; ; i = (i + 1) & mask)
+  {
+    const slot & s = table_[i];
+    if (s.hash == 0)
+      return &s;
+    if (s.hash == h && s.key_len == key.size && s.field_len == field_len
+        && memcmp(s.key, key.data, key.size) == 0
+        && (!field || memcmp(s.key + key.size, field->data, field->size) == 0))
+      return &s;
+  }
+}
+
+bool statement_memo::find(const string_ref & key, const string_ref * field, string_ref & value) const
+{
+  const slot * s = lookup_(hash_(key, field), key, field);
+  if (s->hash == 0)
+    return false;
+  value = string_ref(s->value, s->value_len);
+  return true;
+}
+
+char * statement_memo::alloc_(size_t n)
+{
+  if (n > left_)
+  {
+    size_t size = std::max(n, static_cast<size_t>(chunk_size));
+    char * chunk = static_cast<char *>(malloc(size));
+    if (!chunk)
+      throw std::bad_alloc();
+    chunks_.push_back(chunk);
+    pos_  = chunk;
+    left_ = size;
+  }
+  char * p = pos_;
+  pos_  += n;
+  left_ -= n;
+  used_ += n;
+  return p;
+}
+
+void statement_memo::grow_()
+{
+  std::vector<slot> old;
+  old.swap(table_);
+  table_.assign(old.size() * 2, slot());
+
+  size_t mask = table_.size() - 1;
+  for (size_t i = 0; i < old.size(); ++i)
+  {
+    if (old[i].hash == 0)
+      continue;
+    size_t j = old[i].hash & mask;
+    while (table_[j].hash != 0)
+      j = (j + 1) & mask;
+    table_[j] = old[i];
+  }
+}
+
+void statement_memo::insert(const string_ref & key, const string_ref * field, const string_ref & value)
+{
+  size_t field_size = field ? field->size : 0;
+  size_t bytes = key.size + field_size + value.size;
+  if (used_ + bytes + sizeof(slot) > max_bytes_
+      || key.size + field_size >= no_field || value.size >= no_field)
+    return;
+
+  // keep the load factor under 3/4
+  if ((count_ + 1) * 4 > table_.size() * 3)
+    grow_();
+
+  boost::uint64_t h = hash_(key, field);
+  slot * s = const_cast<slot *>(lookup_(h, key, field));
+  if (s->hash != 0)
+    return;
+
+  char * p = alloc_(bytes);
+  memcpy(p, key.data, key.size);
+  if (field)
+    memcpy(p + key.size, field->data, field->size);
+  memcpy(p + key.size + field_size, value.data, value.size);
+
+  s->hash      = h;
+  s->key       = p;
+  s->key_len   = key.size;
+  s->field_len = field ? field->size : no_field;
+  s->value     = p + key.size + field_size;
+  s->value_len = value.size;
+  used_ += sizeof(slot);
+  ++count_;
+}
@@ -0,0 +1,58 @@
+#ifndef _REDIS_MEMO_H
+#define _REDIS_MEMO_H
+
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "redis_protocol.h"
+
+// Statement-scoped memo of read replies (REDIS_STATEMENT_MEMO=1).
+//
+// Lives on a read UDF's UDF_INIT::ptr from *_init to *_deinit, so a key
+// repeated across the rows of one statement is fetched once and there is
+// nothing to invalidate.  Keys and values are copied into an arena of
+// large chunks and indexed by an open-addressing (linear probing) table of
+// fixed-size slots; nothing is freed individually.
+
+class statement_memo : private boost::noncopyable
+{
+public:
+  explicit statement_memo(size_t max_bytes);
+  ~statement_memo();
+
+  // field == NULL addresses the plain string stored at key.
+  bool   find(const string_ref & key, const string_ref * field, string_ref & value) const;
+  // Ignored once the memo holds max_bytes.
+  void   insert(const string_ref & key, const string_ref * field, const string_ref & value);
+
+  size_t size() const { return count_; }
+
+private:
+  struct slot
+  {
+    boost::uint64_t hash;       // 0 marks an empty slot
+    const char *    key;        // key bytes followed by field bytes
+    boost::uint32_t key_len;
+    boost::uint32_t field_len;  // ~0 for a plain string
+    const char *    value;
+    boost::uint32_t value_len;
+  };
+
+  static boost::uint64_t hash_(const string_ref & key, const string_ref * field);
+  const slot *    lookup_(boost::uint64_t h, const string_ref & key, const string_ref * field) const;
+  char *          alloc_(size_t n);
+  void            grow_();
+
+  enum { chunk_size = 64 * 1024 };
+
+  std::vector<slot>   table_;   // power-of-two size
+  size_t              count_;
+  std::vector<char *> chunks_;
+  char *              pos_;
+  size_t              left_;
+  size_t              used_;
+  size_t              max_bytes_;
+};
+
+#endif
@@ -0,0 +1,312 @@
+#include "redis_pool.h"
+
+#include "anet.h"
+
+#include <cstdlib>
+#include <arpa/inet.h>
+#include <boost/atomic/fences.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+static const char * env_or(const char * name, const char * fallback)
+{
+  const char * value = getenv(name);
+  return value && *value ? value : fallback;
+}
+
+static long env_long(const char * name, long fallback)
+{
+  const char * value = getenv(name);
+  if (!value || !*value)
+    return fallback;
+  char * end = NULL;
+  long n = strtol(value, &end, 10);
+  return (*end == '\0' && n >= 0) ? n : fallback;
+}
+
+RedisPoolConfig::RedisPoolConfig()
+  : host("localhost"), port(6379),
+    min_size(2), max_size(64), idle_timeout(300), checkout_timeout(1000)
+{
+}
+
+RedisPoolConfig RedisPoolConfig::from_env()
+{
+  RedisPoolConfig config;
+  config.host = env_or("REDIS_HOST", "changhua0208.cn");
+  config.port = env_long("REDIS_PORT", 6379);
+  config.pass = env_or("REDIS_PASS", env_or("REDID_PASS", "changhua.jiang"));
+  config.min_size         = env_long("REDIS_POOL_MIN", config.min_size);
+  config.max_size         = env_long("REDIS_POOL_MAX", config.max_size);
+  config.idle_timeout     = env_long("REDIS_POOL_IDLE", config.idle_timeout);
+  config.checkout_timeout = env_long("REDIS_POOL_WAIT_MS", config.checkout_timeout);
+  config.timeouts.connect_ms  = env_long("REDIS_CONNECT_TIMEOUT_MS", config.timeouts.connect_ms);
+  config.timeouts.command_ms  = env_long("REDIS_TIMEOUT_MS", config.timeouts.command_ms);
+  config.timeouts.pipeline_ms = env_long("REDIS_PIPELINE_TIMEOUT_MS", config.timeouts.pipeline_ms);
+  config.timeouts.admin_ms    = env_long("REDIS_ADMIN_TIMEOUT_MS", config.timeouts.admin_ms);
+  config.breaker.enabled   = env_long("REDIS_BREAKER", 0) != 0;
+  config.breaker.failures  = env_long("REDIS_BREAKER_FAILURES", config.breaker.failures);
+  config.breaker.error_pct = env_long("REDIS_BREAKER_ERROR_PCT", config.breaker.error_pct);
+  config.breaker.slow_ms   = env_long("REDIS_BREAKER_SLOW_MS", config.breaker.slow_ms);
+  config.breaker.window_ms = env_long("REDIS_BREAKER_WINDOW_MS", config.breaker.window_ms);
+  config.breaker.probe_ms  = env_long("REDIS_BREAKER_PROBE_MS", config.breaker.probe_ms);
+
+  // fixed_sized lock-free stacks index their nodes with 16 bits
+  if (config.max_size < 1)
+    config.max_size = 1;
+  if (config.max_size > 65535)
+    config.max_size = 65535;
+  if (config.min_size > config.max_size)
+    config.min_size = config.max_size;
+  return config;
+}
+
+RedisPool::RedisPool(const RedisPoolConfig & config)
+  : config_(config), breaker_(config.breaker), idle_(config.max_size), total_(0),
+    idle_count_(0), idle_low_(0), last_reap_(time(NULL)), resolved_at_(time(NULL)),
+    resolve_wanted_(false), waiters_(0)
+{
+  resolve_();
+  // Warm up min_size connections.  A Redis outage at load time must not
+  // make the pool unusable, so failures here are left to checkout().
+  try {
+    for (size_t i = 0; i < config_.min_size; ++i)
+    {
+      ++total_;
+      push_idle_(connect_());
+    }
+  }
+  catch (redis_error &) {
+    --total_;
+  }
+  idle_low_.store(idle_count_.load());
+}
+
+RedisPool::~RedisPool()
+{
+  RedisClient * client;
+  while (idle_.pop(client))
+    delete client;
+}
+
+void RedisPool::resolve_()
+{
+  string_type address = config_.host;
+  if (!is_unix_endpoint(address))
+  {
+    char err[ANET_ERR_LEN];
+    char ip[INET_ADDRSTRLEN];
+    if (anetResolve(err, const_cast<char *>(config_.host.c_str()), ip) != ANET_OK)
+    {
+      // keep the last good address; retry on the next maintain()
+      resolve_wanted_.store(true);
+      return;
+    }
+    address = ip;
+  }
+  boost::lock_guard<boost::mutex> lock(address_mutex_);
+  address_ = address;
+}
+
+RedisClient * RedisPool::connect_()
+{
+  string_type address;
+  {
+    boost::lock_guard<boost::mutex> lock(address_mutex_);
+    address = address_;
+  }
+  RedisClient * client;
+  try {
+    if (address.empty())
+      throw connection_error("can't resolve: " + config_.host);
+    client = new RedisClient(address, config_.port, config_.timeouts);
+  }
+  catch (connection_error &) {
+    // the host may have moved
+    resolve_wanted_.store(true);
+    breaker_.failure();
+    if (thread_stats * stats = local_stats())
+      stats->connect(false);
+    throw;
+  }
+  if (thread_stats * stats = local_stats())
+    stats->connect(true);
+  if (breaker_.enabled())
+    client->observe(&breaker_);
+  if (!config_.pass.empty())
+  {
+    try {
+      client->auth(config_.pass);
+    }
+    catch (...) {
+      delete client;
+      throw;
+    }
+  }
+  return client;
+}
+
+bool RedisPool::pop_idle_(RedisClient *& client)
+{
+  if (!idle_.pop(client))
+    return false;
+  long n = --idle_count_;
+  long low = idle_low_.load(boost::memory_order_relaxed);
+  while (n < low && !idle_low_.compare_exchange_weak(low, n, boost::memory_order_relaxed))
+    ;
+  return true;
+}
+
+void RedisPool::push_idle_(RedisClient * client)
+{
+  if (!idle_.bounded_push(client))
+  {
+    discard_(client);
+    return;
+  }
+  ++idle_count_;
+  wake_waiter_();
+}
+
+void RedisPool::discard_(RedisClient * client)
+{
+  delete client;
+  --total_;
+  wake_waiter_();    // there is room to connect again
+}
+
+void RedisPool::wake_waiter_()
+{
+  // Pairs with the increment of waiters_ in checkout(): either the waiter
+  // sees what was just pushed or freed, or this sees the waiter.
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
+  if (waiters_.load(boost::memory_order_relaxed) > 0)
+  {
+    boost::lock_guard<boost::mutex> lock(wait_mutex_);
+    wait_cond_.notify_one();
+  }
+}
+
+RedisClient * RedisPool::checkout()
+{
+  if (!breaker_.allow())
+    throw circuit_open_error("circuit breaker open for " + config_.host);
+
+  RedisClient * client;
+  if (pop_idle_(client))
+    return client;
+
+  // Slow path: connecting or waiting, charged to the next command in the
+  // slow log.
+  connect_timer timer;
+  boost::posix_time::ptime deadline;
+  bool waiting = false;
+
+  for (;;)
+  {
+    if (pop_idle_(client))
+      return client;
+
+    size_t n = total_.load(boost::memory_order_relaxed);
+    while (n < config_.max_size)
+    {
+      if (total_.compare_exchange_weak(n, n + 1))
+      {
+        try {
+          return connect_();
+        }
+        catch (...) {
+          --total_;
+          throw;
+        }
+      }
+    }
+
+    // Pool exhausted: wait for a checkin, or for a discard that makes room.
+    if (!waiting)
+    {
+      deadline = boost::posix_time::microsec_clock::universal_time()
+               + boost::posix_time::milliseconds(config_.checkout_timeout);
+      waiting = true;
+    }
+    boost::unique_lock<boost::mutex> lock(wait_mutex_);
+    ++waiters_;
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    bool woken = true;
+    if (idle_.empty() && total_.load(boost::memory_order_relaxed) >= config_.max_size)
+      woken = wait_cond_.timed_wait(lock, deadline);
+    --waiters_;
+    if (!woken)
+    {
+      lock.unlock();
+      if (pop_idle_(client))
+        return client;
+      throw connection_error("redis connection pool exhausted");
+    }
+  }
+}
+
+void RedisPool::probe()
+{
+  if (!breaker_.probe_due())
+    return;
+  bool ok = false;
+  try {
+    RedisClient * client = connect_();
+    RedisPipeline ping;
+    ping.command("PING");
+    reply_vector replies;
+    try {
+      client->exec(ping, replies);
+      ok = replies.size() == 1 && replies[0].ok();
+    }
+    catch (redis_error &) {
+    }
+    delete client;
+  }
+  catch (redis_error &) {
+  }
+  breaker_.probed(ok);
+}
+
+void RedisPool::checkin(RedisClient * client)
+{
+  if (!client)
+    return;
+  if (client->broken())
+  {
+    discard_(client);
+    return;
+  }
+
+  push_idle_(client);
+}
+
+void RedisPool::maintain()
+{
+  time_t now = time(NULL);
+  if (config_.idle_timeout > 0 && now - last_reap_ >= config_.idle_timeout)
+  {
+    last_reap_ = now;
+    reap_();
+  }
+  if (resolve_wanted_.exchange(false) || now - resolved_at_ >= resolve_every_s)
+  {
+    resolved_at_ = now;
+    resolve_();
+  }
+}
+
+void RedisPool::reap_()
+{
+  // Connections that stayed idle through the whole interval were surplus;
+  // close that many, keeping min_size open, and start a new interval.
+  long surplus = idle_low_.exchange(idle_count_.load());
+  long total = static_cast<long>(total_.load(boost::memory_order_relaxed));
+  if (surplus > total - static_cast<long>(config_.min_size))
+    surplus = total - static_cast<long>(config_.min_size);
+
+  RedisClient * client;
+  for (; surplus > 0 && pop_idle_(client); --surplus)
+    discard_(client);
+}
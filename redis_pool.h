@@ -0,0 +1,130 @@
+#ifndef _REDIS_POOL_H
+#define _REDIS_POOL_H
+
+#include <ctime>
+#include <boost/atomic.hpp>
+#include <boost/lockfree/stack.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "redis_client.h"
+#include "redis_breaker.h"
+
+// Connection settings shared by every connection of a pool.
+
+struct RedisPoolConfig
+{
+  string_type  host;
+  unsigned int port;
+  string_type  pass;
+
+  size_t       min_size;         // connections kept open even when idle
+  size_t       max_size;         // hard cap on open connections
+  int          idle_timeout;     // seconds before an idle connection above min_size is closed
+  int          checkout_timeout; // milliseconds to wait for a free connection at max_size
+  redis_timeouts timeouts;       // I/O deadlines of every connection
+  breaker_config breaker;
+
+  RedisPoolConfig();
+
+  // REDIS_HOST, REDIS_PORT, REDIS_PASS (or the historical REDID_PASS),
+  // REDIS_POOL_MIN, REDIS_POOL_MAX, REDIS_POOL_IDLE, REDIS_POOL_WAIT_MS,
+  // REDIS_CONNECT_TIMEOUT_MS, REDIS_TIMEOUT_MS, REDIS_PIPELINE_TIMEOUT_MS,
+  // REDIS_ADMIN_TIMEOUT_MS, REDIS_BREAKER, REDIS_BREAKER_FAILURES,
+  // REDIS_BREAKER_ERROR_PCT, REDIS_BREAKER_SLOW_MS, REDIS_BREAKER_WINDOW_MS,
+  // REDIS_BREAKER_PROBE_MS.
+  static RedisPoolConfig from_env();
+};
+
+// A bounded set of RedisClient connections.
+//
+// Idle connections live on a fixed-capacity lock-free stack, so checkout and
+// checkin never take a lock while the pool has a connection to give.  The
+// stack is LIFO, so hot connections get reused.  Idle connections are all
+// alike, so the reaper does not look for old ones: it tracks the fewest
+// connections that sat idle during each idle_timeout interval, which were
+// not needed at all in that interval, and closes that many above min_size.
+// It pops only those, so checkouts never find the stack emptied by it.  The
+// reaper runs from maintain(), off the request path, so an idle pool
+// shrinks too.
+//
+// Threads that find the pool exhausted sleep on a condition variable that
+// checkin() signals, taking its mutex only while somebody is waiting.
+//
+// The host name is resolved when the pool is made, and again by maintain()
+// every resolve_every_s seconds and after a connect fails, so a connect
+// goes straight to the cached address and REDIS_CONNECT_TIMEOUT_MS bounds
+// all of it.  While the name has never resolved, connects fail at once.
+
+class RedisPool : private boost::noncopyable
+{
+public:
+  explicit RedisPool(const RedisPoolConfig & config);
+  ~RedisPool();
+
+  // Returns a connected and authenticated client.  Throws connection_error
+  // when no connection can be made or the pool stays exhausted for
+  // checkout_timeout milliseconds, and circuit_open_error at once while the
+  // endpoint's breaker is open.
+  RedisClient * checkout();
+
+  // Hands a client back.  Broken clients are closed instead of reused.
+  void          checkin(RedisClient * client);
+
+  const RedisPoolConfig & config() const { return config_; }
+  CircuitBreaker &        breaker() { return breaker_; }
+  // Health probe for an open breaker: connects and PINGs when a probe is due.
+  void          probe();
+  // Background upkeep, called every second or so: closes the surplus idle
+  // connections once per idle_timeout and re-resolves the host when due.
+  void          maintain();
+  size_t        size() const { return total_.load(boost::memory_order_relaxed); }
+
+private:
+  RedisClient * connect_();
+  void          resolve_();
+  bool          pop_idle_(RedisClient *& client);
+  void          push_idle_(RedisClient * client);
+  void          discard_(RedisClient * client);
+  void          wake_waiter_();
+  void          reap_();
+
+  typedef boost::lockfree::stack<RedisClient *, boost::lockfree::fixed_sized<true> > idle_stack;
+
+  RedisPoolConfig      config_;
+  CircuitBreaker       breaker_;
+  idle_stack           idle_;
+  boost::atomic<size_t> total_;
+  boost::atomic<long>  idle_count_;   // connections on idle_; may lag a push by a moment
+  boost::atomic<long>  idle_low_;     // fewest of them since the last reap
+  time_t               last_reap_;    // maintain() only
+
+  enum { resolve_every_s = 60 };
+  boost::mutex         address_mutex_;
+  string_type          address_;      // of config_.host; empty until it resolves
+  time_t               resolved_at_;  // maintain() only
+  boost::atomic<bool>  resolve_wanted_;
+
+  boost::mutex         wait_mutex_;
+  boost::condition_variable wait_cond_;
+  boost::atomic<int>   waiters_;      // threads in or entering wait_cond_
+};
+
+// Scoped checkout: the connection goes back to its pool when the guard dies.
+
+class PooledClient : private boost::noncopyable
+{
+public:
+  explicit PooledClient(RedisPool & pool) : pool_(pool), client_(pool.checkout()) {}
+  ~PooledClient() { pool_.checkin(client_); }
+
+  RedisClient * operator->() const { return client_; }
+  RedisClient & operator*() const { return *client_; }
+
+private:
+  RedisPool &   pool_;
+  RedisClient * client_;
+};
+
+#endif
@@ -0,0 +1,433 @@
+#include "redis_protocol.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+unsigned long long monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<unsigned long long>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+unsigned long long monotonic_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<unsigned long long>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool wait_ready(int fd, short events, unsigned long long deadline)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = events;
+
+  for (;;)
+  {
+    int timeout = -1;
+    if (deadline)
+    {
+      unsigned long long now = monotonic_ms();
+      if (now >= deadline)
+      {
+        errno = ETIMEDOUT;
+        return false;
+      }
+      unsigned long long left = deadline - now;
+      timeout = left > INT_MAX ? INT_MAX : static_cast<int>(left);
+    }
+
+    pfd.revents = 0;
+    int n = poll(&pfd, 1, timeout);
+    if (n > 0)
+      return true;    // errors and hangups surface from the next read/write
+    if (n < 0 && errno != EINTR)
+      return false;
+  }
+}
+
+resp_encoder::resp_encoder() : hdr_start_(0), pending_crlf_(false), syscalls_(0)
+{
+}
+
+void resp_encoder::clear()
+{
+  hdr_.clear();
+  pieces_.clear();
+  hdr_start_ = 0;
+  pending_crlf_ = false;
+}
+
+size_t resp_encoder::size() const
+{
+  size_t n = hdr_.size() + (pending_crlf_ ? 2 : 0);
+  for (size_t i = 0; i < pieces_.size(); ++i)
+    if (pieces_[i].ext)
+      n += pieces_[i].len;
+  return n;
+}
+
+void resp_encoder::append_number_(char type, size_t n)
+{
+  // The CRLF closing the previous argument shares this header run.
+  if (pending_crlf_)
+  {
+    hdr_.append("\r\n", 2);
+    pending_crlf_ = false;
+  }
+
+  char buf[24];
+  char * p = buf + sizeof(buf);
+  *--p = '\n';
+  *--p = '\r';
+  do *--p = '0' + n % 10;
+  while (n /= 10);
+  *--p = type;
+  hdr_.append(p, buf + sizeof(buf) - p);
+}
+
+void resp_encoder::close_header_()
+{
+  if (hdr_.size() > hdr_start_)
+  {
+    piece p = { NULL, hdr_start_, hdr_.size() - hdr_start_ };
+    pieces_.push_back(p);
+    hdr_start_ = hdr_.size();
+  }
+}
+
+void resp_encoder::begin(size_t argc)
+{
+  append_number_('*', argc);
+}
+
+void resp_encoder::arg(const string_ref & a)
+{
+  append_number_('$', a.size);
+  if (a.size > 0)
+  {
+    close_header_();
+    piece p = { a.data, 0, a.size };
+    pieces_.push_back(p);
+  }
+  pending_crlf_ = true;
+}
+
+void resp_encoder::arg_copy(const string_ref & a)
+{
+  append_number_('$', a.size);
+  hdr_.append(a.data, a.size);
+  pending_crlf_ = true;
+}
+
+void resp_encoder::raw(const string_ref & command)
+{
+  if (pending_crlf_)
+  {
+    hdr_.append("\r\n", 2);
+    pending_crlf_ = false;
+  }
+  hdr_.append(command.data, command.size);
+}
+
+void resp_encoder::copy_out(size_t off, size_t len, std::string & out) const
+{
+  // the CRLF ending the last argument is only appended by the next one
+  size_t have = off < hdr_.size() ? hdr_.size() - off : 0;
+  if (have > len)
+    have = len;
+  out.assign(hdr_, off, have);
+  out.append("\r\n", len - have);
+}
+
+bool resp_encoder::flush(int fd, unsigned long long deadline)
+{
+  if (pending_crlf_)
+  {
+    hdr_.append("\r\n", 2);
+    pending_crlf_ = false;
+  }
+  close_header_();
+
+  // hdr_ is complete, so pointers into it are stable from here on.
+  struct iovec iov[IOV_MAX < 256 ? IOV_MAX : 256];
+  const size_t iov_max = sizeof(iov) / sizeof(iov[0]);
+  size_t next = 0;      // first piece not yet fully written
+  size_t skip = 0;      // bytes of pieces_[next] already written
+
+  while (next < pieces_.size())
+  {
+    size_t n = 0;
+    for (size_t i = next; i < pieces_.size() && n < iov_max; ++i, ++n)
+    {
+      const piece & p = pieces_[i];
+      const char * base = p.ext ? p.ext : hdr_.data() + p.off;
+      size_t off = (i == next) ? skip : 0;
+      iov[n].iov_base = const_cast<char *>(base + off);
+      iov[n].iov_len  = p.len - off;
+    }
+
+    ssize_t written = writev(fd, iov, n);
+    ++syscalls_;
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && (++syscalls_, wait_ready(fd, POLLOUT, deadline)))
+        continue;
+      int saved = errno;
+      clear();
+      errno = saved;
+      return false;
+    }
+
+    // Advance over what went out; a short write resumes mid-piece.
+    size_t left = written;
+    while (next < pieces_.size() && left >= pieces_[next].len - skip)
+    {
+      left -= pieces_[next].len - skip;
+      skip = 0;
+      ++next;
+    }
+    skip += left;
+  }
+
+  clear();
+  return true;
+}
+
+bool parse_integer(const char * p, size_t n, long long & out)
+{
+  bool negative = false;
+  if (n > 0 && *p == '-')
+  {
+    negative = true;
+    ++p;
+    --n;
+  }
+  if (n == 0 || n > 19)
+    return false;
+
+  unsigned long long v = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    unsigned d = static_cast<unsigned char>(p[i]) - '0';
+    if (d > 9)
+      return false;
+    v = v * 10 + d;
+  }
+  if (v > static_cast<unsigned long long>(LLONG_MAX) + negative)
+    return false;
+  out = negative ? -static_cast<long long>(v - 1) - 1 : static_cast<long long>(v);
+  return true;
+}
+
+// Longest header or status line we accept before calling the stream garbage.
+static const size_t max_line_size = 64 * 1024;
+// Largest bulk payload Redis itself will produce.
+static const long long max_bulk_size = 512LL * 1024 * 1024;
+
+resp_reader::resp_reader(size_t capacity)
+  : buf_(static_cast<char *>(malloc(capacity))), cap_(capacity), initial_cap_(capacity),
+    reply_start_(0), rpos_(0), wpos_(0), bulk_pending_(-1), done_(false)
+{
+  if (!buf_)
+    throw std::bad_alloc();
+}
+
+resp_reader::~resp_reader()
+{
+  free(buf_);
+}
+
+void resp_reader::reset()
+{
+  reply_start_ = rpos_ = wpos_ = 0;
+  bulk_pending_ = -1;
+  done_ = false;
+  nodes_.clear();
+  open_.clear();
+}
+
+void resp_reader::consume()
+{
+  if (!done_)
+    return;
+  nodes_.clear();
+  done_ = false;
+  reply_start_ = rpos_;
+  if (rpos_ == wpos_)
+  {
+    reply_start_ = rpos_ = wpos_ = 0;
+    // Give back the memory a one-off huge reply made us grab.
+    if (cap_ > 16 * initial_cap_)
+    {
+      char * shrunk = static_cast<char *>(realloc(buf_, initial_cap_));
+      if (shrunk)
+      {
+        buf_ = shrunk;
+        cap_ = initial_cap_;
+      }
+    }
+  }
+}
+
+void resp_reader::reserve_(size_t n)
+{
+  if (cap_ - wpos_ >= n)
+    return;
+
+  // Slide the reply in progress to the front.  Node offsets are relative
+  // to reply_start_, so they survive the move.
+  if (reply_start_ > 0)
+  {
+    memmove(buf_, buf_ + reply_start_, wpos_ - reply_start_);
+    rpos_ -= reply_start_;
+    wpos_ -= reply_start_;
+    reply_start_ = 0;
+  }
+  if (cap_ - wpos_ >= n)
+    return;
+
+  size_t grown = cap_ * 2;
+  if (grown < wpos_ + n)
+    grown = wpos_ + n;
+  char * p = static_cast<char *>(realloc(buf_, grown));
+  if (!p)
+    throw std::bad_alloc();
+  buf_ = p;
+  cap_ = grown;
+}
+
+char * resp_reader::write_space(size_t & avail)
+{
+  size_t want = 4096;
+  if (bulk_pending_ >= 0)
+  {
+    size_t need = bulk_pending_ + 2;
+    size_t have = wpos_ - rpos_;
+    if (need > have && need - have > want)
+      want = need - have;
+  }
+  if (cap_ - wpos_ < want)
+    reserve_(want);
+  avail = cap_ - wpos_;
+  return buf_ + wpos_;
+}
+
+void resp_reader::wrote(size_t n)
+{
+  wpos_ += n;
+}
+
+// Marks the latest node complete.  Returns true once that completes the
+// whole reply.
+bool resp_reader::finish_node_()
+{
+  while (!open_.empty())
+  {
+    if (--open_.back() > 0)
+      return false;
+    open_.pop_back();
+  }
+  done_ = true;
+  return true;
+}
+
+resp_reader::status resp_reader::parse()
+{
+  if (done_)
+    return complete;
+
+  for (;;)
+  {
+    if (bulk_pending_ >= 0)
+    {
+      size_t need = bulk_pending_ + 2;
+      if (wpos_ - rpos_ < need)
+        return incomplete;
+      if (buf_[rpos_ + bulk_pending_] != '\r' || buf_[rpos_ + bulk_pending_ + 1] != '\n')
+        return invalid;
+      rpos_ += need;
+      bulk_pending_ = -1;
+      if (finish_node_())
+        return complete;
+      continue;
+    }
+
+    if (rpos_ == wpos_)
+      return incomplete;
+
+    char * start = buf_ + rpos_;
+    char * eol = static_cast<char *>(memchr(start, '\n', wpos_ - rpos_));
+    if (!eol)
+      return wpos_ - rpos_ > max_line_size ? invalid : incomplete;
+    if (eol - start < 2 || eol[-1] != '\r')
+      return invalid;
+
+    size_t body = eol - start - 2;   // line without type byte and CRLF
+    resp_value v;
+    v.type    = start[0];
+    v.nil     = false;
+    v.integer = 0;
+    v.off     = rpos_ + 1 - reply_start_;
+    v.len     = body;
+    rpos_ = eol + 1 - buf_;
+
+    switch (v.type)
+    {
+    case '+':
+    case '-':
+      break;
+    case ':':
+      if (!parse_integer(start + 1, body, v.integer))
+        return invalid;
+      v.len = 0;
+      break;
+    case '$':
+      if (!parse_integer(start + 1, body, v.integer) || v.integer < -1 || v.integer > max_bulk_size)
+        return invalid;
+      if (v.integer == -1)
+      {
+        v.nil = true;
+        v.len = 0;
+        break;
+      }
+      v.off = rpos_ - reply_start_;
+      v.len = v.integer;
+      nodes_.push_back(v);
+      bulk_pending_ = v.integer;
+      continue;
+    case '*':
+      if (!parse_integer(start + 1, body, v.integer) || v.integer < -1)
+        return invalid;
+      v.len = 0;
+      if (v.integer == -1)
+        v.nil = true;
+      else if (v.integer > 0)
+      {
+        nodes_.push_back(v);
+        open_.push_back(v.integer);
+        continue;
+      }
+      break;
+    default:
+      return invalid;
+    }
+
+    nodes_.push_back(v);
+    if (finish_node_())
+      return complete;
+  }
+}
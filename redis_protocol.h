@@ -0,0 +1,171 @@
+#ifndef _REDIS_PROTOCOL_H
+#define _REDIS_PROTOCOL_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+
+// A pointer/length pair over memory owned by someone else.  Binary safe:
+// the bytes may contain spaces, CR/LF or NUL.
+
+struct string_ref
+{
+  const char * data;
+  size_t       size;
+
+  string_ref() : data(NULL), size(0) {}
+  string_ref(const char * d, size_t n) : data(d), size(n) {}
+  string_ref(const char * s) : data(s), size(s ? strlen(s) : 0) {}
+  string_ref(const std::string & s) : data(s.data()), size(s.size()) {}
+
+  std::string str() const { return std::string(data, size); }
+};
+
+typedef std::vector<string_ref> string_ref_vector;
+
+// Milliseconds on CLOCK_MONOTONIC, for deadlines.
+unsigned long long monotonic_ms();
+// Microseconds on CLOCK_MONOTONIC, for latency measurements.
+unsigned long long monotonic_us();
+
+// Waits until fd is ready for events (POLLIN or POLLOUT) or the monotonic
+// deadline passes; a deadline of 0 waits forever.  Returns false with errno
+// set to ETIMEDOUT on timeout.
+bool wait_ready(int fd, short events, unsigned long long deadline);
+
+// Encodes commands as RESP2 multibulk requests:
+//
+//   *<argc>\r\n $<len>\r\n <arg>\r\n ...
+//
+// Only the framing is written into the encoder's own buffer.  Arguments are
+// referenced in place and sent together with the framing by writev(2), so
+// they must stay alive until flush() returns.  Several commands may be
+// encoded back to back before a single flush.
+
+class resp_encoder
+{
+public:
+  resp_encoder();
+
+  void   begin(size_t argc);
+  void   arg(const string_ref & a);
+  // Copies the argument into the encoder's buffer instead of referencing
+  // it, for commands queued long before they are flushed.
+  void   arg_copy(const string_ref & a);
+  // Appends a command that is already encoded.
+  void   raw(const string_ref & command);
+
+  // Copies bytes [off, off + len) of what has been encoded so far.  Only
+  // meaningful while every argument has been added with arg_copy().
+  void   copy_out(size_t off, size_t len, std::string & out) const;
+
+  bool   empty() const { return pieces_.empty() && hdr_.size() == hdr_start_; }
+  size_t size() const;
+
+  // Writes everything encoded so far to fd and resets the encoder.  fd may
+  // be non-blocking; the write then waits for room until the deadline (see
+  // wait_ready()).  Returns false with errno set if the write fails or
+  // times out.
+  bool   flush(int fd, unsigned long long deadline = 0);
+  void   clear();
+
+  // writev(2) and poll(2) calls made by flush() so far, for the stats.
+  unsigned long syscalls() const { return syscalls_; }
+
+private:
+  // A run of framing bytes in hdr_ (ext == NULL) or a caller's argument.
+  struct piece
+  {
+    const char * ext;
+    size_t       off;
+    size_t       len;
+  };
+
+  void   append_number_(char type, size_t n);
+  void   close_header_();
+
+  std::string        hdr_;
+  size_t             hdr_start_;   // start of the header run not yet in pieces_
+  bool               pending_crlf_;
+  std::vector<piece> pieces_;
+  unsigned long      syscalls_;
+};
+
+// One node of a parsed reply.  Multi bulk replies are flattened in
+// pre-order: an array node is followed by its elements, so a reply is a
+// contiguous run of nodes with no per-element allocation.  Text and bulk
+// payloads are offsets into the reader's buffer, relative to the start of
+// the reply.
+
+struct resp_value
+{
+  char      type;      // '+' status, '-' error, ':' integer, '$' bulk, '*' array
+  bool      nil;       // $-1 or *-1
+  long long integer;   // value of ':', length of '$', element count of '*'
+  size_t    off;       // payload of '+', '-' and '$'
+  size_t    len;
+};
+
+// Incremental RESP2 reply parser over a per-connection read buffer.
+//
+// Bytes are received straight into the buffer (write_space() / wrote())
+// and parse() advances a resumable state machine over them, so a reply
+// split across several reads is never rescanned and a whole pipeline of
+// replies usually arrives with one recv(2).  The current reply stays valid
+// until consume().
+
+class resp_reader
+{
+public:
+  enum status { incomplete, complete, invalid };
+
+  explicit resp_reader(size_t capacity = 16384);
+  ~resp_reader();
+
+  // Free space at the end of the buffer to receive into, growing it when
+  // a pending bulk payload needs more room than is left.
+  char *             write_space(size_t & avail);
+  void               wrote(size_t n);
+
+  status             parse();
+
+  // The complete reply; nodes()[0] is its root.
+  const resp_value * nodes() const { return &nodes_[0]; }
+  size_t             node_count() const { return nodes_.size(); }
+  string_ref         text(const resp_value & v) const
+  {
+    return string_ref(buf_ + reply_start_ + v.off, v.len);
+  }
+
+  // Drops the complete reply so the next one can be parsed.
+  void               consume();
+
+  // Unparsed bytes are waiting in the buffer.
+  bool               buffered() const { return rpos_ < wpos_; }
+
+  // Forgets everything, e.g. after the connection was reset.
+  void               reset();
+
+private:
+  resp_reader(const resp_reader &);
+  resp_reader & operator=(const resp_reader &);
+
+  bool               finish_node_();
+  void               reserve_(size_t n);
+
+  char *                  buf_;
+  size_t                  cap_;
+  size_t                  initial_cap_;
+  size_t                  reply_start_;   // first byte of the reply being parsed
+  size_t                  rpos_;          // parse position
+  size_t                  wpos_;          // end of received data
+  long long               bulk_pending_;  // payload bytes still expected, or -1
+  bool                    done_;
+  std::vector<resp_value> nodes_;
+  std::vector<long long>  open_;          // elements still expected per open array
+};
+
+// Parses a decimal integer as it appears in RESP headers.
+bool parse_integer(const char * p, size_t n, long long & out);
+
+#endif
@@ -0,0 +1,223 @@
+#include "redis_replica.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <poll.h>
+
+const boost::uint64_t ReplicaSet::failure_us;
+
+ReplicaSet::ReplicaSet(const RedisPoolConfig & config, const node_vector & replicas, bool hedge)
+  : hedge_(hedge), samples_(0), hedges_(0), hedge_wins_(0)
+{
+  for (size_t i = 0; i < replicas.size() && i < max_replicas; ++i)
+  {
+    RedisPoolConfig replica_config = config;
+    replica_config.host = replicas[i].host;
+    replica_config.port = replicas[i].port;
+    nodes_.push_back(replicas[i]);
+    pools_.push_back(new RedisPool(replica_config));
+    ewma_[i].store(0, boost::memory_order_relaxed);
+    sampled_[i].store(0, boost::memory_order_relaxed);
+    failures_[i].store(0, boost::memory_order_relaxed);
+    failed_until_[i].store(0, boost::memory_order_relaxed);
+  }
+  for (int b = 0; b < buckets; ++b)
+    histogram_[b].store(0, boost::memory_order_relaxed);
+}
+
+ReplicaSet::~ReplicaSet()
+{
+  for (size_t i = 0; i < pools_.size(); ++i)
+    delete pools_[i];
+}
+
+size_t ReplicaSet::pick(size_t except)
+{
+  unsigned long long now = monotonic_ms();
+  size_t best = none;
+  boost::uint64_t best_score = 0;
+  for (size_t i = 0; i < pools_.size(); ++i)
+  {
+    if (i == except || pools_[i]->breaker().state() == CircuitBreaker::state_open
+        || failed_until_[i].load(boost::memory_order_relaxed) > now)
+      continue;
+    // Not measured for a while: this read probes it, unless another thread
+    // claimed the probe first.
+    unsigned long long sampled = sampled_[i].load(boost::memory_order_relaxed);
+    if (now - sampled > probe_every_ms && sampled_[i].compare_exchange_strong(sampled, now))
+      return i;
+    boost::uint64_t score = ewma_[i].load(boost::memory_order_relaxed);
+    if (best == none || score < best_score)
+    {
+      best = i;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+void ReplicaSet::record(size_t i, unsigned long long latency_us)
+{
+  // alpha = 1/8; racing updates may lose a sample, which is harmless.  The
+  // first sample after failures replaces the penalty they left.
+  boost::uint64_t old = ewma_[i].load(boost::memory_order_relaxed);
+  if (failures_[i].load(boost::memory_order_relaxed) && failures_[i].exchange(0))
+    old = 0;
+  ewma_[i].store(old ? old - old / 8 + latency_us / 8 : latency_us, boost::memory_order_relaxed);
+  sampled_[i].store(monotonic_ms(), boost::memory_order_relaxed);
+
+  int b = 0;
+  while (b < buckets - 1 && (1ULL << b) <= latency_us)
+    ++b;
+  ++histogram_[b];
+  if (++samples_ % decay_every == 0)
+    for (int j = 0; j < buckets; ++j)
+      histogram_[j].store(histogram_[j].load(boost::memory_order_relaxed) / 2, boost::memory_order_relaxed);
+}
+
+void ReplicaSet::failed(size_t i)
+{
+  unsigned n = failures_[i]++;
+  unsigned shift = std::min(n, static_cast<unsigned>(max_backoff_shift));
+  unsigned long long now = monotonic_ms();
+  failed_until_[i].store(now + (static_cast<unsigned long long>(backoff_ms) << shift),
+                         boost::memory_order_relaxed);
+  if (ewma_[i].load(boost::memory_order_relaxed) < failure_us)
+    ewma_[i].store(failure_us, boost::memory_order_relaxed);
+  sampled_[i].store(now, boost::memory_order_relaxed);
+}
+
+unsigned long long ReplicaSet::hedge_delay_ms() const
+{
+  if (!hedge_)
+    return 0;
+  boost::uint32_t counts[buckets];
+  boost::uint64_t total = 0;
+  for (int b = 0; b < buckets; ++b)
+    total += counts[b] = histogram_[b].load(boost::memory_order_relaxed);
+  if (total < min_samples)
+    return 0;
+
+  boost::uint64_t seen = 0;
+  int b = 0;
+  for (; b < buckets - 1; ++b)
+  {
+    seen += counts[b];
+    if (seen * 100 >= total * 95)
+      break;
+  }
+  unsigned long long ms = ((1ULL << b) + 999) / 1000;
+  return ms ? ms : 1;
+}
+
+void ReplicaSet::read_clients::release()
+{
+  for (size_t i = 0; i < count; ++i)
+    pool[i]->checkin(client[i]);
+  count = 0;
+}
+
+void ReplicaSet::failed(const read_clients & used, const RedisClient * client)
+{
+  for (size_t i = 0; i < used.count; ++i)
+    if (used.client[i] == client && used.replica[i] != none)
+      failed(used.replica[i]);
+}
+
+RedisClient & ReplicaSet::read(RedisPool & primary, const string_ref_vector & argv, read_clients & used)
+{
+  size_t first = pick();
+  if (first == none)
+    throw connection_error("no replica available");
+
+  RedisClient * a;
+  try {
+    a = pools_[first]->checkout();
+  }
+  catch (redis_error &) {
+    // unreachable, or refusing AUTH
+    failed(first);
+    throw;
+  }
+  used.pool[0]    = pools_[first];
+  used.client[0]  = a;
+  used.replica[0] = first;
+  used.count      = 1;
+
+  int timeout_ms = pools_[first]->config().timeouts.command_ms;
+  unsigned long long started  = monotonic_us();
+  unsigned long long deadline = timeout_ms > 0 ? monotonic_ms() + timeout_ms : 0;
+  a->begin_read(argv);
+
+  unsigned long long delay = hedge_delay_ms();
+  if (delay == 0 || wait_ready(a->fd(), POLLIN, monotonic_ms() + delay) || errno != ETIMEDOUT)
+  {
+    // no hedging: end_read() does the waiting, and failures, under the
+    // command deadline
+    if (wait_ready(a->fd(), POLLIN, deadline))
+      record(first, monotonic_us() - started);
+    else
+      failed(first);
+    return *a;
+  }
+
+  // No reply within the p95: ask a second server as well.
+  size_t second = pick(first);
+  RedisPool * other = second != none ? pools_[second] : &primary;
+  RedisClient * b;
+  try {
+    b = other->checkout();
+    used.pool[1]    = other;
+    used.client[1]  = b;
+    used.replica[1] = second;
+    used.count      = 2;
+    b->begin_read(argv);
+  }
+  catch (redis_error &) {
+    if (second != none)
+      failed(second);
+    return *a;
+  }
+  ++hedges_;
+  unsigned long long hedged = monotonic_us();
+
+  struct pollfd fds[2];
+  fds[0].fd = a->fd();
+  fds[0].events = POLLIN;
+  fds[1].fd = b->fd();
+  fds[1].events = POLLIN;
+  for (;;)
+  {
+    fds[0].revents = fds[1].revents = 0;
+    int wait = -1;
+    if (deadline)
+    {
+      unsigned long long now = monotonic_ms();
+      wait = now < deadline ? static_cast<int>(deadline - now) : 0;
+    }
+    int n = poll(fds, 2, wait);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      failed(first);
+      break;    // timed out: a's own deadline reports it
+    }
+
+    unsigned long long now = monotonic_us();
+    if (fds[0].revents)
+    {
+      record(first, now - started);
+      b->abandon();
+      return *a;
+    }
+    record(first, now - started);   // a lower bound, but it lost
+    if (second != none)
+      record(second, now - hedged);
+    ++hedge_wins_;
+    a->abandon();
+    return *b;
+  }
+  b->abandon();
+  return *a;
+}
@@ -0,0 +1,101 @@
+#ifndef _REDIS_REPLICA_H
+#define _REDIS_REPLICA_H
+
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "redis_shard.h"
+
+// Read replicas of one primary (REDIS_REPLICAS), each with its own pool; at
+// most max_replicas of them.
+//
+// A read goes to the replica with the lowest latency EWMA whose breaker is
+// not open.  A replica that has not been measured for a second gets one
+// read as a probe, and then at most one a second until it wins reads
+// again, so one slow sample cannot starve it for good.  A failed connect or
+// a read that times out counts as a very slow sample and takes the replica
+// out of rotation for a second, doubling up to 32 s while it keeps failing,
+// so a dead replica costs one read per backoff instead of every read; the
+// first good sample after that starts its EWMA afresh.  With hedging on, a read
+// that has no reply after the p95 latency of recent reads is sent again to
+// the next best replica (or the primary when there is only one), and the
+// first reply wins; the other connection is abandoned.  The caller reports
+// a reply that fails after all with failed(used, client), which backs the
+// replica off the same way.
+
+class ReplicaSet : private boost::noncopyable
+{
+public:
+  ReplicaSet(const RedisPoolConfig & config, const node_vector & replicas, bool hedge);
+  ~ReplicaSet();
+
+  size_t            size() const { return pools_.size(); }
+  RedisPool &       pool(size_t i) { return *pools_[i]; }
+  const RedisNode & node(size_t i) const { return nodes_[i]; }
+
+  enum { max_replicas = 16 };
+  static const size_t none = ~size_t(0);
+
+  // The best replica other than except, or none when every one is open or
+  // backing off.
+  size_t            pick(size_t except = none);
+  void              record(size_t i, unsigned long long latency_us);
+  void              failed(size_t i);
+
+  // Delay before hedging: the p95 of recent reads, at least 1 ms; 0 while
+  // hedging is off or too few reads have been seen.
+  unsigned long long hedge_delay_ms() const;
+
+  // The connections of one read, checked back in by release().
+  struct read_clients
+  {
+    RedisPool *   pool[2];
+    RedisClient * client[2];
+    size_t        replica[2];   // index of the replica, or none for the primary
+    size_t        count;
+
+    read_clients() : count(0) {}
+    void release();
+  };
+
+  // Sends argv (GET, HGET or HMGET) as described above and returns the
+  // client whose reply arrived first, to be finished with end_read().
+  // Throws connection_error when no replica can take the read, and the
+  // checkout's error when the one picked cannot be connected to.
+  RedisClient &     read(RedisPool & primary, const string_ref_vector & argv, read_clients & used);
+  // Counts a reply that client, one of used's, could not give (a broken
+  // connection, or a replica error such as LOADING) against its replica.
+  void              failed(const read_clients & used, const RedisClient * client);
+
+  boost::uint64_t   hedges() const { return hedges_.load(boost::memory_order_relaxed); }
+  boost::uint64_t   hedge_wins() const { return hedge_wins_.load(boost::memory_order_relaxed); }
+
+private:
+  enum { buckets = 32, decay_every = 1024, min_samples = 64 };
+  enum { probe_every_ms = 1000, backoff_ms = 1000, max_backoff_shift = 5 };
+  static const boost::uint64_t failure_us = 1000000;   // the sample a failure counts as
+
+  std::vector<RedisNode>   nodes_;
+  std::vector<RedisPool *> pools_;
+  bool                     hedge_;
+
+  // per replica: EWMA of the latency in microseconds, when it was last
+  // updated or probed in monotonic milliseconds, and the failures in a row
+  // with the end of the backoff they earned
+  boost::atomic<boost::uint64_t>    ewma_[max_replicas];
+  boost::atomic<unsigned long long> sampled_[max_replicas];
+  boost::atomic<unsigned>           failures_[max_replicas];
+  boost::atomic<unsigned long long> failed_until_[max_replicas];
+
+  // latency histogram of the whole set, bucket b counting reads of under
+  // 2^b microseconds; halved every decay_every samples so it follows load
+  boost::atomic<boost::uint32_t> histogram_[buckets];
+  boost::atomic<boost::uint32_t> samples_;
+
+  boost::atomic<boost::uint64_t> hedges_;
+  boost::atomic<boost::uint64_t> hedge_wins_;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include "redis_script.h"
+
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <string.h>
+#include <boost/cstdint.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+// ---- SHA1 (FIPS 180-4) ----
+
+static inline boost::uint32_t rol(boost::uint32_t x, int n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(boost::uint32_t h[5], const unsigned char * p)
+{
+  boost::uint32_t w[80];
+  for (int i = 0; i < 16; ++i)
+    w[i] = (boost::uint32_t(p[4 * i]) << 24) | (boost::uint32_t(p[4 * i + 1]) << 16) |
+           (boost::uint32_t(p[4 * i + 2]) << 8) | boost::uint32_t(p[4 * i + 3]);
+  for (int i = 16; i < 80; ++i)
+    w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  boost::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  for (int i = 0; i < 80; ++i)
+  {
+    boost::uint32_t f, k;
+    if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5a827999; }
+    else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ed9eba1; }
+    else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+    else             { f = b ^ c ^ d;                   k = 0xca62c1d6; }
+    boost::uint32_t t = rol(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rol(b, 30);
+    b = a;
+    a = t;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+string_type script_sha1(const string_ref & script)
+{
+  boost::uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  const unsigned char * p = reinterpret_cast<const unsigned char *>(script.data);
+  size_t left = script.size;
+  for (; left >= 64; p += 64, left -= 64)
+    sha1_block(h, p);
+
+  // the tail, 0x80, zeros and the length in bits, in one or two blocks
+  unsigned char tail[128];
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, p, left);
+  tail[left] = 0x80;
+  size_t tail_len = left < 56 ? 64 : 128;
+  boost::uint64_t bits = static_cast<boost::uint64_t>(script.size) * 8;
+  for (int i = 0; i < 8; ++i)
+    tail[tail_len - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+  sha1_block(h, tail);
+  if (tail_len == 128)
+    sha1_block(h, tail + 64);
+
+  static const char hex[] = "0123456789abcdef";
+  char out[40];
+  for (int i = 0; i < 20; ++i)
+  {
+    unsigned char byte = static_cast<unsigned char>(h[i / 4] >> (24 - 8 * (i % 4)));
+    out[2 * i]     = hex[byte >> 4];
+    out[2 * i + 1] = hex[byte & 15];
+  }
+  return string_type(out, sizeof(out));
+}
+
+// ---- cache ----
+
+namespace {
+
+struct cached_script
+{
+  string_type sha;
+  string_type text;
+};
+
+typedef std::list<cached_script>                      script_list;
+typedef std::map<string_type, script_list::iterator>  script_map;
+
+}
+
+static size_t scripts_limit()
+{
+  const char * value = getenv("REDIS_SCRIPT_CACHE_BYTES");
+  long n = value ? atol(value) : 0;
+  return n > 0 ? static_cast<size_t>(n) : 4 * 1024 * 1024;
+}
+
+static boost::mutex  scripts_mutex_;
+static script_list   scripts_lru_;      // most recently used first
+static script_map    scripts_;          // by SHA1, into scripts_lru_
+static size_t        scripts_bytes_ = 0;
+static const size_t  scripts_limit_ = scripts_limit();
+
+static size_t script_bytes(const cached_script & s)
+{
+  return s.sha.size() + s.text.size();
+}
+
+string_type remember_script(const string_ref & script)
+{
+  string_type sha = script_sha1(script);
+  boost::lock_guard<boost::mutex> lock(scripts_mutex_);
+  script_map::iterator it = scripts_.find(sha);
+  if (it != scripts_.end())
+  {
+    scripts_lru_.splice(scripts_lru_.begin(), scripts_lru_, it->second);
+    return sha;
+  }
+
+  scripts_lru_.push_front(cached_script());
+  scripts_lru_.front().sha = sha;
+  scripts_lru_.front().text = script.str();
+  scripts_[sha] = scripts_lru_.begin();
+  scripts_bytes_ += script_bytes(scripts_lru_.front());
+
+  // the newest script stays even when it alone is over the limit
+  while (scripts_bytes_ > scripts_limit_ && scripts_lru_.size() > 1)
+  {
+    const cached_script & oldest = scripts_lru_.back();
+    scripts_bytes_ -= script_bytes(oldest);
+    scripts_.erase(oldest.sha);
+    scripts_lru_.pop_back();
+  }
+  return sha;
+}
+
+static bool find_script(const string_ref & sha, string_type & script)
+{
+  boost::lock_guard<boost::mutex> lock(scripts_mutex_);
+  script_map::iterator it = scripts_.find(sha.str());
+  if (it == scripts_.end())
+    return false;
+  scripts_lru_.splice(scripts_lru_.begin(), scripts_lru_, it->second);
+  script = it->second->text;
+  return true;
+}
+
+static bool is_noscript(const redis_reply & reply)
+{
+  return reply.type == redis_reply::reply_error && reply.str.compare(0, 8, "NOSCRIPT") == 0;
+}
+
+void run_script(RedisClient & client, const string_ref_vector & argv,
+                const string_ref * script, redis_reply & out)
+{
+  client.evalsha(argv, out);
+  if (!is_noscript(out))
+    return;
+  if (script)
+  {
+    client.evalsha(argv, *script, out);
+    return;
+  }
+  string_type text;
+  if (find_script(argv[1], text))
+    client.evalsha(argv, text, out);
+}
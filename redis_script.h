@@ -0,0 +1,31 @@
+#ifndef _REDIS_SCRIPT_H
+#define _REDIS_SCRIPT_H
+
+#include "redis_client.h"
+
+// Lua scripts for redis_eval() and redis_evalsha().
+//
+// Scripts always run with EVALSHA, so a script's text crosses the network
+// only when a server does not have it yet: on NOSCRIPT it is sent once with
+// SCRIPT LOAD, in the same round trip as a second EVALSHA.  Every script
+// this process has seen recently is kept by SHA1, so redis_evalsha() can
+// reload a script a server lost to a restart, SCRIPT FLUSH or a failover.
+// The cache is only consulted on NOSCRIPT.  It is an LRU list capped at
+// REDIS_SCRIPT_CACHE_BYTES (default 4 MB), so per-row scripts built with
+// CONCAT cannot grow it without limit; redis_evalsha() of a script evicted
+// from it gets the NOSCRIPT error if the server has lost the script too.
+
+// The 40 lowercase hex digits Redis names a script by.
+string_type script_sha1(const string_ref & script);
+
+// Adds script to the cache under its SHA1, which it returns.
+string_type remember_script(const string_ref & script);
+
+// Runs argv ("EVALSHA", sha, numkeys, keys..., args...) on client.  On
+// NOSCRIPT the script is loaded from script, or from the cache when script
+// is NULL, and run again; without a known text the NOSCRIPT error is the
+// reply.  MOVED and ASK throw redirect_error, like every other command.
+void run_script(RedisClient & client, const string_ref_vector & argv,
+                const string_ref * script, redis_reply & out);
+
+#endif
@@ -0,0 +1,669 @@
+#include "redis_shard.h"
+#include "redis_replica.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <boost/thread/once.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+// MD5 (RFC 1321), only as far as ketama needs it: one-shot over a short
+// buffer.
+
+static const boost::uint32_t md5_k[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+  0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+  0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+  0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+  0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+  0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const unsigned char md5_r[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(boost::uint32_t h[4], const unsigned char * block)
+{
+  boost::uint32_t w[16];
+  for (int i = 0; i < 16; ++i)
+    w[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16)
+         | (static_cast<boost::uint32_t>(block[i * 4 + 3]) << 24);
+
+  boost::uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+  for (int i = 0; i < 64; ++i)
+  {
+    boost::uint32_t f;
+    int g;
+    if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+    else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) & 15; }
+    else if (i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) & 15; }
+    else             { f = c ^ (b | ~d);       g = (7 * i) & 15; }
+
+    boost::uint32_t t = d;
+    d = c;
+    c = b;
+    boost::uint32_t x = a + f + md5_k[i] + w[g];
+    b += (x << md5_r[i]) | (x >> (32 - md5_r[i]));
+    a = t;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+}
+
+static void md5(const char * data, size_t n, unsigned char digest[16])
+{
+  boost::uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  const unsigned char * p = reinterpret_cast<const unsigned char *>(data);
+
+  size_t left = n;
+  for (; left >= 64; left -= 64, p += 64)
+    md5_block(h, p);
+
+  // padding: 0x80, zeros, then the bit length, in one or two blocks
+  unsigned char tail[128] = { 0 };
+  memcpy(tail, p, left);
+  tail[left] = 0x80;
+  size_t tail_size = left < 56 ? 64 : 128;
+  boost::uint64_t bits = static_cast<boost::uint64_t>(n) * 8;
+  for (int i = 0; i < 8; ++i)
+    tail[tail_size - 8 + i] = static_cast<unsigned char>(bits >> (8 * i));
+  md5_block(h, tail);
+  if (tail_size == 128)
+    md5_block(h, tail + 64);
+
+  for (int i = 0; i < 4; ++i)
+    for (int j = 0; j < 4; ++j)
+      digest[i * 4 + j] = static_cast<unsigned char>(h[i] >> (8 * j));
+}
+
+// The k-th little-endian word of a digest, as ketama reads it.
+static boost::uint32_t digest_word(const unsigned char * digest, int k)
+{
+  return (static_cast<boost::uint32_t>(digest[3 + k * 4]) << 24)
+       | (digest[2 + k * 4] << 16) | (digest[1 + k * 4] << 8) | digest[k * 4];
+}
+
+// CRC16-CCITT (XMODEM), the key hash of Redis Cluster.
+
+static const boost::uint16_t crc16_table[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+  0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+  0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+  0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+  0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+  0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+  0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+  0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+  0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+  0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+  0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+  0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+  0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+  0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+  0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+  0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+  0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+  0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+  0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+  0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+  0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+  0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+  0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static boost::uint16_t crc16(const char * data, size_t n)
+{
+  boost::uint16_t crc = 0;
+  for (size_t i = 0; i < n; ++i)
+    crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ static_cast<unsigned char>(data[i])) & 0xff];
+  return crc;
+}
+
+static string_ref hash_tag(const string_ref & key)
+{
+  const char * open = static_cast<const char *>(memchr(key.data, '{', key.size));
+  if (!open)
+    return key;
+  const char * end = key.data + key.size;
+  const char * close = static_cast<const char *>(memchr(open + 1, '}', end - open - 1));
+  if (!close || close == open + 1)
+    return key;
+  return string_ref(open + 1, close - open - 1);
+}
+
+boost::uint32_t HashRing::hash(const string_ref & key)
+{
+  string_ref tag = hash_tag(key);
+  unsigned char digest[16];
+  md5(tag.data, tag.size, digest);
+  return digest_word(digest, 0);
+}
+
+HashRing::HashRing(const node_vector & nodes)
+  : nodes_(nodes.size())
+{
+  unsigned long total_weight = 0;
+  for (size_t i = 0; i < nodes.size(); ++i)
+    total_weight += nodes[i].weight;
+
+  for (size_t i = 0; i < nodes.size(); ++i)
+  {
+    double share = static_cast<double>(nodes[i].weight) / total_weight;
+    size_t digests = static_cast<size_t>(share * 40 * nodes.size());
+    if (digests == 0)
+      digests = 1;
+
+    char name[300];
+    for (size_t n = 0; n < digests; ++n)
+    {
+      int len = snprintf(name, sizeof(name), "%s:%u-%lu", nodes[i].host.c_str(),
+                         nodes[i].port, static_cast<unsigned long>(n));
+      unsigned char digest[16];
+      md5(name, std::min<size_t>(len, sizeof(name) - 1), digest);
+      for (int k = 0; k < 4; ++k)
+      {
+        point p = { digest_word(digest, k), i };
+        points_.push_back(p);
+      }
+    }
+  }
+  std::sort(points_.begin(), points_.end());
+}
+
+size_t HashRing::node_for(const string_ref & key) const
+{
+  if (nodes_ <= 1)
+    return 0;
+  point p = { hash(key), 0 };
+  std::vector<point>::const_iterator it = std::lower_bound(points_.begin(), points_.end(), p);
+  if (it == points_.end())
+    it = points_.begin();
+  return it->node;
+}
+
+RedisShards::RedisShards(const RedisPoolConfig & config, const node_vector & nodes, bool cluster,
+                         const std::vector<node_vector> & replicas, bool hedge)
+  : config_(config), cluster_(cluster), ring_(nodes), count_(0), node_added_(NULL),
+    refresh_wanted_(false), stop_(false), refresh_interval_(30)
+{
+  for (int i = 0; i < slot_count; ++i)
+    slots_[i].store(0, boost::memory_order_relaxed);
+  for (size_t i = 0; i < nodes.size(); ++i)
+    add_node_(nodes[i]);
+  if (!cluster_)
+  {
+    replicas_.resize(std::min(replicas.size(), nodes.size()), static_cast<ReplicaSet *>(NULL));
+    for (size_t i = 0; i < replicas_.size(); ++i)
+      if (!replicas[i].empty())
+        replicas_[i] = new ReplicaSet(config_, replicas[i], hedge);
+  }
+
+  if (cluster_)
+  {
+    const char * interval = getenv("REDIS_CLUSTER_REFRESH_S");
+    if (interval && atoi(interval) > 0)
+      refresh_interval_ = atoi(interval);
+    // Until a seed answers, every slot points at the first seed and the
+    // redirects will tell us better.
+    refresh();
+    refresher_ = boost::thread(&RedisShards::refresh_loop_, this);
+  }
+  maintainer_ = boost::thread(&RedisShards::maintain_loop_, this);
+}
+
+RedisShards::~RedisShards()
+{
+  stop();
+  for (size_t i = 0; i < replicas_.size(); ++i)
+    delete replicas_[i];
+  for (size_t i = 0; i < size(); ++i)
+    delete pools_[i];
+}
+
+void RedisShards::stop()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(refresh_mutex_);
+    stop_ = true;
+    refresh_wake_.notify_one();
+    maintain_wake_.notify_one();
+  }
+  if (refresher_.joinable())
+    refresher_.join();
+  if (maintainer_.joinable())
+    maintainer_.join();
+}
+
+unsigned RedisShards::key_slot(const string_ref & key)
+{
+  string_ref tag = hash_tag(key);
+  return crc16(tag.data, tag.size) & (slot_count - 1);
+}
+
+size_t RedisShards::node_for(const string_ref & key) const
+{
+  if (cluster_)
+    return slots_[key_slot(key)].load(boost::memory_order_acquire);
+  return ring_.node_for(key);
+}
+
+size_t RedisShards::add_node_(const RedisNode & node)
+{
+  boost::lock_guard<boost::mutex> lock(nodes_mutex_);
+  size_t n = count_.load(boost::memory_order_relaxed);
+  for (size_t i = 0; i < n; ++i)
+    if (nodes_[i].port == node.port && nodes_[i].host == node.host)
+      return i;
+  if (n == max_nodes)
+    throw connection_error("too many redis nodes");
+
+  RedisPoolConfig node_config = config_;
+  node_config.host = node.host;
+  node_config.port = node.port;
+  nodes_[n] = node;
+  pools_[n] = new RedisPool(node_config);
+  count_.store(n + 1, boost::memory_order_release);
+  if (node_added_)
+    node_added_(pools_[n]->config());
+  return n;
+}
+
+void RedisShards::observe(node_callback node_added)
+{
+  boost::lock_guard<boost::mutex> lock(nodes_mutex_);
+  node_added_ = node_added;
+  if (node_added_)
+    for (size_t i = 0; i < size(); ++i)
+      node_added_(pools_[i]->config());
+}
+
+size_t RedisShards::node_at(const string_type & host, unsigned int port)
+{
+  RedisNode node;
+  node.host = host;
+  node.port = port;
+  return add_node_(node);
+}
+
+size_t RedisShards::moved(int slot, const string_type & host, unsigned int port)
+{
+  size_t node = node_at(host, port);
+  slots_[slot].store(node, boost::memory_order_release);
+
+  boost::lock_guard<boost::mutex> lock(refresh_mutex_);
+  refresh_wanted_ = true;
+  refresh_wake_.notify_one();
+  return node;
+}
+
+// CLUSTER SLOTS replies with one entry per slot range:
+//   [start, end, [master host, port, id, ...], [replica ...], ...]
+
+bool RedisShards::load_slots_(size_t node)
+{
+  reply_vector replies;
+  try {
+    PooledClient client(pool(node));
+    RedisPipeline pipeline;
+    pipeline.command("CLUSTER", "SLOTS");
+    client->exec(pipeline, replies);
+  }
+  catch (redis_error &) {
+    return false;
+  }
+  if (replies.size() != 1 || replies[0].type != redis_reply::reply_array)
+    return false;
+
+  const reply_vector & ranges = replies[0].elements;
+  for (size_t i = 0; i < ranges.size(); ++i)
+  {
+    const redis_reply & range = ranges[i];
+    if (range.elements.size() < 3 || range.elements[2].elements.size() < 2)
+      continue;
+    long start = range.elements[0].integer;
+    long end   = range.elements[1].integer;
+    const reply_vector & master = range.elements[2].elements;
+    if (start < 0 || end >= slot_count || start > end)
+      continue;
+
+    // an empty host means the node we asked
+    string_type host = master[0].str.empty() || master[0].str == "?" ? nodes_[node].host : master[0].str;
+    size_t owner;
+    try {
+      owner = node_at(host, master[1].integer);
+    }
+    catch (redis_error &) {
+      continue;
+    }
+    for (long slot = start; slot <= end; ++slot)
+      slots_[slot].store(owner, boost::memory_order_release);
+  }
+  return true;
+}
+
+bool RedisShards::refresh()
+{
+  for (size_t i = 0; i < size(); ++i)
+    if (load_slots_(i))
+      return true;
+  return false;
+}
+
+void RedisShards::refresh_loop_()
+{
+  boost::unique_lock<boost::mutex> lock(refresh_mutex_);
+  while (!stop_)
+  {
+    if (!refresh_wanted_)
+      refresh_wake_.timed_wait(lock, boost::posix_time::seconds(refresh_interval_));
+    if (stop_)
+      break;
+    refresh_wanted_ = false;
+
+    lock.unlock();
+    refresh();
+    // a burst of redirects costs one reload
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    lock.lock();
+  }
+}
+
+// Probes run outside the lock; a probe is bounded by the connect and
+// command timeouts.
+void RedisShards::maintain_loop_()
+{
+  int interval = 1000;
+  if (config_.breaker.enabled)
+    interval = config_.breaker.probe_ms > 0 ? config_.breaker.probe_ms : 500;
+  boost::unique_lock<boost::mutex> lock(refresh_mutex_);
+  while (!stop_)
+  {
+    maintain_wake_.timed_wait(lock, boost::posix_time::milliseconds(interval));
+    if (stop_)
+      break;
+
+    lock.unlock();
+    std::vector<RedisPool *> pools;
+    for (size_t i = 0; i < size(); ++i)
+      pools.push_back(pools_[i]);
+    for (size_t i = 0; i < replicas_.size(); ++i)
+      for (size_t r = 0; replicas_[i] && r < replicas_[i]->size(); ++r)
+        pools.push_back(&replicas_[i]->pool(r));
+    for (size_t i = 0; i < pools.size(); ++i)
+    {
+      if (config_.breaker.enabled)
+        pools[i]->probe();
+      pools[i]->maintain();
+    }
+    lock.lock();
+  }
+}
+
+node_vector RedisShards::parse_nodes(const string_type & spec, unsigned int default_port)
+{
+  node_vector nodes;
+  string_type::size_type start = 0;
+  while (start < spec.size())
+  {
+    string_type::size_type end = spec.find(',', start);
+    if (end == string_type::npos)
+      end = spec.size();
+    string_type item = spec.substr(start, end - start);
+    start = end + 1;
+
+    // host[:port[:weight]], or unix:/path/to.sock
+    RedisNode node;
+    node.port = default_port;
+    string_type::size_type colon = is_unix_endpoint(item) ? string_type::npos : item.find(':');
+    node.host = item.substr(0, colon);
+    if (colon != string_type::npos)
+    {
+      node.port = atoi(item.c_str() + colon + 1);
+      string_type::size_type colon2 = item.find(':', colon + 1);
+      if (colon2 != string_type::npos && atoi(item.c_str() + colon2 + 1) > 0)
+        node.weight = atoi(item.c_str() + colon2 + 1);
+    }
+    if (!node.host.empty() && node.port > 0)
+      nodes.push_back(node);
+  }
+  return nodes;
+}
+
+node_vector RedisShards::nodes_from_env(const RedisPoolConfig & config)
+{
+  node_vector nodes;
+  const char * list = getenv("REDIS_NODES");
+  if (list)
+    nodes = parse_nodes(list, config.port);
+  if (nodes.empty())
+  {
+    RedisNode node;
+    node.host = config.host;
+    node.port = config.port;
+    nodes.push_back(node);
+  }
+  return nodes;
+}
+
+std::vector<node_vector> RedisShards::replicas_from_env(const RedisPoolConfig & config)
+{
+  std::vector<node_vector> replicas;
+  const char * list = getenv("REDIS_REPLICAS");
+  if (!list)
+    return replicas;
+  string_type spec(list);
+  string_type::size_type start = 0;
+  while (start <= spec.size())
+  {
+    string_type::size_type end = spec.find(';', start);
+    if (end == string_type::npos)
+      end = spec.size();
+    replicas.push_back(parse_nodes(spec.substr(start, end - start), config.port));
+    start = end + 1;
+  }
+  return replicas;
+}
+
+static RedisShards * global_shards_ = NULL;
+static boost::once_flag global_shards_once_ = BOOST_ONCE_INIT;
+
+static void create_global_shards()
+{
+  RedisPoolConfig config = RedisPoolConfig::from_env();
+  const char * cluster = getenv("REDIS_CLUSTER");
+  const char * hedge   = getenv("REDIS_HEDGE");
+  global_shards_ = new RedisShards(config, RedisShards::nodes_from_env(config),
+                                   cluster && atoi(cluster) != 0,
+                                   RedisShards::replicas_from_env(config),
+                                   hedge && atoi(hedge) != 0);
+}
+
+void stop_shards()
+{
+  if (global_shards_)
+    global_shards_->stop();
+}
+
+RedisShards & redis_shards()
+{
+  boost::call_once(global_shards_once_, create_global_shards);
+  return *global_shards_;
+}
+
+PooledClients::~PooledClients()
+{
+  for (size_t i = 0; i < clients_.size(); ++i)
+    if (clients_[i])
+      shards_.pool(i).checkin(clients_[i]);
+}
+
+RedisClient & PooledClients::client(size_t node)
+{
+  if (node >= clients_.size())
+    clients_.resize(node + 1, NULL);
+  if (!clients_[node])
+    clients_[node] = shards_.pool(node).checkout();
+  return *clients_[node];
+}
+
+// Sends every pipeline, then collects every node's replies.
+
+static void exec_parallel(client_source & source,
+                          std::vector<RedisPipeline> & pipelines,
+                          std::vector<reply_vector> & replies,
+                          string_vector & errors)
+{
+  size_t n = pipelines.size();
+  std::vector<RedisClient *> clients(n, static_cast<RedisClient *>(NULL));
+  std::vector<size_t> counts(n, 0);
+  replies.resize(n);
+  errors.assign(n, string_type());
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    replies[i].clear();
+    if (pipelines[i].empty())
+      continue;
+    try {
+      clients[i] = &source.client(i);
+      counts[i] = clients[i]->send(pipelines[i]);
+    }
+    catch (redis_error & e) {
+      pipelines[i].clear();
+      errors[i] = e;
+    }
+  }
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (counts[i] == 0)
+      continue;
+    try {
+      clients[i]->recv(counts[i], replies[i]);
+    }
+    catch (redis_error & e) {
+      replies[i].clear();
+      errors[i] = e;
+    }
+  }
+}
+
+static const int max_redirects = 5;
+static const size_t asking_reply = static_cast<size_t>(-1);
+
+void exec_routed(RedisShards & shards, client_source & source,
+                 std::vector<RedisPipeline> & pipelines,
+                 std::vector<reply_vector> & replies,
+                 string_vector & errors)
+{
+  if (!shards.cluster())
+  {
+    exec_parallel(source, pipelines, replies, errors);
+    return;
+  }
+
+  // what was sent, to resend redirected commands from, and the reply each
+  // sent command stands for: (node, index) into replies
+  typedef std::pair<size_t, size_t> reply_slot;
+  std::vector<RedisPipeline> sent = pipelines;
+  exec_parallel(source, pipelines, replies, errors);
+
+  std::vector<std::vector<reply_slot> > origin(replies.size());
+  for (size_t i = 0; i < replies.size(); ++i)
+    for (size_t j = 0; j < replies[i].size(); ++j)
+      origin[i].push_back(reply_slot(i, j));
+
+  std::vector<reply_vector> hop_replies;
+  string_vector hop_errors;
+  const std::vector<reply_vector> * seen = &replies;
+  string_type command;
+
+  for (int hop = 0; hop < max_redirects; ++hop)
+  {
+    std::vector<RedisPipeline> resend;
+    std::vector<std::vector<reply_slot> > resend_origin;
+    for (size_t i = 0; i < seen->size(); ++i)
+    {
+      for (size_t j = 0; j < (*seen)[i].size(); ++j)
+      {
+        const redis_reply & reply = (*seen)[i][j];
+        bool ask;
+        int slot;
+        string_type host;
+        unsigned int port;
+        if (reply.type != redis_reply::reply_error || origin[i][j].first == asking_reply
+            || !parse_redirect(reply.str, ask, slot, host, port))
+          continue;
+
+        size_t target;
+        try {
+          target = ask ? shards.node_at(host, port) : shards.moved(slot, host, port);
+        }
+        catch (redis_error &) {
+          continue;    // the redirect stands as the reply
+        }
+        if (target >= resend.size())
+        {
+          resend.resize(target + 1);
+          resend_origin.resize(target + 1);
+        }
+        if (ask)
+        {
+          resend[target].command("ASKING");
+          resend_origin[target].push_back(reply_slot(asking_reply, 0));
+        }
+        sent[i].encoded(j, command);
+        resend[target].command_encoded(command);
+        resend_origin[target].push_back(origin[i][j]);
+      }
+    }
+    if (resend.empty())
+      return;
+
+    sent = resend;
+    origin.swap(resend_origin);
+    exec_parallel(source, resend, hop_replies, hop_errors);
+
+    for (size_t i = 0; i < origin.size(); ++i)
+    {
+      for (size_t j = 0; j < origin[i].size(); ++j)
+      {
+        const reply_slot & o = origin[i][j];
+        if (o.first == asking_reply)
+          continue;
+        redis_reply & out = replies[o.first][o.second];
+        if (hop_errors[i].empty())
+          out = hop_replies[i][j];
+        else
+        {
+          out.type = redis_reply::reply_error;
+          out.str  = hop_errors[i];
+          out.elements.clear();
+        }
+      }
+    }
+    seen = &hop_replies;
+  }
+}
@@ -0,0 +1,207 @@
+#ifndef _REDIS_SHARD_H
+#define _REDIS_SHARD_H
+
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "redis_pool.h"
+
+// One Redis server of the sharded tier.
+
+struct RedisNode
+{
+  string_type  host;
+  unsigned int port;
+  unsigned int weight;    // relative share of the keyspace
+
+  RedisNode() : port(6379), weight(1) {}
+};
+
+typedef std::vector<RedisNode> node_vector;
+
+class ReplicaSet;
+
+// Ketama consistent-hash ring.
+//
+// Every node is placed on a 32-bit circle at 160 points per unit of weight
+// (40 MD5 digests of "host:port-<n>", 4 points each), and a key belongs to
+// the first point at or after the MD5 of the key.  Adding or removing one of
+// N nodes moves only the keys on its arcs, about 1/N of them, and the
+// placement matches libmemcached/twemproxy ketama for the same node names.
+//
+// As in Redis Cluster, only the part of the key inside the first {...} is
+// hashed when there is one, so "{user:1}:name" and "{user:1}:mail" land on
+// the same node.
+
+class HashRing
+{
+public:
+  explicit HashRing(const node_vector & nodes);
+
+  size_t          node_for(const string_ref & key) const;
+  size_t          size() const { return nodes_; }
+
+  static boost::uint32_t hash(const string_ref & key);
+
+private:
+  struct point
+  {
+    boost::uint32_t hash;
+    size_t          node;
+    bool operator<(const point & other) const { return hash < other.hash; }
+  };
+
+  std::vector<point> points_;   // sorted by hash
+  size_t             nodes_;
+};
+
+// The configured nodes, each with its own connection pool, and the map from
+// keys to nodes.
+//
+// By default keys are placed on the HashRing above.  In cluster mode
+// (REDIS_CLUSTER=1) the nodes are discovered with CLUSTER SLOTS from the
+// configured seeds, and a key goes to the owner of its slot, CRC16 of the
+// key (or of its {hash tag}) mod 16384.  The slot map is a flat table of
+// node indexes, so routing a key is one array index.  A MOVED redirect
+// patches its slot at once and wakes a background thread that reloads the
+// whole map; the map is also reloaded every REDIS_CLUSTER_REFRESH_S seconds
+// (default 30).
+//
+// Outside cluster mode a node may have read replicas (see ReplicaSet).
+//
+// A second background thread looks after the pools of the nodes and
+// replicas: it closes their surplus idle connections and, with
+// REDIS_BREAKER=1, probes the ones whose circuit breaker is open.
+//
+// Nodes are only ever added, at most max_nodes of them, so an index stays
+// valid for the life of the process and needs no lock.
+
+class RedisShards : private boost::noncopyable
+{
+public:
+  // replicas[i] are the read replicas of nodes[i]; ignored in cluster mode.
+  RedisShards(const RedisPoolConfig & config, const node_vector & nodes, bool cluster,
+              const std::vector<node_vector> & replicas = std::vector<node_vector>(),
+              bool hedge = false);
+  ~RedisShards();
+
+  bool              cluster() const { return cluster_; }
+  size_t            size() const { return count_.load(boost::memory_order_acquire); }
+  size_t            node_for(const string_ref & key) const;
+  RedisPool &       pool(size_t node) { return *pools_[node]; }
+  RedisPool &       pool_for(const string_ref & key) { return *pools_[node_for(key)]; }
+  const RedisNode & node(size_t node) const { return nodes_[node]; }
+  // The node's read replicas, or NULL when it has none.
+  ReplicaSet *      replicas(size_t node) const { return node < replicas_.size() ? replicas_[node] : NULL; }
+
+  // Cluster mode: records a MOVED redirect and returns the slot's new owner.
+  size_t            moved(int slot, const string_type & host, unsigned int port);
+  // The index of host:port, which is added if it is not known yet.
+  size_t            node_at(const string_type & host, unsigned int port);
+  // Reloads the slot map from the first node that answers CLUSTER SLOTS.
+  bool              refresh();
+  // Calls node_added with the pool settings of every node, now for the
+  // nodes known and later for each one that joins, until it is replaced or
+  // reset with NULL.  Calls happen under the node lock, so none is running
+  // once observe() returns.
+  typedef void (*node_callback)(const RedisPoolConfig & config);
+  void              observe(node_callback node_added);
+  // Stops the background refresh and upkeep; for plugin unload.
+  void              stop();
+
+  static unsigned   key_slot(const string_ref & key);
+
+  // REDIS_NODES ("host:port[:weight],..."), or the single node given by
+  // REDIS_HOST and REDIS_PORT.
+  static node_vector nodes_from_env(const RedisPoolConfig & config);
+  // REDIS_REPLICAS: the replicas of each node in REDIS_NODES order, nodes
+  // separated by ';' and replicas of one node by ',', e.g.
+  // "r1:6379,r2:6379;r3:6379".
+  static std::vector<node_vector> replicas_from_env(const RedisPoolConfig & config);
+  // "host[:port[:weight]],..." where a host may also be "unix:/path/to.sock";
+  // port defaults to default_port.
+  static node_vector parse_nodes(const string_type & spec, unsigned int default_port);
+
+  enum { max_nodes = 1024, slot_count = 16384 };
+
+private:
+  size_t            add_node_(const RedisNode & node);
+  bool              load_slots_(size_t node);
+  void              refresh_loop_();
+  void              maintain_loop_();
+
+  RedisPoolConfig                config_;
+  bool                           cluster_;
+  HashRing                       ring_;
+  RedisNode                      nodes_[max_nodes];
+  RedisPool *                    pools_[max_nodes];
+  boost::atomic<size_t>          count_;
+  boost::mutex                   nodes_mutex_;     // serializes add_node_
+  node_callback                  node_added_;      // guarded by nodes_mutex_
+  boost::atomic<boost::uint16_t> slots_[slot_count];
+  std::vector<ReplicaSet *>      replicas_;        // fixed after construction
+
+  boost::mutex                   refresh_mutex_;
+  boost::condition_variable      refresh_wake_;
+  bool                           refresh_wanted_;
+  bool                           stop_;
+  int                            refresh_interval_;  // seconds
+  boost::thread                  refresher_;
+  boost::condition_variable      maintain_wake_;
+  boost::thread                  maintainer_;
+};
+
+// Process-wide shards built from the environment on first use.
+
+RedisShards & redis_shards();
+
+// Joins the refresh and upkeep threads.  The pools are left alone.  Called
+// once, when the plugin is unloaded.
+void          stop_shards();
+
+// Where exec_routed() gets the connection to a node.  client() may throw
+// redis_error when the node cannot be reached.
+
+class client_source
+{
+public:
+  virtual ~client_source() {}
+  virtual RedisClient & client(size_t node) = 0;
+};
+
+// A client_source that checks connections out of the shards' pools and
+// hands them back when it goes out of scope.
+
+class PooledClients : public client_source, private boost::noncopyable
+{
+public:
+  explicit PooledClients(RedisShards & shards) : shards_(shards) {}
+  ~PooledClients();
+
+  RedisClient & client(size_t node);
+
+private:
+  RedisShards &              shards_;
+  std::vector<RedisClient *> clients_;
+};
+
+// Runs one pipeline per node, pipelines[i] holding the commands for node i.
+// Every pipeline is sent before any reply is read, so the nodes work
+// through their batches at the same time.  A node that cannot be reached
+// gets errors[i] set and no replies; the others carry on.
+//
+// In cluster mode commands answered with MOVED or ASK are resent, in one
+// more parallel round per hop, to the node named in the redirect, and the
+// final reply takes the place of the redirect in replies.
+
+void exec_routed(RedisShards & shards, client_source & source,
+                 std::vector<RedisPipeline> & pipelines,
+                 std::vector<reply_vector> & replies,
+                 string_vector & errors);
+
+#endif
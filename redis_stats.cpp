@@ -0,0 +1,329 @@
+#include "redis_stats.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+static bool env_on(const char * name, bool fallback)
+{
+  const char * value = getenv(name);
+  return value && *value ? atoi(value) != 0 : fallback;
+}
+
+bool stats_enabled = env_on("REDIS_STATS", true);
+
+static const char * command_names[stat_command_count] = {
+  "GET", "SET", "GETSET", "DEL", "HGET", "HSET", "HMGET", "HMSET", "INCR", "EVAL", "PIPELINE", "OTHER"
+};
+
+const char * stat_command_name(stat_command cmd)
+{
+  return command_names[cmd];
+}
+
+thread_stats::thread_stats()
+{
+  for (int c = 0; c < stat_command_count; ++c)
+  {
+    commands_[c].calls.store(0);
+    commands_[c].errors.store(0);
+    commands_[c].total_us.store(0);
+    for (int b = 0; b < buckets; ++b)
+      commands_[c].histogram[b].store(0);
+  }
+  bytes_sent_.store(0);
+  bytes_received_.store(0);
+  syscalls_.store(0);
+  pipelines_.store(0);
+  pipelined_.store(0);
+  connects_.store(0);
+  connect_failures_.store(0);
+  compressed_.store(0);
+  compress_in_.store(0);
+  compress_out_.store(0);
+  compress_us_.store(0);
+  decompressed_.store(0);
+  decompress_in_.store(0);
+  decompress_out_.store(0);
+  decompress_us_.store(0);
+}
+
+unsigned long long thread_stats::bucket_limit(unsigned b)
+{
+  if (b < sub_buckets)
+    return b;
+  int shift = b / sub_buckets - 1;
+  unsigned long long lower = static_cast<unsigned long long>(sub_buckets + b % sub_buckets) << shift;
+  return lower + (1ULL << shift) - 1;
+}
+
+stats_totals::stats_totals()
+  : bytes_sent(0), bytes_received(0), syscalls(0), pipelines(0), pipelined(0),
+    connects(0), connect_failures(0),
+    compressed(0), compress_in(0), compress_out(0), compress_us(0),
+    decompressed(0), decompress_in(0), decompress_out(0), decompress_us(0), threads(0), since_ms(0)
+{
+  for (int c = 0; c < stat_command_count; ++c)
+  {
+    commands[c].calls = commands[c].errors = commands[c].total_us = 0;
+    commands[c].histogram.assign(thread_stats::buckets, 0);
+  }
+}
+
+void stats_totals::add(const thread_stats & t)
+{
+  for (int c = 0; c < stat_command_count; ++c)
+  {
+    const thread_stats::per_command & from = t.commands_[c];
+    per_command & to = commands[c];
+    to.calls    += from.calls.load(boost::memory_order_relaxed);
+    to.errors   += from.errors.load(boost::memory_order_relaxed);
+    to.total_us += from.total_us.load(boost::memory_order_relaxed);
+    for (int b = 0; b < thread_stats::buckets; ++b)
+      to.histogram[b] += from.histogram[b].load(boost::memory_order_relaxed);
+  }
+  bytes_sent       += t.bytes_sent_.load(boost::memory_order_relaxed);
+  bytes_received   += t.bytes_received_.load(boost::memory_order_relaxed);
+  syscalls         += t.syscalls_.load(boost::memory_order_relaxed);
+  pipelines        += t.pipelines_.load(boost::memory_order_relaxed);
+  pipelined        += t.pipelined_.load(boost::memory_order_relaxed);
+  connects         += t.connects_.load(boost::memory_order_relaxed);
+  connect_failures += t.connect_failures_.load(boost::memory_order_relaxed);
+  compressed       += t.compressed_.load(boost::memory_order_relaxed);
+  compress_in      += t.compress_in_.load(boost::memory_order_relaxed);
+  compress_out     += t.compress_out_.load(boost::memory_order_relaxed);
+  compress_us      += t.compress_us_.load(boost::memory_order_relaxed);
+  decompressed     += t.decompressed_.load(boost::memory_order_relaxed);
+  decompress_in    += t.decompress_in_.load(boost::memory_order_relaxed);
+  decompress_out   += t.decompress_out_.load(boost::memory_order_relaxed);
+  decompress_us    += t.decompress_us_.load(boost::memory_order_relaxed);
+}
+
+void stats_totals::subtract(const stats_totals & base)
+{
+  for (int c = 0; c < stat_command_count; ++c)
+  {
+    commands[c].calls    -= base.commands[c].calls;
+    commands[c].errors   -= base.commands[c].errors;
+    commands[c].total_us -= base.commands[c].total_us;
+    for (int b = 0; b < thread_stats::buckets; ++b)
+      commands[c].histogram[b] -= base.commands[c].histogram[b];
+  }
+  bytes_sent       -= base.bytes_sent;
+  bytes_received   -= base.bytes_received;
+  syscalls         -= base.syscalls;
+  pipelines        -= base.pipelines;
+  pipelined        -= base.pipelined;
+  connects         -= base.connects;
+  connect_failures -= base.connect_failures;
+  compressed       -= base.compressed;
+  compress_in      -= base.compress_in;
+  compress_out     -= base.compress_out;
+  compress_us      -= base.compress_us;
+  decompressed     -= base.decompressed;
+  decompress_in    -= base.decompress_in;
+  decompress_out   -= base.decompress_out;
+  decompress_us    -= base.decompress_us;
+}
+
+unsigned long long stats_totals::per_command::percentile(double p) const
+{
+  if (calls == 0)
+    return 0;
+  boost::uint64_t rank = static_cast<boost::uint64_t>(p * calls);
+  if (rank >= calls)
+    rank = calls - 1;
+  boost::uint64_t seen = 0;
+  for (size_t b = 0; b < histogram.size(); ++b)
+  {
+    seen += histogram[b];
+    if (seen > rank)
+      return thread_stats::bucket_limit(b);
+  }
+  return thread_stats::bucket_limit(histogram.size() - 1);
+}
+
+// ---- per-thread blocks ----
+
+static boost::mutex                  registry_mutex_;
+static std::vector<thread_stats *>   blocks_;       // every block ever made
+static std::vector<thread_stats *>   free_blocks_;  // of threads that exited
+static stats_totals                  baseline_;
+static const unsigned long long      loaded_ms_ = monotonic_ms();
+static __thread thread_stats *       local_ = NULL;
+
+static void release_block(void * t)
+{
+  boost::lock_guard<boost::mutex> lock(registry_mutex_);
+  free_blocks_.push_back(static_cast<thread_stats *>(t));
+}
+
+// Hands the block back when its thread exits, MySQL's own threads included.
+// A plain pthread key rather than boost::thread_specific_ptr: stop_stats()
+// deletes it at unload, after which no thread calls into the plugin on
+// exit, whereas boost keeps the cleanup registered on every thread.
+static pthread_key_t owner_key_;
+static bool          owner_key_ok_ = pthread_key_create(&owner_key_, release_block) == 0;
+
+thread_stats * local_stats()
+{
+  if (local_ || !stats_enabled)
+    return local_;
+
+  thread_stats * t;
+  {
+    boost::lock_guard<boost::mutex> lock(registry_mutex_);
+    if (!free_blocks_.empty())
+    {
+      t = free_blocks_.back();
+      free_blocks_.pop_back();
+    }
+    else
+    {
+      t = new thread_stats();
+      blocks_.push_back(t);
+    }
+  }
+  if (owner_key_ok_)
+    pthread_setspecific(owner_key_, t);
+  local_ = t;
+  return t;
+}
+
+void stop_stats()
+{
+  // Blocks of threads still alive stay in the registry.
+  if (owner_key_ok_)
+  {
+    owner_key_ok_ = false;
+    pthread_key_delete(owner_key_);
+  }
+}
+
+stats_totals stats_snapshot()
+{
+  boost::lock_guard<boost::mutex> lock(registry_mutex_);
+  stats_totals totals;
+  for (size_t i = 0; i < blocks_.size(); ++i)
+    totals.add(*blocks_[i]);
+  totals.subtract(baseline_);
+  totals.threads  = blocks_.size() - free_blocks_.size();
+  totals.since_ms = baseline_.since_ms ? baseline_.since_ms : loaded_ms_;
+  return totals;
+}
+
+void stats_reset()
+{
+  boost::lock_guard<boost::mutex> lock(registry_mutex_);
+  stats_totals totals;
+  for (size_t i = 0; i < blocks_.size(); ++i)
+    totals.add(*blocks_[i]);
+  totals.since_ms = monotonic_ms();
+  baseline_ = totals;
+}
+
+// ---- slow log ----
+
+static unsigned long long slowlog_threshold()
+{
+  const char * value = getenv("REDIS_SLOWLOG_US");
+  long long us = value && *value ? atoll(value) : 10000;
+  return us < 0 ? ~0ULL : static_cast<unsigned long long>(us);
+}
+
+static size_t slowlog_length()
+{
+  const char * value = getenv("REDIS_SLOWLOG_LEN");
+  long len = value && *value ? atol(value) : 128;
+  return len > 0 ? static_cast<size_t>(len) : 1;
+}
+
+unsigned long long slowlog_threshold_us = slowlog_threshold();
+bool               command_timing = stats_enabled || slowlog_threshold_us != ~0ULL;
+__thread unsigned long long slowlog_connect_us = 0;
+
+namespace {
+
+struct slowlog_slot
+{
+  boost::atomic<boost::uint64_t> version;   // odd while being written
+  slowlog_entry                  entry;
+};
+
+}
+
+static const size_t                   slowlog_size_ = slowlog_length();
+static slowlog_slot *                 slowlog_ring_ = new slowlog_slot[slowlog_size_]();
+static boost::atomic<boost::uint64_t> slowlog_next_(1);
+static boost::atomic<boost::uint64_t> slowlog_since_(1);   // first id after the last reset
+static __thread unsigned long         thread_id_ = 0;
+
+void slowlog_record(stat_command cmd, const string_ref & key, const command_trace & trace,
+                    unsigned long long started_us, unsigned long long connect_us,
+                    unsigned long long now_us, bool ok)
+{
+  boost::uint64_t id = slowlog_next_.fetch_add(1, boost::memory_order_relaxed);
+  slowlog_slot & slot = slowlog_ring_[id % slowlog_size_];
+  boost::uint64_t version = slot.version.load(boost::memory_order_relaxed);
+  if ((version & 1) || !slot.version.compare_exchange_strong(version, version + 1, boost::memory_order_acquire))
+    return;
+
+  if (!thread_id_)
+    thread_id_ = syscall(SYS_gettid);
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  slowlog_entry & e = slot.entry;
+  e.id          = id;
+  e.time_ms     = tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+  e.thread_id   = thread_id_;
+  e.command     = cmd;
+  e.ok          = ok;
+  e.key_len     = std::min(key.size, static_cast<size_t>(slowlog_key_max));
+  e.key_bytes   = key.size;
+  memcpy(e.key, key.data, e.key_len);
+  e.reply_bytes = trace.reply_bytes;
+  e.connect_us  = connect_us;
+  unsigned long long first_byte = trace.first_byte_us >= started_us ? trace.first_byte_us : now_us;
+  e.wait_us     = first_byte - started_us;
+  e.parse_us    = now_us - first_byte;
+
+  slot.version.store(version + 2, boost::memory_order_release);
+}
+
+static bool newer(const slowlog_entry & a, const slowlog_entry & b)
+{
+  return a.id > b.id;
+}
+
+void slowlog_entries(std::vector<slowlog_entry> & out, size_t max)
+{
+  out.clear();
+  boost::uint64_t since = slowlog_since_.load(boost::memory_order_relaxed);
+  for (size_t i = 0; i < slowlog_size_; ++i)
+  {
+    slowlog_slot & slot = slowlog_ring_[i];
+    boost::uint64_t before = slot.version.load(boost::memory_order_acquire);
+    if (before == 0 || (before & 1))
+      continue;
+    slowlog_entry e = slot.entry;
+    boost::atomic_thread_fence(boost::memory_order_acquire);
+    if (slot.version.load(boost::memory_order_relaxed) != before || e.id < since)
+      continue;
+    out.push_back(e);
+  }
+  std::sort(out.begin(), out.end(), newer);
+  if (out.size() > max)
+    out.resize(max);
+}
+
+void slowlog_reset()
+{
+  slowlog_since_.store(slowlog_next_.load(boost::memory_order_relaxed), boost::memory_order_relaxed);
+}
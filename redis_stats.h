@@ -0,0 +1,279 @@
+#ifndef _REDIS_STATS_H
+#define _REDIS_STATS_H
+
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "redis_protocol.h"
+
+// Plugin metrics, returned by redis_stats() (REDIS_STATS=0 turns them off),
+// and the slow log further down.
+//
+// Each thread records into its own block of counters.  Only that thread
+// writes them, with relaxed atomic stores, so recording is a few
+// uncontended adds: no lock and no shared cache line.  redis_stats() sums
+// the blocks on demand.  A block outlives its thread and goes to the next
+// new thread, so no count is lost and there are only as many blocks as the
+// peak number of threads.  A reset leaves the blocks alone and stores the
+// current sums as a baseline that later sums subtract.
+//
+// Latencies go into log-linear histograms in the manner of HdrHistogram.
+// There are 8 buckets per power of two microseconds, so a reported
+// percentile is within 12.5% of the true value, up to two minutes.
+
+enum stat_command
+{
+  stat_get, stat_set, stat_getset, stat_del, stat_hget, stat_hset, stat_hmget, stat_hmset,
+  stat_incr, stat_eval, stat_pipeline, stat_other, stat_command_count
+};
+
+const char * stat_command_name(stat_command cmd);
+
+class thread_stats : private boost::noncopyable
+{
+public:
+  enum { sub_buckets = 8, buckets = 200 };
+
+  thread_stats();
+
+  void command(stat_command cmd, unsigned long long latency_us, bool ok)
+  {
+    per_command & c = commands_[cmd];
+    bump_(c.calls, 1);
+    if (!ok)
+      bump_(c.errors, 1);
+    bump_(c.total_us, latency_us);
+    bump_(c.histogram[bucket(latency_us)], 1);
+  }
+  void io(size_t sent, size_t received, unsigned long syscalls)
+  {
+    if (sent)
+      bump_(bytes_sent_, sent);
+    if (received)
+      bump_(bytes_received_, received);
+    bump_(syscalls_, syscalls);
+  }
+  void pipeline(size_t commands)
+  {
+    bump_(pipelines_, 1);
+    bump_(pipelined_, commands);
+  }
+  void connect(bool ok) { bump_(ok ? connects_ : connect_failures_, 1); }
+  // Values deflated for storage (stored is what went out, the original
+  // size when it did not shrink) and values inflated on the way back.
+  void compressed(size_t original, size_t stored, unsigned long long us)
+  {
+    bump_(compressed_, 1);
+    bump_(compress_in_, original);
+    bump_(compress_out_, stored);
+    bump_(compress_us_, us);
+  }
+  void decompressed(size_t stored, size_t original, unsigned long long us)
+  {
+    bump_(decompressed_, 1);
+    bump_(decompress_in_, stored);
+    bump_(decompress_out_, original);
+    bump_(decompress_us_, us);
+  }
+
+  static unsigned bucket(unsigned long long us)
+  {
+    if (us < sub_buckets)
+      return static_cast<unsigned>(us);
+    int msb = 63 - __builtin_clzll(us);
+    unsigned b = (msb - 2) * sub_buckets + ((us >> (msb - 3)) & (sub_buckets - 1));
+    return b < buckets ? b : buckets - 1;
+  }
+  // Largest latency in bucket b, in microseconds.
+  static unsigned long long bucket_limit(unsigned b);
+
+private:
+  friend struct stats_totals;
+  typedef boost::atomic<boost::uint64_t> counter;
+
+  static void bump_(counter & c, boost::uint64_t n)
+  {
+    c.store(c.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+  }
+
+  struct per_command
+  {
+    counter calls;
+    counter errors;
+    counter total_us;
+    counter histogram[buckets];
+  };
+
+  per_command commands_[stat_command_count];
+  counter     bytes_sent_;
+  counter     bytes_received_;
+  counter     syscalls_;
+  counter     pipelines_;
+  counter     pipelined_;
+  counter     connects_;
+  counter     connect_failures_;
+  counter     compressed_;
+  counter     compress_in_;
+  counter     compress_out_;
+  counter     compress_us_;
+  counter     decompressed_;
+  counter     decompress_in_;
+  counter     decompress_out_;
+  counter     decompress_us_;
+};
+
+// Sums over every thread's block.
+struct stats_totals
+{
+  struct per_command
+  {
+    boost::uint64_t calls;
+    boost::uint64_t errors;
+    boost::uint64_t total_us;
+    std::vector<boost::uint64_t> histogram;
+
+    // Latency below which fraction p of the calls completed.
+    unsigned long long percentile(double p) const;
+  };
+
+  per_command     commands[stat_command_count];
+  boost::uint64_t bytes_sent;
+  boost::uint64_t bytes_received;
+  boost::uint64_t syscalls;
+  boost::uint64_t pipelines;
+  boost::uint64_t pipelined;
+  boost::uint64_t connects;
+  boost::uint64_t connect_failures;
+  boost::uint64_t compressed;
+  boost::uint64_t compress_in;
+  boost::uint64_t compress_out;
+  boost::uint64_t compress_us;
+  boost::uint64_t decompressed;
+  boost::uint64_t decompress_in;
+  boost::uint64_t decompress_out;
+  boost::uint64_t decompress_us;
+  size_t          threads;
+  unsigned long long since_ms;   // monotonic time of the last reset
+
+  stats_totals();
+  void add(const thread_stats & t);
+  void subtract(const stats_totals & base);
+};
+
+extern bool stats_enabled;
+
+// The calling thread's block; NULL when stats are off.
+thread_stats * local_stats();
+
+// Current sums since the last reset, and the reset itself.
+stats_totals   stats_snapshot();
+void           stats_reset();
+
+// Stops handing blocks back at thread exit.  Called once, when the plugin
+// is unloaded, so no thread runs plugin code on its way out.
+void           stop_stats();
+
+// ---- slow log ----
+//
+// Commands slower than REDIS_SLOWLOG_US go into a ring of the last
+// REDIS_SLOWLOG_LEN entries, returned by redis_slowlog().  Recording takes
+// no lock and allocates nothing: a writer claims a slot by making its
+// version odd, fills it in and makes it even again; a reader copies a slot
+// and keeps it only if the version did not move meanwhile.  A writer that
+// finds its slot being written drops the entry.
+
+enum { slowlog_key_max = 64 };   // bytes of the key kept
+
+// What a RedisClient saw of the command in flight; reset by every send.
+struct command_trace
+{
+  unsigned long long first_byte_us;   // arrival of the first reply byte, 0 before
+  size_t             reply_bytes;
+
+  command_trace() : first_byte_us(0), reply_bytes(0) {}
+};
+
+struct slowlog_entry
+{
+  boost::uint64_t    id;
+  boost::uint64_t    time_ms;       // wall clock, at completion
+  unsigned long      thread_id;     // OS thread id
+  stat_command       command;
+  bool               ok;
+  char               key[slowlog_key_max];
+  size_t             key_len;       // kept in key
+  size_t             key_bytes;     // of the whole key
+  size_t             reply_bytes;
+  unsigned long long connect_us;    // checking out the connection, when it was not idle
+  unsigned long long wait_us;       // from sending to the first reply byte
+  unsigned long long parse_us;      // from the first reply byte to the decoded reply
+};
+
+// Slowest command latency that is not logged; ULLONG_MAX when the log is off.
+extern unsigned long long slowlog_threshold_us;
+extern bool               command_timing;    // stats or slow log on
+
+// Time the calling thread spent in RedisPool::checkout() that its next
+// command has not been charged with yet.
+extern __thread unsigned long long slowlog_connect_us;
+
+void slowlog_record(stat_command cmd, const string_ref & key, const command_trace & trace,
+                    unsigned long long started_us, unsigned long long connect_us,
+                    unsigned long long now_us, bool ok);
+
+// Newest first, at most max of them, from since the last reset.
+void slowlog_entries(std::vector<slowlog_entry> & out, size_t max);
+void slowlog_reset();
+
+// Charges the time from construction to destruction to slowlog_connect_us.
+class connect_timer : private boost::noncopyable
+{
+public:
+  connect_timer() : started_(slowlog_threshold_us != ~0ULL ? monotonic_us() : 0) {}
+  ~connect_timer()
+  {
+    if (started_)
+      slowlog_connect_us += monotonic_us() - started_;
+  }
+
+private:
+  unsigned long long started_;
+};
+
+// Times one command for the thread's stats and the slow log.  The command
+// counts as failed unless done() is reached, e.g. when a throw skips it.
+class command_timer : private boost::noncopyable
+{
+public:
+  command_timer(stat_command cmd, const command_trace & trace, const string_ref & key)
+    : cmd_(cmd), trace_(trace), key_(key), started_(command_timing ? monotonic_us() : 0), ok_(false) {}
+  // For a command sent earlier, at started_us (0: not timed).
+  command_timer(stat_command cmd, const command_trace & trace, const string_ref & key,
+                unsigned long long started_us)
+    : cmd_(cmd), trace_(trace), key_(key), started_(started_us), ok_(false) {}
+  ~command_timer()
+  {
+    if (!started_)
+      return;
+    unsigned long long now = monotonic_us();
+    if (thread_stats * stats = local_stats())
+      stats->command(cmd_, now - started_, ok_);
+    unsigned long long connect = slowlog_connect_us;
+    if (connect)
+      slowlog_connect_us = 0;
+    if (now - started_ + connect >= slowlog_threshold_us)
+      slowlog_record(cmd_, key_, trace_, started_, connect, now, ok_);
+  }
+  void done() { ok_ = true; }
+
+private:
+  stat_command          cmd_;
+  const command_trace & trace_;
+  string_ref            key_;
+  unsigned long long    started_;
+  bool                  ok_;
+};
+
+#endif
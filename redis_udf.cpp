@@ -1,13 +1,45 @@
 #include <mysql.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 #include <vector>
+#include <new>
+#include <stdlib.h>
 #include "redis_client.h"
+#include "redis_shard.h"
+#include "redis_replica.h"
+#include "redis_writer.h"
+#include "redis_cache.h"
+#include "redis_memo.h"
+#include "redis_script.h"
+#include "redis_counter.h"
+#include "redis_compress.h"
 using namespace std;
 
+// Background threads must be gone before the plugin is unloaded, and they
+// go in dependency order: the write-behind and counter flushers still send
+// through the pools and invalidate the cache while they drain, so they stop
+// first, then the cache's subscribers, then the shards' refresh threads.
+// Last, the compression streams and the stats' thread-exit hooks are
+// removed, since mysqld's threads outlive the plugin.
+// One static here instead of one per module, whose destruction order
+// across translation units would be unspecified.
+static struct plugin_reaper
+{
+	~plugin_reaper()
+	{
+		stop_write_behind();
+		stop_counters();
+		stop_cache();
+		stop_shards();
+		stop_compress();
+		stop_stats();
+	}
+} plugin_reaper_;
+
 #define SUCCESS "SUCCESS"
 #define RESULT(x) setResult(result,length,x)
-#define STRING_RESULT(x) setStringResult(result,length,x)
+#define ARG(i) string_ref(args->args[i],args->lengths[i])
 
 extern "C" void setResult(char* result,unsigned long * length,const char *resultValue)
 {
@@ -30,6 +62,487 @@ extern "C" void setStringResult(char* result,unsigned long * length,string_type
 	setResult(result,length,c_retValue);
 }
 
+// Per-statement state hung off UDF_INIT::ptr.  It is built in *_init, reused
+// for every row and released in *_deinit, so a row costs one round trip and
+// no fresh allocations once the buffers have grown to size.
+
+struct udf_state
+{
+	std::vector<RedisClient *> clients;  // pinned connection per node, checked out on first use
+	string_ref_vector fields;  // argument staging for hmget/hmset
+	string_ref_vector values;
+	string_type    reply;      // bulk reply
+	string_vector  replies;    // hmget values copied out of the cache
+	bulk_ref_vector views;     // hmget values, wherever they are
+	statement_memo *memo;      // read UDFs with REDIS_STATEMENT_MEMO=1
+	bool           replica_reads;  // read UDFs may use the key's replicas
+	ReplicaSet::read_clients replica_clients;  // of the last replica read
+	string_ref_vector argv;    // command of a replica read or a script
+	string_type    script;     // redis_eval(): the last script and its SHA1
+	string_type    script_sha;
+	string_vector  packed;     // compressed values, by argument
+	char *         buf;        // result buffer for values over MySQL's 255 bytes
+	size_t         buf_size;
+
+	// aggregate UDFs: rows queued per node since the last flush and the
+	// group's tally
+	std::vector<RedisPipeline> pipelines;
+	std::vector<reply_vector>  pipeline_replies;
+	string_vector  pipeline_errors;
+	size_t         queued;
+	size_t         batch_size;
+	unsigned long  agg_ok;
+	unsigned long  agg_errors;
+	string_type    agg_error;  // first error of the group
+	string_vector  agg_keys;   // keys of the queued rows, when the cache is on
+};
+
+#define STATE (reinterpret_cast<udf_state *>(initid->ptr))
+#define STATE_RESULT(x) stateResult(initid,result,length,(x).data(),(x).size())
+#define VALUE(i) valueArg(initid,args,i)
+
+// MySQL hands every string UDF a result buffer of this size.
+static const size_t mysql_result_size = 255;
+
+// Advertised as initid->max_length by the read UDFs so MySQL sizes the
+// result column as a MEDIUMBLOB rather than VARCHAR(255).
+static const unsigned long max_result_length = 16777215;
+
+static my_bool state_init(UDF_INIT *initid, char *message)
+{
+	udf_state *state = new (std::nothrow) udf_state();
+	if(!state){
+		strncpy(message, "out of memory", MYSQL_ERRMSG_SIZE);
+		return 1;
+	}
+	initid->ptr = reinterpret_cast<char *>(state);
+	return 0;
+}
+
+static void state_deinit(UDF_INIT *initid)
+{
+	udf_state *state = STATE;
+	if(!state)
+		return;
+	for(size_t i = 0;i < state->clients.size();i++)
+		if(state->clients[i])
+			redis_shards().pool(i).checkin(state->clients[i]);
+	state->replica_clients.release();
+	delete state->memo;
+	free(state->buf);
+	delete state;
+	initid->ptr = NULL;
+}
+
+// Where read UDFs go when the key's node has replicas: REDIS_READ_FROM
+// (replica by default, or primary), unless the call names its own as a
+// last, constant argument aliased read_from, e.g.
+// rget('k', 'primary' AS read_from).  The alias tells it apart from one of
+// hmget's fields.
+
+static bool has_read_from(UDF_ARGS *args)
+{
+	if(args->arg_count == 0 || !args->attributes)
+		return false;
+	unsigned int last = args->arg_count - 1;
+	return args->attribute_lengths[last] == 9 && memcmp(args->attributes[last], "read_from", 9) == 0;
+}
+
+// The arguments before the read_from one.
+static unsigned int read_arg_count(UDF_ARGS *args)
+{
+	return args->arg_count - (has_read_from(args) ? 1 : 0);
+}
+
+static bool read_from_default()
+{
+	const char *mode = getenv("REDIS_READ_FROM");
+	return !(mode && strcmp(mode, "primary") == 0);
+}
+
+// Read UDFs remember every reply of the statement when REDIS_STATEMENT_MEMO
+// is set, bounded by REDIS_STATEMENT_MEMO_BYTES (default 64 MB).  Their
+// routing is fixed here, for this call in this statement only.
+static my_bool memo_state_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+	bool replica_reads = read_from_default();
+	if(has_read_from(args)){
+		unsigned int last = args->arg_count - 1;
+		string_type mode = args->args[last] ? string_type(args->args[last], args->lengths[last]) : "";
+		if(mode == "primary" || mode == "replica")
+			replica_reads = mode == "replica";
+		else if(mode != "default"){
+			strncpy(message, "read_from must be a constant 'primary', 'replica' or 'default'", MYSQL_ERRMSG_SIZE);
+			return 1;
+		}
+		args->arg_type[last] = STRING_RESULT;
+	}
+	if(state_init(initid, message))
+		return 1;
+	STATE->replica_reads = replica_reads;
+	const char *enabled = getenv("REDIS_STATEMENT_MEMO");
+	if(enabled && atoi(enabled) != 0){
+		const char *bytes = getenv("REDIS_STATEMENT_MEMO_BYTES");
+		long n = bytes ? atol(bytes) : 0;
+		STATE->memo = new (std::nothrow) statement_memo(n > 0 ? n : 64L * 1024 * 1024);
+	}
+	return 0;
+}
+
+// The statement's connection to a node.  A connection broken by an earlier
+// row goes back to the pool (which closes it) and a fresh one is checked out.
+// Throws circuit_open_error while the node's breaker is open, even when the
+// statement still holds a connection.
+static RedisClient & node_client(UDF_INIT *initid, size_t node)
+{
+	udf_state *state = STATE;
+	RedisShards & shards = redis_shards();
+	if(!shards.pool(node).breaker().allow())
+		throw circuit_open_error("circuit breaker open for " + shards.node(node).host);
+	if(state->clients.size() <= node)
+		state->clients.resize(node + 1, NULL);
+	RedisClient *& client = state->clients[node];
+	if(client && client->broken()){
+		shards.pool(node).checkin(client);
+		client = NULL;
+	}
+	if(!client)
+		client = shards.pool(node).checkout();
+	return *client;
+}
+
+// Where a single-key command goes: the node that owns the key, then in
+// cluster mode wherever a MOVED or ASK redirect points.  Used as
+//
+//   for(key_route route(initid,key);route.next();){
+//   	try{ route.client().get(key,value); }
+//   	catch(redirect_error &){ route.follow(); }
+//   }
+class key_route
+{
+public:
+	key_route(UDF_INIT *initid, const string_ref & key)
+		: initid_(initid), node_(redis_shards().node_for(key)), ask_(false), hops_(0), pending_(true) {}
+
+	bool next()
+	{
+		bool pending = pending_;
+		pending_ = false;
+		return pending;
+	}
+
+	RedisClient & client()
+	{
+		RedisClient & c = node_client(initid_, node_);
+		if(ask_){
+			ask_ = false;
+			c.asking();
+		}
+		return c;
+	}
+
+	// Call from the redirect_error handler; rethrows when the redirect is
+	// not to be followed.
+	void follow()
+	{
+		RedisShards & shards = redis_shards();
+		try{
+			throw;
+		}
+		catch(redirect_error & e){
+			if(!shards.cluster() || ++hops_ > max_hops)
+				throw;
+			node_ = e.ask ? shards.node_at(e.host, e.port) : shards.moved(e.slot, e.host, e.port);
+			ask_ = e.ask;
+			pending_ = true;
+		}
+	}
+
+private:
+	enum { max_hops = 5 };
+	UDF_INIT *initid_;
+	size_t    node_;
+	bool      ask_;
+	int       hops_;
+	bool      pending_;
+};
+
+// Sends the read in state->argv to a replica of key's node.  Returns the
+// client to finish it with end_read(), or NULL when the statement reads
+// from the primary, the node has no replicas or none of them can be
+// reached; the read then goes to the primary.  The replica connections
+// stay checked out until the next replica read, so a view returned by
+// end_read() lives as long as the row.
+static RedisClient *replica_client(UDF_INIT *initid, const string_ref & key, ReplicaSet *& replicas)
+{
+	udf_state *state = STATE;
+	state->replica_clients.release();
+	if(!state->replica_reads)
+		return NULL;
+	RedisShards & shards = redis_shards();
+	size_t node = shards.node_for(key);
+	replicas = shards.replicas(node);
+	if(!replicas)
+		return NULL;
+	try{
+		return &replicas->read(shards.pool(node), state->argv, state->replica_clients);
+	}
+	catch(redis_error &){
+		state->replica_clients.release();
+		return NULL;
+	}
+}
+
+// Whether a replica read that failed with e should go to the primary: the
+// connection broke, or the replica cannot serve reads at the moment (it is
+// loading its data set, has lost its primary, or is running a script).
+// Other error replies, WRONGTYPE say, are what the primary would answer.
+static bool replica_unavailable(RedisClient *client, const protocol_error & e)
+{
+	if(client->broken())
+		return true;
+	string errMsg(e);
+	return errMsg.compare(0, 7, "LOADING") == 0 || errMsg.compare(0, 10, "MASTERDOWN") == 0
+		|| errMsg.compare(0, 4, "BUSY") == 0;
+}
+
+// GET (field == NULL) or HGET from a replica; false sends it to the primary.
+static bool replica_get(UDF_INIT *initid, const string_ref & key, const string_ref *field, string_ref & value)
+{
+	string_ref_vector & argv = STATE->argv;
+	argv.clear();
+	argv.push_back(field ? "HGET" : "GET");
+	argv.push_back(key);
+	if(field)
+		argv.push_back(*field);
+	ReplicaSet *replicas = NULL;
+	RedisClient *client = replica_client(initid, key, replicas);
+	if(!client)
+		return false;
+	try{
+		client->end_read(value);
+		return true;
+	}
+	catch(timeout_error &){
+		return false;    // read() has counted it
+	}
+	catch(connection_error &){
+	}
+	catch(protocol_error & e){
+		if(!replica_unavailable(client, e))
+			throw;
+	}
+	replicas->failed(STATE->replica_clients, client);
+	return false;
+}
+
+static bool replica_hmget(UDF_INIT *initid, const string_ref & key, const string_ref_vector & fields, bulk_ref_vector & out)
+{
+	string_ref_vector & argv = STATE->argv;
+	argv.clear();
+	argv.push_back("HMGET");
+	argv.push_back(key);
+	argv.insert(argv.end(), fields.begin(), fields.end());
+	ReplicaSet *replicas = NULL;
+	RedisClient *client = replica_client(initid, key, replicas);
+	if(!client)
+		return false;
+	try{
+		client->end_read(out);
+		return true;
+	}
+	catch(timeout_error &){
+		return false;    // read() has counted it
+	}
+	catch(connection_error &){
+	}
+	catch(protocol_error & e){
+		if(!replica_unavailable(client, e))
+			throw;
+	}
+	replicas->failed(STATE->replica_clients, client);
+	return false;
+}
+
+// exec_routed() connections: the statement's own.
+class state_clients : public client_source
+{
+public:
+	explicit state_clients(UDF_INIT *initid) : initid_(initid) {}
+	RedisClient & client(size_t node) { return node_client(initid_, node); }
+private:
+	UDF_INIT *initid_;
+};
+
+// Returns the buffer to hand back to MySQL for a value of len bytes: its
+// own result buffer when the value fits, otherwise the statement's growable
+// buffer.  len shrinks when the buffer cannot grow.
+static char *stateBuffer(UDF_INIT *initid, char *result, size_t & len)
+{
+	udf_state *state = STATE;
+	if(len > mysql_result_size && len > state->buf_size){
+		char *grown = static_cast<char *>(realloc(state->buf, len));
+		if(grown){
+			state->buf = grown;
+			state->buf_size = len;
+		}
+		else
+			len = mysql_result_size;    // truncate rather than fail the row
+	}
+	return len > mysql_result_size ? state->buf : result;
+}
+
+static char *stateResult(UDF_INIT *initid, char *result, unsigned long *length, const char *data, size_t len)
+{
+	char *out = stateBuffer(initid, result, len);
+	memcpy(out,data,len);
+	*length = len;
+	return out;
+}
+
+// Argument i as it goes to Redis: deflated into the statement's packed
+// buffers when compression is on and the value is long enough to bother.
+static string_ref valueArg(UDF_INIT *initid, UDF_ARGS *args, unsigned int i)
+{
+	string_ref value = ARG(i);
+	if(!compress_wanted(value.size))
+		return value;
+	string_vector & packed = STATE->packed;
+	if(packed.size() <= i)
+		packed.resize(i + 1);
+	return compress_value(value, packed[i]) ? string_ref(packed[i]) : value;
+}
+
+// Length of a stored value once inflated.
+static size_t valueSize(const string_ref & value)
+{
+	size_t size;
+	return compressed_size(value, size) ? size : value.size;
+}
+
+// Copies a stored value into out, which holds up to n bytes, inflating it
+// on the way when it was stored compressed.  Returns the bytes written.
+static size_t copyValue(const string_ref & value, char *out, size_t n)
+{
+	size_t size;
+	if(compressed_size(value, size) && size <= n && decompress_value(value, out, size))
+		return size;
+	n = std::min(value.size, n);    // legacy value, or one that would not fit
+	memcpy(out, value.data, n);
+	return n;
+}
+
+// The hmget result, values joined by commas, written straight from the
+// views into the result buffer.  Nil values read as missing_value.
+static char *joinResult(UDF_INIT *initid, char *result, unsigned long *length, const bulk_ref_vector & values)
+{
+	size_t len = values.size() - 1;
+	for(size_t i = 0;i < values.size();i++)
+		len += values[i].nil ? missing_value.size() : valueSize(values[i].data);
+
+	char *out = stateBuffer(initid, result, len);
+	size_t pos = 0;
+	for(size_t i = 0;i < values.size() && pos < len;i++){
+		if(i > 0)
+			out[pos++] = ',';
+		string_ref v = values[i].nil ? string_ref(missing_value) : values[i].data;
+		pos += copyValue(v, out + pos, len - pos);
+	}
+	*length = pos;
+	return out;
+}
+
+// Hands MySQL the value where it already lives instead of copying it: the
+// client's read buffer, the statement memo or the state's reply string.  All
+// of them belong to the statement and stay put until the next row.
+static char *viewResult(unsigned long *length, const string_ref & value)
+{
+	*length = value.size;
+	return const_cast<char *>(value.data);
+}
+
+// viewResult() for a value read from Redis: one stored compressed is
+// inflated straight into the result buffer instead.
+static char *valueResult(UDF_INIT *initid, char *result, unsigned long *length, const string_ref & value)
+{
+	size_t size;
+	if(!compressed_size(value, size))
+		return viewResult(length,value);
+	char *out = stateBuffer(initid, result, size);
+	if(!decompress_value(value, out, size))
+		return viewResult(length,value);    // not ours after all: as stored
+	*length = size;
+	return out;
+}
+
+// Result of a row that failed fast on an open circuit breaker: NULL, or
+// REDIS_FALLBACK when it is set.
+static char *fallbackResult(UDF_INIT *initid, char *result, unsigned long *length, char *is_null)
+{
+	const char *fallback = getenv("REDIS_FALLBACK");
+	if(!fallback){
+		*is_null = 1;
+		return result;
+	}
+	return stateResult(initid, result, length, fallback, strlen(fallback));
+}
+
+// Appends s to out as a JSON string.  Bytes outside ASCII are copied as
+// they are, so UTF-8 keys stay readable.
+static void json_string(string_type & out, const char *s, size_t n)
+{
+	out += '"';
+	for(size_t i = 0;i < n;i++){
+		unsigned char c = s[i];
+		if(c == '"' || c == '\\'){
+			out += '\\';
+			out += c;
+		}
+		else if(c < 0x20){
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			out += esc;
+		}
+		else
+			out += c;
+	}
+	out += '"';
+}
+
+// Write-behind mode: copy the write into a write_op for the background
+// flusher and report success as soon as it is queued.
+static char *queueWrite(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, write_op::op_kind kind)
+{
+	write_op *op = new write_op();
+	op->kind = kind;
+	op->key.assign(args->args[0], args->lengths[0]);
+	switch(kind){
+	case write_op::op_set:
+		op->values.push_back(VALUE(1).str());
+		break;
+	case write_op::op_hset:
+	case write_op::op_hmset:
+		for(unsigned int i = 1;i + 1 < args->arg_count;i += 2){
+			op->fields.push_back(ARG(i).str());
+			op->values.push_back(VALUE(i + 1).str());
+		}
+		if(op->fields.empty()){
+			delete op;
+			throw protocol_error("invalid arguments");
+		}
+		break;
+	case write_op::op_del:
+		break;
+	}
+	// the flusher invalidates again once the write has reached Redis
+	if(RedisCache *cache = redis_cache())
+		cache->invalidate(ARG(0));
+	if(!write_behind().push(op))
+		throw connection_error("write-behind queue full, write dropped");
+	RESULT(SUCCESS);
+	return result;
+}
+
 extern "C" char *hset(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error){
 	memset(result,0,sizeof(result));
 	if(!(args->args && args->args[0] && args->args[1] && args->args[2])){
@@ -38,15 +551,23 @@ extern "C" char *hset(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned l
       return result;
    }
    try{
-   	RedisClient *p_client = init_client_if_isnull();
-   	p_client->hset(args->args[0],args->args[1],args->args[2]);
+   	if(write_behind_enabled())
+   		return queueWrite(initid,args,result,length,write_op::op_hset);
+   	for(key_route route(initid,ARG(0));route.next();){
+   		try{ route.client().hset(ARG(0),ARG(1),VALUE(2)); }
+   		catch(redirect_error &){ route.follow(); }
+   	}
+   	if(RedisCache *cache = redis_cache())
+   		cache->invalidate(ARG(0),ARG(1));
    	RESULT(SUCCESS);
    	return result;
  	}
+ 	catch(circuit_open_error &){
+ 		return fallbackResult(initid,result,length,is_null);
+ 	}
  	catch(redis_error & e){
  		string errMsg(e);
- 		STRING_RESULT(errMsg);
- 		return result;
+ 		return STATE_RESULT(errMsg);
  	}
   
 }
@@ -62,8 +583,12 @@ extern "C" my_bool hset_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
     args->arg_type[1] = STRING_RESULT;
     args->arg_type[2] = STRING_RESULT;
 
-    initid->ptr       = NULL;
-    return 0;
+    return state_init(initid, message);
+}
+
+extern "C" void hset_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
 }
 
 
@@ -76,30 +601,55 @@ extern "C" char *hget(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned l
       return result;
    }
    try{
-   	RedisClient *p_client = init_client_if_isnull();
-   	string_type ret = p_client->hget(args->args[0],args->args[1]);
-   	STRING_RESULT(ret);
-  	return result;
+   	statement_memo *memo = STATE->memo;
+   	string_ref field = ARG(1);
+   	string_ref value;
+   	if(memo && memo->find(ARG(0),&field,value))
+   		return valueResult(initid,result,length,value);
+   	RedisCache *cache = redis_cache();
+   	if(cache && cache->get(ARG(0),&field,STATE->reply))
+   		value = STATE->reply;
+   	else{
+   		boost::uint64_t epoch = cache ? cache->epoch(ARG(0)) : 0;
+   		if(!replica_get(initid,ARG(0),&field,value)){
+   			for(key_route route(initid,ARG(0));route.next();){
+   				try{ route.client().hget(ARG(0),field,value); }
+   				catch(redirect_error &){ route.follow(); }
+   			}
+   		}
+   		if(cache)
+   			cache->put(ARG(0),&field,value,epoch);
+   	}
+   	if(memo)
+   		memo->insert(ARG(0),&field,value);
+  	return valueResult(initid,result,length,value);
+ 	}
+ 	catch(circuit_open_error &){
+ 		return fallbackResult(initid,result,length,is_null);
  	}
  	catch(redis_error & e){
  		string errMsg(e);
- 		STRING_RESULT(errMsg);
- 		return result;
+ 		return STATE_RESULT(errMsg);
  	}
 }
 
 
 extern "C" my_bool hget_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
 {
-    if (2 != args->arg_count  || args->arg_type[0] != STRING_RESULT  || args->arg_type[1] != STRING_RESULT ){ // hset(key, field, value) 需要三个参数
+    if (2 != read_arg_count(args)  || args->arg_type[0] != STRING_RESULT  || args->arg_type[1] != STRING_RESULT ){ // hset(key, field, value) 需要三个参数
         strncpy(message, "please input 3 args and must be string, such as: hget('key', 'feild');", MYSQL_ERRMSG_SIZE);
         return -1;
     }
     args->arg_type[0] = STRING_RESULT;
     args->arg_type[1] = STRING_RESULT;
 
-    initid->ptr       = NULL;
-    return 0;
+    initid->max_length = max_result_length;
+    return memo_state_init(initid, args, message);
+}
+
+extern "C" void hget_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
 }
 
 extern "C" char *del(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error){
@@ -110,15 +660,23 @@ extern "C" char *del(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned lo
       return result;
    }
    try{
-   	RedisClient *p_client = init_client_if_isnull();
-   	p_client->del(args->args[0]);
+   	if(write_behind_enabled())
+   		return queueWrite(initid,args,result,length,write_op::op_del);
+   	for(key_route route(initid,ARG(0));route.next();){
+   		try{ route.client().del(ARG(0)); }
+   		catch(redirect_error &){ route.follow(); }
+   	}
+   	if(RedisCache *cache = redis_cache())
+   		cache->invalidate(ARG(0));
    	RESULT(SUCCESS);
   	return result;
  	}
+ 	catch(circuit_open_error &){
+ 		return fallbackResult(initid,result,length,is_null);
+ 	}
  	catch(redis_error & e){
  		string errMsg(e);
- 		STRING_RESULT(errMsg);
- 		return result;
+ 		return STATE_RESULT(errMsg);
  	}
 }
 
@@ -131,8 +689,12 @@ extern "C" my_bool del_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
     }
     args->arg_type[0] = STRING_RESULT;
 
-    initid->ptr       = NULL;
-    return 0;
+    return state_init(initid, message);
+}
+
+extern "C" void del_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
 }
 
 
@@ -144,15 +706,23 @@ extern "C" char *rset(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned l
       return result;
    }
    try{
-   	RedisClient *p_client = init_client_if_isnull();
-   	p_client->set(args->args[0],args->args[1]);
+   	if(write_behind_enabled())
+   		return queueWrite(initid,args,result,length,write_op::op_set);
+   	for(key_route route(initid,ARG(0));route.next();){
+   		try{ route.client().set(ARG(0),VALUE(1)); }
+   		catch(redirect_error &){ route.follow(); }
+   	}
+   	if(RedisCache *cache = redis_cache())
+   		cache->invalidate(ARG(0));
    	RESULT(SUCCESS);
   	return result;
  	}
+ 	catch(circuit_open_error &){
+ 		return fallbackResult(initid,result,length,is_null);
+ 	}
  	catch(redis_error & e){
  		string errMsg(e);
- 		STRING_RESULT(errMsg);
- 		return result;
+ 		return STATE_RESULT(errMsg);
  	}
 }
 
@@ -165,8 +735,12 @@ extern "C" my_bool rset_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
     }
     args->arg_type[0] = STRING_RESULT;
 		args->arg_type[1] = STRING_RESULT;
-    initid->ptr       = NULL;
-    return 0;
+    return state_init(initid, message);
+}
+
+extern "C" void rset_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
 }
 
 
@@ -178,71 +752,122 @@ extern "C" char *rget(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned l
       return result;
    }
    try{
-   	RedisClient *p_client = init_client_if_isnull();
-   	string_type ret = p_client->get(args->args[0]);
-   	STRING_RESULT(ret);
-  	return result;
+   	statement_memo *memo = STATE->memo;
+   	string_ref value;
+   	if(memo && memo->find(ARG(0),NULL,value))
+   		return valueResult(initid,result,length,value);
+   	RedisCache *cache = redis_cache();
+   	if(cache && cache->get(ARG(0),NULL,STATE->reply))
+   		value = STATE->reply;
+   	else{
+   		boost::uint64_t epoch = cache ? cache->epoch(ARG(0)) : 0;
+   		if(!replica_get(initid,ARG(0),NULL,value)){
+   			for(key_route route(initid,ARG(0));route.next();){
+   				try{ route.client().get(ARG(0),value); }
+   				catch(redirect_error &){ route.follow(); }
+   			}
+   		}
+   		if(cache)
+   			cache->put(ARG(0),NULL,value,epoch);
+   	}
+   	if(memo)
+   		memo->insert(ARG(0),NULL,value);
+  	return valueResult(initid,result,length,value);
+ 	}
+ 	catch(circuit_open_error &){
+ 		return fallbackResult(initid,result,length,is_null);
  	}
  	catch(redis_error & e){
  		string errMsg(e);
- 		STRING_RESULT(errMsg);
- 		return result;
+ 		return STATE_RESULT(errMsg);
  	}
 }
 
 
 extern "C" my_bool rget_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
 {
-    if (1 != args->arg_count  || args->arg_type[0] != STRING_RESULT ){ // hset(key, field, value) 需要三个参数
+    if (1 != read_arg_count(args)  || args->arg_type[0] != STRING_RESULT ){ // hset(key, field, value) 需要三个参数
         strncpy(message, "please input 2 args and must be string, such as: get('key');", MYSQL_ERRMSG_SIZE);
         return -1;
     }
     args->arg_type[0] = STRING_RESULT;
-    initid->ptr       = NULL;
-    return 0;
+    initid->max_length = max_result_length;
+    return memo_state_init(initid, args, message);
+}
+
+extern "C" void rget_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
 }
 
 extern "C" char *hmget(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error){
 	memset(result,0,sizeof(result));
    try{
-   	string_vector fields = string_vector();
-   	string_vector out = string_vector();
-   	for(int i = 1;i < args->arg_count;i++)
+   	string_ref_vector & fields = STATE->fields;
+   	bulk_ref_vector & out = STATE->views;
+   	unsigned int count = read_arg_count(args);
+   	fields.resize(count - 1);
+   	for(unsigned int i = 1;i < count;i++)
    	{
-   		string_type field(args->args[i]);
-   		fields.push_back(field);
+   		fields[i - 1] = ARG(i);
    	}
    	
-   	RedisClient *p_client = init_client_if_isnull();
-   	p_client->hmget(args->args[0],fields,out);
+   	// served from the memo or the cache only when every field is there
+   	statement_memo *memo = STATE->memo;
+   	bool memoized = memo != NULL;
+   	if(memo){
+   		out.resize(fields.size());
+   		for(size_t i = 0;memoized && i < fields.size();i++){
+   			out[i].nil = false;
+   			memoized = memo->find(ARG(0),&fields[i],out[i].data);
+   		}
+   	}
+   	RedisCache *cache = redis_cache();
+   	bool cached = memoized || cache != NULL;
+   	if(!memoized && cache){
+   		string_vector & copies = STATE->replies;
+   		copies.resize(fields.size());
+   		out.resize(fields.size());
+   		for(size_t i = 0;cached && i < fields.size();i++){
+   			cached = cache->get(ARG(0),&fields[i],copies[i]);
+   			out[i] = string_ref(copies[i]);
+   		}
+   	}
+   	if(!cached){
+   		boost::uint64_t epoch = cache ? cache->epoch(ARG(0)) : 0;
+   		if(!replica_hmget(initid,ARG(0),fields,out)){
+   			for(key_route route(initid,ARG(0));route.next();){
+   				try{ route.client().hmget(ARG(0),fields,out); }
+   				catch(redirect_error &){ route.follow(); }
+   			}
+   		}
+   		if(cache)
+   			for(size_t i = 0;i < fields.size();i++)
+   				cache->put(ARG(0),&fields[i],out[i].nil ? string_ref(missing_value) : out[i].data,epoch);
+   	}
+   	if(memo && !memoized)
+   		for(size_t i = 0;i < fields.size();i++)
+   			memo->insert(ARG(0),&fields[i],out[i].nil ? string_ref(missing_value) : out[i].data);
    	if(out.size() > 0)
- 		{
- 			string ret("");
- 			int size = out.size();
- 			for(int i = 0;i < size;i++)
- 			{
- 				ret += out[i];
- 				if(i < size -1)
- 					ret += ",";
- 			}
- 			STRING_RESULT(ret);
- 		}
+ 			return joinResult(initid,result,length,out);
  		else{
  			RESULT(NULL);
  		}
   	return result;
  	}
+ 	catch(circuit_open_error &){
+ 		return fallbackResult(initid,result,length,is_null);
+ 	}
  	catch(redis_error & e){
  		string errMsg(e);
- 		STRING_RESULT(errMsg);
- 		return result;
+ 		return STATE_RESULT(errMsg);
  	}
 }
 
 
 extern "C" my_bool hmget_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
 {
-    if (args->arg_count < 2 ){ // hset(key, field, value) 需要三个参数
+    if (read_arg_count(args) < 2 ){ // hset(key, field, value) 需要三个参数
         strncpy(message, "please input 2 or more args and must be string, such as: hmget('key',id1,id2...);", MYSQL_ERRMSG_SIZE);
         return -1;
     }
@@ -250,52 +875,70 @@ extern "C" my_bool hmget_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
     {
     	args->arg_type[i] = STRING_RESULT;
     }
-    initid->ptr       = NULL;
-    return 0;
+    initid->max_length = max_result_length;
+    return memo_state_init(initid, args, message);
+}
+
+extern "C" void hmget_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
 }
 
 
 extern "C" char *hmset(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error){
 	memset(result,0,sizeof(result));
    try{
-   	string_vector fields = string_vector();
-   	string_vector values = string_vector();
+   	if(write_behind_enabled())
+   		return queueWrite(initid,args,result,length,write_op::op_hmset);
+   	string_ref_vector & fields = STATE->fields;
+   	string_ref_vector & values = STATE->values;
+   	fields.resize(args->arg_count / 2);
+   	values.resize((args->arg_count - 1) / 2);
    	for(int i = 1;i < args->arg_count;i++)
    	{
-   		string element(args->args[i]);
    		if(i % 2 == 0){
-   			values.push_back(element);
+   			values[i / 2 - 1] = VALUE(i);
    		}
    		else{
-   			fields.push_back(element);
+   			fields[i / 2] = ARG(i);
    		}
    	}
    	
-   	RedisClient *p_client = init_client_if_isnull();
-   	p_client->hmset(args->args[0],fields,values);
+   	for(key_route route(initid,ARG(0));route.next();){
+   		try{ route.client().hmset(ARG(0),fields,values); }
+   		catch(redirect_error &){ route.follow(); }
+   	}
+   	if(RedisCache *cache = redis_cache())
+   		cache->invalidate(ARG(0));
    	RESULT(SUCCESS);
   	return result;
  	}
+ 	catch(circuit_open_error &){
+ 		return fallbackResult(initid,result,length,is_null);
+ 	}
  	catch(redis_error & e){
  		string errMsg(e);
- 		STRING_RESULT(errMsg);
- 		return result;
+ 		return STATE_RESULT(errMsg);
  	}
 }
 
 
 extern "C" my_bool hmset_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
 {
-    if (args->arg_count < 3 ){
-        strncpy(message, "please input 3 or more args and must be string, such as: hmset('key',id1,value1,...);", MYSQL_ERRMSG_SIZE);
+    if (args->arg_count < 3 || args->arg_count % 2 == 0){ // a key and whole field/value pairs
+        strncpy(message, "please input a key and field/value pairs, such as: hmset('key',id1,value1,...);", MYSQL_ERRMSG_SIZE);
         return -1;
     }
     for(int i = 0;i < args->arg_count;i++)
     {
     	args->arg_type[i] = STRING_RESULT;
     }
-    initid->ptr       = NULL;
-    return 0;
+    return state_init(initid, message);
+}
+
+extern "C" void hmset_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
 }
 
 
@@ -307,15 +950,21 @@ extern "C" char *getset(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned
       return result;
    }
    try{
-   	RedisClient *p_client = init_client_if_isnull();
-   	string_type ret = p_client->getset(args->args[0],args->args[1]);
-   	STRING_RESULT(ret);
-   	return result;
+   	string_ref value;
+   	for(key_route route(initid,ARG(0));route.next();){
+   		try{ route.client().getset(ARG(0),VALUE(1),value); }
+   		catch(redirect_error &){ route.follow(); }
+   	}
+   	if(RedisCache *cache = redis_cache())
+   		cache->invalidate(ARG(0));
+   	return valueResult(initid,result,length,value);
+ 	}
+ 	catch(circuit_open_error &){
+ 		return fallbackResult(initid,result,length,is_null);
  	}
  	catch(redis_error & e){
  		string errMsg(e);
- 		STRING_RESULT(errMsg);
- 		return result;
+ 		return STATE_RESULT(errMsg);
  	}
   
 }
@@ -330,6 +979,1028 @@ extern "C" my_bool getset_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
     args->arg_type[0] = STRING_RESULT;
     args->arg_type[1] = STRING_RESULT;
 
-    initid->ptr       = NULL;
-    return 0;
-}
\ No newline at end of file
+    initid->max_length = max_result_length;
+    return state_init(initid, message);
+}
+
+extern "C" void getset_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+
+// redis_eval(script, numkeys, key..., arg...) and redis_evalsha(sha,
+// numkeys, key..., arg...): Redis EVAL and EVALSHA, for read-modify-write
+// steps that would otherwise take several UDF calls, e.g.
+//
+//   SELECT redis_eval('if redis.call("hget",KEYS[1],"state") == ARGV[1] then
+//                        return redis.call("hset",KEYS[1],"state",ARGV[2]) end
+//                      return -1', 1, CONCAT('order:', id), 'new', 'paid') FROM orders;
+//
+// Both send EVALSHA, so redis_eval() sends the script text only when the
+// node does not have it yet.  redis_evalsha() can reload a script that
+// redis_eval() or redis_script_load() has seen in this mysqld.  The script
+// runs on the node of its first key (keys must share a slot in cluster
+// mode), and keys are dropped from the read cache, as the script may have
+// written them.  Writes are not queued in write-behind mode.
+//
+// Bulk and status replies are returned as they are, integers in decimal,
+// nil as NULL, Redis errors as their text, and arrays as JSON arrays.
+
+static void json_reply(string_type & out, const redis_reply & reply)
+{
+	char num[24];
+	switch(reply.type){
+	case redis_reply::reply_integer:
+		snprintf(num, sizeof(num), "%ld", reply.integer);
+		out += num;
+		break;
+	case redis_reply::reply_nil:
+		out += "null";
+		break;
+	case redis_reply::reply_array:
+		out += '[';
+		for(size_t i = 0;i < reply.elements.size();i++){
+			if(i > 0)
+				out += ',';
+			json_reply(out, reply.elements[i]);
+		}
+		out += ']';
+		break;
+	default:
+		json_string(out, reply.str.data(), reply.str.size());
+		break;
+	}
+}
+
+static char *replyResult(UDF_INIT *initid, char *result, unsigned long *length, char *is_null, const redis_reply & reply)
+{
+	string_type & ret = STATE->reply;
+	switch(reply.type){
+	case redis_reply::reply_nil:
+		*is_null = 1;
+		return result;
+	case redis_reply::reply_integer:{
+		char num[24];
+		int len = snprintf(num, sizeof(num), "%ld", reply.integer);
+		return stateResult(initid, result, length, num, len);
+	}
+	case redis_reply::reply_array:
+		ret.clear();
+		json_reply(ret, reply);
+		return STATE_RESULT(ret);
+	default:
+		return STATE_RESULT(reply.str);
+	}
+}
+
+static my_bool script_udf_init(UDF_INIT *initid, UDF_ARGS *args, char *message, const char *usage)
+{
+	if(args->arg_count < 2){
+		strncpy(message, usage, MYSQL_ERRMSG_SIZE);
+		return -1;
+	}
+	args->arg_type[1] = INT_RESULT;
+	for(unsigned int i = 0;i < args->arg_count;i++)
+		if(i != 1)
+			args->arg_type[i] = STRING_RESULT;
+	initid->maybe_null = 1;
+	initid->max_length = max_result_length;
+	return state_init(initid, message);
+}
+
+// Runs the script named by sha with the UDF's numkeys, keys and args.
+// script is its text when the UDF has it.
+static char *runScript(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null,
+                       const string_ref & sha, const string_ref *script)
+{
+	long long numkeys = args->args[1] ? *(long long *)args->args[1] : -1;
+	if(numkeys < 0 || numkeys > (long long)args->arg_count - 2){
+		RESULT("numkeys must be between 0 and the number of keys and args");
+		return result;
+	}
+	char numkeys_arg[24];
+	snprintf(numkeys_arg, sizeof(numkeys_arg), "%lld", numkeys);
+	string_ref_vector & argv = STATE->argv;
+	argv.clear();
+	argv.push_back("EVALSHA");
+	argv.push_back(sha);
+	argv.push_back(numkeys_arg);
+	for(unsigned int i = 2;i < args->arg_count;i++)
+		argv.push_back(args->args[i] ? ARG(i) : string_ref());
+
+	string_ref key = numkeys > 0 ? argv[3] : string_ref();
+	redis_reply reply;
+	for(key_route route(initid,key);route.next();){
+		try{ run_script(route.client(),argv,script,reply); }
+		catch(redirect_error &){ route.follow(); }
+	}
+	if(RedisCache *cache = redis_cache())
+		for(long long i = 0;i < numkeys;i++)
+			cache->invalidate(argv[3 + i]);
+	return replyResult(initid,result,length,is_null,reply);
+}
+
+extern "C" my_bool redis_eval_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+	return script_udf_init(initid, args, message,
+		"please input at least 2 args, such as: redis_eval('return redis.call(\"get\",KEYS[1])', 1, 'key');");
+}
+
+extern "C" void redis_eval_deinit(UDF_INIT *initid)
+{
+	state_deinit(initid);
+}
+
+extern "C" char *redis_eval(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	if(!args->args[0]){
+		*is_null = 1;
+		return result;
+	}
+	try{
+		udf_state *state = STATE;
+		string_ref script = ARG(0);
+		if(state->script_sha.empty() || script.size != state->script.size() ||
+		   memcmp(script.data, state->script.data(), script.size) != 0){
+			state->script.assign(script.data, script.size);
+			state->script_sha = remember_script(script);
+		}
+		return runScript(initid,args,result,length,is_null,state->script_sha,&script);
+	}
+	catch(circuit_open_error &){
+		return fallbackResult(initid,result,length,is_null);
+	}
+	catch(redis_error & e){
+		string errMsg(e);
+		return STATE_RESULT(errMsg);
+	}
+}
+
+extern "C" my_bool redis_evalsha_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+	return script_udf_init(initid, args, message,
+		"please input at least 2 args, such as: redis_evalsha('<sha1>', 1, 'key');");
+}
+
+extern "C" void redis_evalsha_deinit(UDF_INIT *initid)
+{
+	state_deinit(initid);
+}
+
+extern "C" char *redis_evalsha(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	if(!args->args[0]){
+		*is_null = 1;
+		return result;
+	}
+	try{
+		return runScript(initid,args,result,length,is_null,ARG(0),NULL);
+	}
+	catch(circuit_open_error &){
+		return fallbackResult(initid,result,length,is_null);
+	}
+	catch(redis_error & e){
+		string errMsg(e);
+		return STATE_RESULT(errMsg);
+	}
+}
+
+// redis_script_load(script): loads the script on every node and returns
+// its SHA1 for redis_evalsha().  The script is also remembered here, so
+// redis_evalsha() reloads it wherever it goes missing later.
+
+extern "C" my_bool redis_script_load_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+	if(1 != args->arg_count || args->arg_type[0] != STRING_RESULT){
+		strncpy(message, "please input 1 arg and must be string, such as: redis_script_load('return 1');", MYSQL_ERRMSG_SIZE);
+		return -1;
+	}
+	initid->maybe_null = 1;
+	return state_init(initid, message);
+}
+
+extern "C" void redis_script_load_deinit(UDF_INIT *initid)
+{
+	state_deinit(initid);
+}
+
+extern "C" char *redis_script_load(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	if(!args->args[0]){
+		*is_null = 1;
+		return result;
+	}
+	try{
+		string_type sha = remember_script(ARG(0));
+		RedisShards & shards = redis_shards();
+		RedisPipeline load;
+		reply_vector replies;
+		for(size_t node = 0;node < shards.size();node++){
+			load.command("SCRIPT", "LOAD", ARG(0));
+			node_client(initid, node).exec(load, replies);
+			if(!replies[0].ok())
+				return STATE_RESULT(replies[0].str);
+		}
+		return STATE_RESULT(sha);
+	}
+	catch(circuit_open_error &){
+		return fallbackResult(initid,result,length,is_null);
+	}
+	catch(redis_error & e){
+		string errMsg(e);
+		return STATE_RESULT(errMsg);
+	}
+}
+
+
+// redis_incrby(key, delta), redis_hincrby(key, field, delta) and
+// redis_hincrbyfloat(key, field, delta): INCRBY, HINCRBY and HINCRBYFLOAT,
+// returning the new value.  With REDIS_COUNTER_COALESCE=1 they return
+// SUCCESS instead and the delta joins the other increments of the same
+// counter in process, to be sent as one command per counter every
+// REDIS_COUNTER_FLUSH_MS; redis_flush() sends them at once.
+
+static my_bool incr_udf_init(UDF_INIT *initid, UDF_ARGS *args, char *message, unsigned int arg_count,
+                             Item_result delta_type, const char *usage)
+{
+	if(arg_count != args->arg_count){
+		strncpy(message, usage, MYSQL_ERRMSG_SIZE);
+		return -1;
+	}
+	for(unsigned int i = 0;i + 1 < arg_count;i++)
+		args->arg_type[i] = STRING_RESULT;
+	args->arg_type[arg_count - 1] = delta_type;
+	initid->maybe_null = 1;
+	return state_init(initid, message);
+}
+
+static char *incrResult(UDF_INIT *initid, char *result, unsigned long *length, int_type value)
+{
+	char num[24];
+	int len = snprintf(num, sizeof(num), "%ld", value);
+	return stateResult(initid, result, length, num, len);
+}
+
+extern "C" my_bool redis_incrby_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+	return incr_udf_init(initid, args, message, 2, INT_RESULT,
+		"please input 2 args, such as: redis_incrby('key', 1);");
+}
+
+extern "C" void redis_incrby_deinit(UDF_INIT *initid)
+{
+	state_deinit(initid);
+}
+
+extern "C" char *redis_incrby(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	if(!(args->args[0] && args->args[1])){
+		*is_null = 1;
+		return result;
+	}
+	long long delta = *(long long *)args->args[1];
+	try{
+		if(counter_coalescing_enabled()){
+			redis_counters().add(RedisCounters::kind_incrby, ARG(0), string_ref(), delta, 0);
+			RESULT(SUCCESS);
+			return result;
+		}
+		int_type value = 0;
+		for(key_route route(initid,ARG(0));route.next();){
+			try{ value = route.client().incrby(ARG(0),delta); }
+			catch(redirect_error &){ route.follow(); }
+		}
+		if(RedisCache *cache = redis_cache())
+			cache->invalidate(ARG(0));
+		return incrResult(initid,result,length,value);
+	}
+	catch(circuit_open_error &){
+		return fallbackResult(initid,result,length,is_null);
+	}
+	catch(redis_error & e){
+		string errMsg(e);
+		return STATE_RESULT(errMsg);
+	}
+}
+
+extern "C" my_bool redis_hincrby_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+	return incr_udf_init(initid, args, message, 3, INT_RESULT,
+		"please input 3 args, such as: redis_hincrby('key', 'field', 1);");
+}
+
+extern "C" void redis_hincrby_deinit(UDF_INIT *initid)
+{
+	state_deinit(initid);
+}
+
+extern "C" char *redis_hincrby(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	if(!(args->args[0] && args->args[1] && args->args[2])){
+		*is_null = 1;
+		return result;
+	}
+	long long delta = *(long long *)args->args[2];
+	try{
+		if(counter_coalescing_enabled()){
+			redis_counters().add(RedisCounters::kind_hincrby, ARG(0), ARG(1), delta, 0);
+			RESULT(SUCCESS);
+			return result;
+		}
+		int_type value = 0;
+		for(key_route route(initid,ARG(0));route.next();){
+			try{ value = route.client().hincrby(ARG(0),ARG(1),delta); }
+			catch(redirect_error &){ route.follow(); }
+		}
+		if(RedisCache *cache = redis_cache())
+			cache->invalidate(ARG(0),ARG(1));
+		return incrResult(initid,result,length,value);
+	}
+	catch(circuit_open_error &){
+		return fallbackResult(initid,result,length,is_null);
+	}
+	catch(redis_error & e){
+		string errMsg(e);
+		return STATE_RESULT(errMsg);
+	}
+}
+
+extern "C" my_bool redis_hincrbyfloat_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+	return incr_udf_init(initid, args, message, 3, REAL_RESULT,
+		"please input 3 args, such as: redis_hincrbyfloat('key', 'field', 0.5);");
+}
+
+extern "C" void redis_hincrbyfloat_deinit(UDF_INIT *initid)
+{
+	state_deinit(initid);
+}
+
+extern "C" char *redis_hincrbyfloat(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	if(!(args->args[0] && args->args[1] && args->args[2])){
+		*is_null = 1;
+		return result;
+	}
+	double delta = *(double *)args->args[2];
+	try{
+		if(counter_coalescing_enabled()){
+			redis_counters().add(RedisCounters::kind_hincrbyfloat, ARG(0), ARG(1), 0, delta);
+			RESULT(SUCCESS);
+			return result;
+		}
+		string_type & value = STATE->reply;
+		for(key_route route(initid,ARG(0));route.next();){
+			try{ route.client().hincrbyfloat(ARG(0),ARG(1),delta,value); }
+			catch(redirect_error &){ route.follow(); }
+		}
+		if(RedisCache *cache = redis_cache())
+			cache->invalidate(ARG(0),ARG(1));
+		return STATE_RESULT(value);
+	}
+	catch(circuit_open_error &){
+		return fallbackResult(initid,result,length,is_null);
+	}
+	catch(redis_error & e){
+		string errMsg(e);
+		return STATE_RESULT(errMsg);
+	}
+}
+
+
+// Aggregate write UDFs, e.g.
+//
+//   SELECT redis_hset_agg(CONCAT('user:', id), 'name', name) FROM users;
+//
+// _add queues one command per row and flushes them every REDIS_AGG_BATCH
+// rows (default 500), as one pipeline per node sent to all nodes at once;
+// the group's result is a summary of how many commands succeeded and the
+// first error seen.
+
+static const size_t default_agg_batch = 500;
+
+static my_bool agg_init(UDF_INIT *initid, char *message)
+{
+	if(state_init(initid, message))
+		return 1;
+	const char *batch = getenv("REDIS_AGG_BATCH");
+	long n = batch ? atol(batch) : 0;
+	STATE->batch_size = n > 0 ? n : default_agg_batch;
+	initid->maybe_null = 0;
+	return 0;
+}
+
+static void agg_count_error(udf_state *state, unsigned long n, const string_type & msg)
+{
+	if(state->agg_errors == 0)
+		state->agg_error = msg;
+	state->agg_errors += n;
+}
+
+// Sends the queued rows.  A connection failure costs that node's share of
+// the batch, which is counted as failed; its next batch gets a fresh
+// connection.
+static void agg_flush(UDF_INIT *initid)
+{
+	udf_state *state = STATE;
+	if(state->queued == 0)
+		return;
+	size_t nodes = state->pipelines.size();
+	std::vector<size_t> sizes(nodes);
+	for(size_t n = 0;n < nodes;n++)
+		sizes[n] = state->pipelines[n].size();
+
+	state_clients clients(initid);
+	exec_routed(redis_shards(), clients, state->pipelines, state->pipeline_replies, state->pipeline_errors);
+	for(size_t n = 0;n < nodes;n++){
+		if(!state->pipeline_errors[n].empty()){
+			agg_count_error(state, sizes[n], state->pipeline_errors[n]);
+			continue;
+		}
+		const reply_vector & replies = state->pipeline_replies[n];
+		for(size_t i = 0;i < replies.size();i++){
+			if(replies[i].ok())
+				state->agg_ok++;
+			else
+				agg_count_error(state, 1, replies[i].str);
+		}
+	}
+	state->queued = 0;
+	if(RedisCache *cache = redis_cache()){
+		for(size_t i = 0;i < state->agg_keys.size();i++)
+			cache->invalidate(state->agg_keys[i]);
+		state->agg_keys.clear();
+	}
+}
+
+// The pipeline of the node that owns key.
+static RedisPipeline & agg_pipeline(UDF_INIT *initid, const string_ref & key)
+{
+	udf_state *state = STATE;
+	size_t node = redis_shards().node_for(key);
+	if(state->pipelines.size() <= node)
+		state->pipelines.resize(node + 1);
+	return state->pipelines[node];
+}
+
+static void agg_queued(UDF_INIT *initid, UDF_ARGS *args)
+{
+	if(redis_cache())
+		STATE->agg_keys.push_back(ARG(0).str());
+	if(++STATE->queued >= STATE->batch_size)
+		agg_flush(initid);
+}
+
+static void agg_clear(UDF_INIT *initid)
+{
+	udf_state *state = STATE;
+	for(size_t n = 0;n < state->pipelines.size();n++)
+		state->pipelines[n].clear();
+	state->queued = 0;
+	state->agg_keys.clear();
+	state->agg_ok = 0;
+	state->agg_errors = 0;
+	state->agg_error.clear();
+}
+
+static char *agg_result(UDF_INIT *initid, char *result, unsigned long *length)
+{
+	agg_flush(initid);
+	udf_state *state = STATE;
+	char summary[64];
+	snprintf(summary, sizeof(summary), "%lu ok, %lu errors", state->agg_ok, state->agg_errors);
+	string_type & ret = state->reply;
+	ret.assign(summary);
+	if(state->agg_errors > 0){
+		ret += "; first error: ";
+		ret += state->agg_error;
+	}
+	return STATE_RESULT(ret);
+}
+
+static void agg_string_args(UDF_ARGS *args)
+{
+	for(unsigned int i = 0;i < args->arg_count;i++)
+		args->arg_type[i] = STRING_RESULT;
+}
+
+// redis_hset_agg(key, field, value)
+
+extern "C" my_bool redis_hset_agg_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (3 != args->arg_count){
+        strncpy(message, "please input 3 args, such as: redis_hset_agg('key', 'field', 'value');", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    agg_string_args(args);
+    return agg_init(initid, message);
+}
+
+extern "C" void redis_hset_agg_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" void redis_hset_agg_clear(UDF_INIT *initid, char *is_null, char *error)
+{
+    agg_clear(initid);
+}
+
+extern "C" void redis_hset_agg_add(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+	if(!(args->args[0] && args->args[1] && args->args[2])){
+		agg_count_error(STATE, 1, "null argument");
+		return;
+	}
+	agg_pipeline(initid, ARG(0)).command("HSET", ARG(0), ARG(1), VALUE(2));
+	agg_queued(initid, args);
+}
+
+extern "C" char *redis_hset_agg(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	return agg_result(initid, result, length);
+}
+
+// redis_set_agg(key, value)
+
+extern "C" my_bool redis_set_agg_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (2 != args->arg_count){
+        strncpy(message, "please input 2 args, such as: redis_set_agg('key', 'value');", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    agg_string_args(args);
+    return agg_init(initid, message);
+}
+
+extern "C" void redis_set_agg_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" void redis_set_agg_clear(UDF_INIT *initid, char *is_null, char *error)
+{
+    agg_clear(initid);
+}
+
+extern "C" void redis_set_agg_add(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+	if(!(args->args[0] && args->args[1])){
+		agg_count_error(STATE, 1, "null argument");
+		return;
+	}
+	agg_pipeline(initid, ARG(0)).command("SET", ARG(0), VALUE(1));
+	agg_queued(initid, args);
+}
+
+extern "C" char *redis_set_agg(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	return agg_result(initid, result, length);
+}
+
+// redis_hmset_agg(key, field1, value1, ...)
+
+extern "C" my_bool redis_hmset_agg_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (args->arg_count < 3 || args->arg_count % 2 == 0){
+        strncpy(message, "please input a key and field/value pairs, such as: redis_hmset_agg('key', id1, value1, ...);", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    agg_string_args(args);
+    return agg_init(initid, message);
+}
+
+extern "C" void redis_hmset_agg_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" void redis_hmset_agg_clear(UDF_INIT *initid, char *is_null, char *error)
+{
+    agg_clear(initid);
+}
+
+extern "C" void redis_hmset_agg_add(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+	if(!args->args[0]){
+		agg_count_error(STATE, 1, "null key");
+		return;
+	}
+	string_ref_vector & argv = STATE->fields;
+	argv.resize(args->arg_count + 1);
+	argv[0] = "HMSET";
+	for(unsigned int i = 0;i < args->arg_count;i++)
+		argv[i + 1] = i > 0 && i % 2 == 0 ? VALUE(i) : ARG(i);
+	agg_pipeline(initid, ARG(0)).command(argv);
+	agg_queued(initid, args);
+}
+
+extern "C" char *redis_hmset_agg(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	return agg_result(initid, result, length);
+}
+
+// redis_del_agg(key)
+
+extern "C" my_bool redis_del_agg_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (1 != args->arg_count){
+        strncpy(message, "please input 1 arg, such as: redis_del_agg('key');", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    agg_string_args(args);
+    return agg_init(initid, message);
+}
+
+extern "C" void redis_del_agg_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" void redis_del_agg_clear(UDF_INIT *initid, char *is_null, char *error)
+{
+    agg_clear(initid);
+}
+
+extern "C" void redis_del_agg_add(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *error)
+{
+	if(!args->args[0]){
+		agg_count_error(STATE, 1, "null key");
+		return;
+	}
+	agg_pipeline(initid, ARG(0)).command("DEL", ARG(0));
+	agg_queued(initid, args);
+}
+
+extern "C" char *redis_del_agg(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	return agg_result(initid, result, length);
+}
+
+
+// redis_flush(): waits until every write queued in write-behind mode and
+// every coalesced increment from before the call has reached Redis.
+// Returns SUCCESS, or the number of writes that failed since the previous
+// flush and the last error.
+
+extern "C" my_bool redis_flush_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (0 != args->arg_count){
+        strncpy(message, "redis_flush() takes no arguments", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    return state_init(initid, message);
+}
+
+extern "C" void redis_flush_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" char *redis_flush(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	string_type last_error;
+	unsigned long failed = 0;
+	if(write_behind_enabled())
+		failed += write_behind().flush(last_error);
+	if(counter_coalescing_enabled()){
+		string_type counter_error;
+		unsigned long counter_failed = redis_counters().flush(counter_error);
+		if(counter_failed){
+			failed += counter_failed;
+			last_error.swap(counter_error);
+		}
+	}
+	if(failed == 0){
+		RESULT(SUCCESS);
+		return result;
+	}
+	char summary[64];
+	snprintf(summary, sizeof(summary), "%lu writes failed: ", failed);
+	string_type & ret = STATE->reply;
+	ret.assign(summary);
+	ret += last_error;
+	return STATE_RESULT(ret);
+}
+
+
+// redis_cache_stats(): hit/miss/invalidation counters of the read cache as
+// JSON, or NULL when the cache is off.
+
+extern "C" my_bool redis_cache_stats_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (0 != args->arg_count){
+        strncpy(message, "redis_cache_stats() takes no arguments", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    initid->maybe_null = 1;
+    return state_init(initid, message);
+}
+
+extern "C" void redis_cache_stats_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" char *redis_cache_stats(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	RedisCache *cache = redis_cache();
+	if(!cache){
+		*is_null = 1;
+		return result;
+	}
+	RedisCache::counters c = cache->stats();
+	char json[256];
+	int len = snprintf(json, sizeof(json),
+		"{\"hits\":%llu,\"misses\":%llu,\"invalidations\":%llu,\"evictions\":%llu,\"entries\":%llu,\"bytes\":%llu}",
+		(unsigned long long)c.hits, (unsigned long long)c.misses, (unsigned long long)c.invalidations,
+		(unsigned long long)c.evictions, (unsigned long long)c.entries, (unsigned long long)c.bytes);
+	return stateResult(initid, result, length, json, len);
+}
+
+
+// redis_breaker_status(): circuit breaker of every node as a JSON array,
+// e.g. [{"node":"10.0.0.1:6379","state":"open","trips":1,...}], or NULL when
+// REDIS_BREAKER is off.
+
+extern "C" my_bool redis_breaker_status_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (0 != args->arg_count){
+        strncpy(message, "redis_breaker_status() takes no arguments", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    initid->maybe_null = 1;
+    initid->max_length = max_result_length;
+    return state_init(initid, message);
+}
+
+extern "C" void redis_breaker_status_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" char *redis_breaker_status(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	RedisShards & shards = redis_shards();
+	if(!shards.pool(0).breaker().enabled()){
+		*is_null = 1;
+		return result;
+	}
+	string_type & ret = STATE->reply;
+	ret.assign("[");
+	for(size_t i = 0;i < shards.size();i++){
+		const RedisNode & node = shards.node(i);
+		CircuitBreaker::counters c = shards.pool(i).breaker().stats();
+		char json[320];
+		snprintf(json, sizeof(json),
+			"%s{\"node\":\"%s:%u\",\"state\":\"%s\",\"trips\":%llu,\"rejected\":%llu,"
+			"\"window_calls\":%llu,\"window_failures\":%llu,\"open_ms\":%llu}",
+			i ? "," : "", node.host.c_str(), node.port, CircuitBreaker::state_name(c.state),
+			(unsigned long long)c.trips, (unsigned long long)c.rejected,
+			(unsigned long long)c.window_calls, (unsigned long long)c.window_failures,
+			(unsigned long long)c.open_ms);
+		ret += json;
+	}
+	ret += "]";
+	return STATE_RESULT(ret);
+}
+
+
+// redis_stats(): the plugin's metrics since load or the last
+// redis_stats_reset(), as one JSON object:
+//
+//   {"seconds":12.5,"live_threads":8,
+//    "commands":{"GET":{"calls":1000,"errors":0,"avg_us":61.2,"p50_us":55,
+//                       "p90_us":79,"p99_us":143,"p999_us":319,"max_us":1151},...},
+//    "io":{"bytes_sent":...,"bytes_received":...,"syscalls":...,
+//          "syscalls_per_call":2.1,"connects":8,"connect_failures":0},
+//    "pipeline":{"round_trips":...,"commands":...,"commands_per_round_trip":...},
+//    "cache":{"hits":...,"misses":...,"hit_ratio":...,...},
+//    "counters":{"increments":...,"commands":...,"increments_per_command":...,"pending":...},
+//    "compression":{"threshold":4096,"values":...,"bytes_in":...,"bytes_out":...,
+//                   "ratio":3.2,"compress_us":...,"inflated":...,"inflated_bytes":...,
+//                   "decompress_us":...},
+//    "replicas":{"hedges":...,"hedge_wins":...}}
+//
+// Commands that were never called are left out; cache and counters are
+// null when the cache or counter coalescing is off.  NULL when
+// REDIS_STATS=0.
+
+extern "C" my_bool redis_stats_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (0 != args->arg_count){
+        strncpy(message, "redis_stats() takes no arguments", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    initid->maybe_null = 1;
+    initid->max_length = max_result_length;
+    return state_init(initid, message);
+}
+
+extern "C" void redis_stats_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" char *redis_stats(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	if(!stats_enabled){
+		*is_null = 1;
+		return result;
+	}
+	stats_totals t = stats_snapshot();
+	string_type & ret = STATE->reply;
+	char json[512];
+	snprintf(json, sizeof(json), "{\"seconds\":%.1f,\"live_threads\":%lu,\"commands\":{",
+		(monotonic_ms() - t.since_ms) / 1000.0, (unsigned long)t.threads);
+	ret.assign(json);
+
+	boost::uint64_t calls = 0;
+	bool first = true;
+	for(int c = 0;c < stat_command_count;c++){
+		const stats_totals::per_command & cmd = t.commands[c];
+		if(cmd.calls == 0)
+			continue;
+		calls += cmd.calls;
+		snprintf(json, sizeof(json),
+			"%s\"%s\":{\"calls\":%llu,\"errors\":%llu,\"avg_us\":%.1f,\"p50_us\":%llu,"
+			"\"p90_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu}",
+			first ? "" : ",", stat_command_name(static_cast<stat_command>(c)),
+			(unsigned long long)cmd.calls, (unsigned long long)cmd.errors,
+			double(cmd.total_us) / cmd.calls, cmd.percentile(0.50), cmd.percentile(0.90),
+			cmd.percentile(0.99), cmd.percentile(0.999), cmd.percentile(1.0));
+		ret += json;
+		first = false;
+	}
+
+	snprintf(json, sizeof(json),
+		"},\"io\":{\"bytes_sent\":%llu,\"bytes_received\":%llu,\"syscalls\":%llu,"
+		"\"syscalls_per_call\":%.2f,\"connects\":%llu,\"connect_failures\":%llu},"
+		"\"pipeline\":{\"round_trips\":%llu,\"commands\":%llu,\"commands_per_round_trip\":%.1f},",
+		(unsigned long long)t.bytes_sent, (unsigned long long)t.bytes_received,
+		(unsigned long long)t.syscalls, calls ? double(t.syscalls) / calls : 0.0,
+		(unsigned long long)t.connects, (unsigned long long)t.connect_failures,
+		(unsigned long long)t.pipelines, (unsigned long long)t.pipelined,
+		t.pipelines ? double(t.pipelined) / t.pipelines : 0.0);
+	ret += json;
+
+	RedisCache *cache = redis_cache();
+	if(cache){
+		RedisCache::counters c = cache->stats();
+		boost::uint64_t lookups = c.hits + c.misses;
+		snprintf(json, sizeof(json),
+			"\"cache\":{\"hits\":%llu,\"misses\":%llu,\"hit_ratio\":%.3f,\"invalidations\":%llu,"
+			"\"evictions\":%llu,\"entries\":%llu,\"bytes\":%llu},",
+			(unsigned long long)c.hits, (unsigned long long)c.misses,
+			lookups ? double(c.hits) / lookups : 0.0, (unsigned long long)c.invalidations,
+			(unsigned long long)c.evictions, (unsigned long long)c.entries, (unsigned long long)c.bytes);
+		ret += json;
+	}
+	else
+		ret += "\"cache\":null,";
+
+	if(counter_coalescing_enabled()){
+		RedisCounters::counters c = redis_counters().stats();
+		snprintf(json, sizeof(json),
+			"\"counters\":{\"increments\":%llu,\"commands\":%llu,\"increments_per_command\":%.1f,\"pending\":%llu},",
+			(unsigned long long)c.increments, (unsigned long long)c.commands,
+			c.commands ? double(c.increments) / c.commands : 0.0, (unsigned long long)c.pending);
+		ret += json;
+	}
+	else
+		ret += "\"counters\":null,";
+
+	// ratio is over every value considered, including those stored as they
+	// were because deflating them did not pay
+	snprintf(json, sizeof(json),
+		"\"compression\":{\"threshold\":%lu,\"values\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+		"\"ratio\":%.2f,\"compress_us\":%llu,\"inflated\":%llu,\"inflated_bytes\":%llu,"
+		"\"decompress_us\":%llu},",
+		(unsigned long)compress_threshold, (unsigned long long)t.compressed,
+		(unsigned long long)t.compress_in, (unsigned long long)t.compress_out,
+		t.compress_out ? double(t.compress_in) / t.compress_out : 0.0,
+		(unsigned long long)t.compress_us, (unsigned long long)t.decompressed,
+		(unsigned long long)t.decompress_out, (unsigned long long)t.decompress_us);
+	ret += json;
+
+	RedisShards & shards = redis_shards();
+	boost::uint64_t hedges = 0, hedge_wins = 0;
+	for(size_t i = 0;i < shards.size();i++)
+		if(ReplicaSet *replicas = shards.replicas(i)){
+			hedges += replicas->hedges();
+			hedge_wins += replicas->hedge_wins();
+		}
+	snprintf(json, sizeof(json), "\"replicas\":{\"hedges\":%llu,\"hedge_wins\":%llu}}",
+		(unsigned long long)hedges, (unsigned long long)hedge_wins);
+	ret += json;
+	return STATE_RESULT(ret);
+}
+
+// redis_stats_reset(): starts redis_stats() over from zero.  Cache,
+// coalesced counter and replica figures are not reset.
+
+extern "C" my_bool redis_stats_reset_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (0 != args->arg_count){
+        strncpy(message, "redis_stats_reset() takes no arguments", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    return state_init(initid, message);
+}
+
+extern "C" void redis_stats_reset_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" char *redis_stats_reset(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	stats_reset();
+	RESULT(SUCCESS);
+	return result;
+}
+
+
+// redis_slowlog([count]): the slow log, newest first, as a JSON array of
+// at most count entries (default all):
+//
+//   [{"id":42,"time_ms":1760601234567,"thread_id":3141,"command":"HMGET",
+//     "ok":true,"key":"user:1001","key_bytes":9,"reply_bytes":18342,
+//     "total_us":12873,"connect_us":0,"wait_us":12650,"parse_us":223},...]
+//
+// thread_id is the OS thread id of the MySQL connection, which is
+// performance_schema.threads.THREAD_OS_ID.  key holds at most 64 bytes of
+// the key; it is empty for pipelines and admin commands.
+
+extern "C" my_bool redis_slowlog_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (args->arg_count > 1){
+        strncpy(message, "redis_slowlog() takes at most 1 arg, the number of entries", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    if (args->arg_count == 1)
+        args->arg_type[0] = INT_RESULT;
+    initid->max_length = max_result_length;
+    return state_init(initid, message);
+}
+
+extern "C" void redis_slowlog_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" char *redis_slowlog(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	size_t max = ~size_t(0);
+	if(args->arg_count == 1 && args->args[0]){
+		long long count = *(long long *)args->args[0];
+		max = count > 0 ? static_cast<size_t>(count) : 0;
+	}
+	std::vector<slowlog_entry> entries;
+	slowlog_entries(entries, max);
+
+	string_type & ret = STATE->reply;
+	ret.assign("[");
+	char json[512];
+	for(size_t i = 0;i < entries.size();i++){
+		const slowlog_entry & e = entries[i];
+		snprintf(json, sizeof(json),
+			"%s{\"id\":%llu,\"time_ms\":%llu,\"thread_id\":%lu,\"command\":\"%s\",\"ok\":%s,\"key\":",
+			i ? "," : "", (unsigned long long)e.id, (unsigned long long)e.time_ms, e.thread_id,
+			stat_command_name(e.command), e.ok ? "true" : "false");
+		ret += json;
+		json_string(ret, e.key, e.key_len);
+		snprintf(json, sizeof(json),
+			",\"key_bytes\":%lu,\"reply_bytes\":%lu,\"total_us\":%llu,\"connect_us\":%llu,"
+			"\"wait_us\":%llu,\"parse_us\":%llu}",
+			(unsigned long)e.key_bytes, (unsigned long)e.reply_bytes,
+			e.connect_us + e.wait_us + e.parse_us, e.connect_us, e.wait_us, e.parse_us);
+		ret += json;
+	}
+	ret += "]";
+	return STATE_RESULT(ret);
+}
+
+// redis_slowlog_reset(): empties the slow log.
+
+extern "C" my_bool redis_slowlog_reset_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+    if (0 != args->arg_count){
+        strncpy(message, "redis_slowlog_reset() takes no arguments", MYSQL_ERRMSG_SIZE);
+        return -1;
+    }
+    return state_init(initid, message);
+}
+
+extern "C" void redis_slowlog_reset_deinit(UDF_INIT *initid)
+{
+    state_deinit(initid);
+}
+
+extern "C" char *redis_slowlog_reset(UDF_INIT *initid, UDF_ARGS *args, char *result, unsigned long *length, char *is_null, char *error)
+{
+	slowlog_reset();
+	RESULT(SUCCESS);
+	return result;
+}
@@ -0,0 +1,298 @@
+#include "redis_writer.h"
+#include "redis_shard.h"
+#include "redis_cache.h"
+
+#include <cstdlib>
+#include <set>
+#include <utility>
+#include <boost/thread/once.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+RedisWriteBehind::RedisWriteBehind(RedisShards & shards, size_t capacity, size_t batch, full_policy policy)
+  : shards_(shards), queue_(capacity), batch_(batch), policy_(policy),
+    pushed_(0), done_(0), dropped_(0), sleeping_(false), stop_(false), errors_(0)
+{
+  thread_ = boost::thread(&RedisWriteBehind::run_, this);
+}
+
+RedisWriteBehind::~RedisWriteBehind()
+{
+  // The flusher drains the queue before it notices stop_.
+  stop_ = true;
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    wake_.notify_one();
+  }
+  thread_.join();
+}
+
+bool RedisWriteBehind::push(write_op * op)
+{
+  // Counted before it is queued, so a flush() that starts once this op is
+  // in the queue always waits for it.  A dropped op counts as done.
+  ++pushed_;
+  while (!queue_.bounded_push(op))
+  {
+    if (policy_ == policy_drop)
+    {
+      delete op;
+      ++dropped_;
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      ++done_;
+      drained_.notify_all();
+      return false;
+    }
+    // Backpressure: let the flusher catch up.
+    boost::this_thread::sleep(boost::posix_time::microseconds(50));
+  }
+
+  if (sleeping_.load())
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    wake_.notify_one();
+  }
+  return true;
+}
+
+unsigned long RedisWriteBehind::flush(string_type & last_error)
+{
+  boost::uint64_t target = pushed_.load();
+
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  wake_.notify_one();
+  while (done_.load() < target)
+    drained_.timed_wait(lock, boost::posix_time::milliseconds(100));
+
+  unsigned long errors = errors_;
+  last_error.swap(last_error_);
+  last_error_.clear();
+  errors_ = 0;
+  return errors;
+}
+
+void RedisWriteBehind::fail_(unsigned long n, const string_type & error)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  errors_ += n;
+  last_error_ = error;
+}
+
+void RedisWriteBehind::run_()
+{
+  std::vector<write_op *> batch;
+  batch.reserve(batch_);
+
+  for (;;)
+  {
+    write_op * op;
+    while (batch.size() < batch_ && queue_.pop(op))
+      batch.push_back(op);
+
+    if (!batch.empty())
+    {
+      send_(batch);
+      continue;
+    }
+    if (stop_)
+      break;
+
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    sleeping_ = true;
+    if (queue_.empty() && !stop_)
+      wake_.timed_wait(lock, boost::posix_time::milliseconds(10));
+    sleeping_ = false;
+  }
+}
+
+// Drops writes that a later write in the same batch overwrites anyway:
+// SET and DEL replace the whole key, HSET/HMSET replace single fields.
+// Walks the batch backwards so the newest write of each target survives.
+// Returns the number of ops removed from the batch.
+
+size_t RedisWriteBehind::coalesce_(std::vector<write_op *> & batch)
+{
+  std::set<string_type> whole;
+  std::set<std::pair<string_type, string_type> > fields;
+  size_t kept = batch.size();
+
+  for (size_t i = batch.size(); i-- > 0; )
+  {
+    write_op * op = batch[i];
+    bool drop = whole.count(op->key) > 0;
+
+    if (!drop)
+    {
+      switch (op->kind)
+      {
+      case write_op::op_set:
+      case write_op::op_del:
+        whole.insert(op->key);
+        break;
+      case write_op::op_hset:
+      case write_op::op_hmset:
+        {
+          size_t n = 0;
+          for (size_t f = 0; f < op->fields.size(); ++f)
+          {
+            if (!fields.insert(std::make_pair(op->key, op->fields[f])).second)
+              continue;
+            if (n != f)
+            {
+              op->fields[n].swap(op->fields[f]);
+              op->values[n].swap(op->values[f]);
+            }
+            ++n;
+          }
+          op->fields.resize(n);
+          op->values.resize(n);
+          drop = (n == 0);
+        }
+        break;
+      }
+    }
+
+    if (drop)
+    {
+      delete op;
+      batch[i] = NULL;
+      --kept;
+    }
+  }
+  return batch.size() - kept;
+}
+
+void RedisWriteBehind::send_(std::vector<write_op *> & batch)
+{
+  size_t total = batch.size();
+  coalesce_(batch);
+
+  std::vector<RedisPipeline> pipelines;
+  string_ref_vector argv;
+  for (size_t i = 0; i < batch.size(); ++i)
+  {
+    write_op * op = batch[i];
+    if (!op)
+      continue;
+    size_t node = shards_.node_for(op->key);
+    if (node >= pipelines.size())
+      pipelines.resize(node + 1);
+    RedisPipeline & pipeline = pipelines[node];
+    switch (op->kind)
+    {
+    case write_op::op_set:
+      pipeline.command("SET", op->key, op->values[0]);
+      break;
+    case write_op::op_del:
+      pipeline.command("DEL", op->key);
+      break;
+    case write_op::op_hset:
+    case write_op::op_hmset:
+      if (op->fields.size() == 1)
+        pipeline.command("HSET", op->key, op->fields[0], op->values[0]);
+      else
+      {
+        argv.clear();
+        argv.push_back("HMSET");
+        argv.push_back(op->key);
+        for (size_t f = 0; f < op->fields.size(); ++f)
+        {
+          argv.push_back(op->fields[f]);
+          argv.push_back(op->values[f]);
+        }
+        pipeline.command(argv);
+      }
+      break;
+    }
+  }
+
+  // These writes are idempotent, so a node's batch lost to a dead
+  // connection is retried once on a fresh one.
+  std::vector<reply_vector> replies;
+  string_vector errors;
+  std::vector<RedisPipeline> retry = pipelines;    // sending consumes them
+  for (int attempt = 0; attempt < 2; ++attempt)
+  {
+    {
+      PooledClients clients(shards_);
+      exec_routed(shards_, clients, pipelines, replies, errors);
+    }
+
+    bool again = false;
+    for (size_t n = 0; n < pipelines.size(); ++n)
+    {
+      if (errors[n].empty())
+      {
+        for (size_t i = 0; i < replies[n].size(); ++i)
+          if (!replies[n][i].ok())
+            fail_(1, replies[n][i].str);
+      }
+      else if (attempt > 0)
+        fail_(retry[n].size(), errors[n]);
+      else
+      {
+        pipelines[n] = retry[n];
+        again = true;
+      }
+    }
+    if (!again)
+      break;
+  }
+
+  // Readers may have cached the old value while the write was queued.
+  RedisCache * cache = redis_cache();
+  for (size_t i = 0; i < batch.size(); ++i)
+  {
+    if (cache && batch[i])
+      cache->invalidate(batch[i]->key);
+    delete batch[i];
+  }
+  batch.clear();
+
+  done_ += total;
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  drained_.notify_all();
+}
+
+bool write_behind_enabled()
+{
+  static int enabled = -1;
+  if (enabled < 0)
+  {
+    const char * value = getenv("REDIS_WRITE_BEHIND");
+    enabled = (value && atoi(value) != 0) ? 1 : 0;
+  }
+  return enabled == 1;
+}
+
+static RedisWriteBehind * global_writer_ = NULL;
+static boost::once_flag global_writer_once_ = BOOST_ONCE_INIT;
+
+static void create_global_writer()
+{
+  const char * capacity = getenv("REDIS_WRITE_BEHIND_QUEUE");
+  const char * batch    = getenv("REDIS_WRITE_BEHIND_BATCH");
+  const char * policy   = getenv("REDIS_WRITE_BEHIND_POLICY");
+
+  long n = capacity ? atol(capacity) : 0;
+  if (n <= 0 || n > 65534)
+    n = 65534;
+  long b = batch ? atol(batch) : 0;
+  if (b <= 0)
+    b = 500;
+  RedisWriteBehind::full_policy p = (policy && std::string(policy) == "drop")
+    ? RedisWriteBehind::policy_drop : RedisWriteBehind::policy_block;
+
+  global_writer_ = new RedisWriteBehind(redis_shards(), n, b, p);
+}
+
+void stop_write_behind()
+{
+  delete global_writer_;
+  global_writer_ = NULL;
+}
+
+RedisWriteBehind & write_behind()
+{
+  boost::call_once(global_writer_once_, create_global_writer);
+  return *global_writer_;
+}
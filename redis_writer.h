@@ -0,0 +1,92 @@
+#ifndef _REDIS_WRITER_H
+#define _REDIS_WRITER_H
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "redis_client.h"
+
+class RedisShards;
+
+// One queued write.  Owns copies of its arguments since the UDF's argument
+// buffers are gone by the time the flusher gets to it.
+
+struct write_op
+{
+  enum op_kind { op_set, op_hset, op_hmset, op_del };
+
+  op_kind       kind;
+  string_type   key;
+  string_vector fields;    // hset: one field, hmset: all of them
+  string_vector values;    // set: one value, hset/hmset: one per field
+};
+
+// Write-behind mode for the write UDFs (REDIS_WRITE_BEHIND=1).
+//
+// UDFs push writes onto a bounded lock-free queue and return immediately.
+// A single background thread drains it in batches, drops writes that a
+// later write in the same batch makes redundant, and sends the rest as one
+// pipeline per node.  When the queue is full push() either waits for room or drops
+// the write, per REDIS_WRITE_BEHIND_POLICY (block, the default, or drop).
+
+class RedisWriteBehind : private boost::noncopyable
+{
+public:
+  enum full_policy { policy_block, policy_drop };
+
+  RedisWriteBehind(RedisShards & shards, size_t capacity, size_t batch, full_policy policy);
+  ~RedisWriteBehind();
+
+  // Takes ownership of op.  Returns false if it was dropped because the
+  // queue was full.
+  bool          push(write_op * op);
+
+  // Blocks until everything pushed before the call has been sent.  Returns
+  // the number of failed writes since the previous flush and the last
+  // error message seen.
+  unsigned long flush(string_type & last_error);
+
+  unsigned long dropped() const { return dropped_.load(boost::memory_order_relaxed); }
+
+private:
+  void          run_();
+  size_t        coalesce_(std::vector<write_op *> & batch);
+  void          send_(std::vector<write_op *> & batch);
+  void          fail_(unsigned long n, const string_type & error);
+
+  RedisShards &                   shards_;
+  boost::lockfree::queue<write_op *, boost::lockfree::fixed_sized<true> > queue_;
+  size_t                          batch_;
+  full_policy                     policy_;
+
+  boost::atomic<boost::uint64_t>  pushed_;
+  boost::atomic<boost::uint64_t>  done_;
+  boost::atomic<unsigned long>    dropped_;
+  boost::atomic<bool>             sleeping_;
+  boost::atomic<bool>             stop_;
+
+  boost::mutex                    mutex_;
+  boost::condition_variable       wake_;      // flusher waits for work
+  boost::condition_variable       drained_;   // flush() waits for the flusher
+  unsigned long                   errors_;
+  string_type                     last_error_;
+
+  boost::thread                   thread_;
+};
+
+// True when REDIS_WRITE_BEHIND is set to a non-zero value.
+bool               write_behind_enabled();
+
+// Process-wide write-behind queue over redis_shards(), started on first use.
+RedisWriteBehind & write_behind();
+
+// Drains the queue and joins the flusher.  Called once, when the plugin is
+// unloaded.
+void               stop_write_behind();
+
+#endif